@@ -0,0 +1,32 @@
+-- Applies highlights sent by the tag-highlight server in packed form.
+--
+-- `clears` is a flat array of (first, last) line ranges to clear before anything is
+-- added. `data` is a flat array of (line, start_col, end_col, group) quadruples,
+-- where group is a zero based index into `groups`.
+
+local M = {}
+
+local api = vim.api
+
+function M.apply(bufnr, ns, clears, groups, data)
+    if not api.nvim_buf_is_loaded(bufnr) then
+        return
+    end
+
+    for i = 1, #clears, 2 do
+        api.nvim_buf_clear_namespace(bufnr, ns, clears[i], clears[i + 1])
+    end
+
+    local set_extmark = api.nvim_buf_set_extmark
+    local opts        = {}
+
+    for i = 1, #data, 4 do
+        opts.end_col  = data[i + 2]
+        opts.hl_group = groups[data[i + 3] + 1]
+        -- The buffer may have changed since the highlights were computed, in which
+        -- case some positions are out of range. Those are simply dropped.
+        pcall(set_extmark, bufnr, ns, data[i], data[i + 1], opts)
+    end
+end
+
+return M
@@ -51,6 +51,22 @@ call s:InitVar('no_autoconf', 1)
 call s:InitVar('recursive',   1)
 call s:InitVar('verbose',     0)
 call s:InitVar('run_ctags',   0)
+call s:InitVar('debounce_ms', 100)
+call s:InitVar('packed_highlights', has('nvim-0.5'))
+" Saves the AST of every C/C++ file opened, for a faster first highlight next time.
+" Each one holds everything the file includes (easily 100MB with Qt or Boost), and
+" is written out right after the file's first full parse, which delays the next
+" update of that buffer. The least recently used are deleted past the size limit.
+call s:InitVar('clang_ast_cache',   1)
+call s:InitVar('clang_ast_cache_mb', 2048)
+call s:InitVar('clang_memory_budget', 2048)
+call s:InitVar('clang_skeleton_kb',   64)
+call s:InitVar('clang_workers',       0)
+call s:InitVar('clang_worker_max_mb', 4096)
+call s:InitVar('atomic_chunk_calls',  2048)
+call s:InitVar('atomic_chunk_kb',     256)
+call s:InitVar('atomic_pipeline',     2)
+call s:InitVar('atomic_yield_usec',   0)
 
 " People often make annoying #defines for C and C++ keywords, types, etc. Avoid
 " highlighting these by default, leaving the built in vim highlighting intact.
@@ -378,8 +394,19 @@ let s:msg_types = {
             \         'ClearBuffer':     5,
             \         'Stop':            6,
             \         'Exit':            7,
+            \         'ConfigChanged':   8,
+            \         'Viewport':        9,
             \     }
 
+" The server caches the per-filetype group settings, so tell it when any of them
+" change. Only keys of the form tag_highlight#allbut, tag_highlight#<ft>#allbut
+" and tag_highlight#<ft>#<kind> matter.
+function! s:ConfigChanged(dict, key, change)
+    if a:key =~# '\v^tag_highlight#(allbut|\w+#(\a|allbut))$'
+        call s:SendMessage('ConfigChanged')
+    endif
+endfunction
+
 function! s:NewBuf()
     if g:tag_highlight#pid > 0
         let l:buf = nvim_get_current_buf()
@@ -420,6 +447,21 @@ function! s:SendMessage(msg)
     endif
 endfunction
 
+" Tell the server which lines of a buffer are on screen so that they can be
+" highlighted before the rest of the file.
+function! s:ViewportChanged(winid)
+    if g:tag_highlight#pid > 0
+        let l:buf = winbufnr(a:winid)
+        if index(s:new_bufs, l:buf) != (-1)
+            try
+                call rpcnotify(g:tag_highlight#pid, 'vim_event_update', s:msg_types['Viewport'],
+                             \ l:buf, line('w0', a:winid) - 1, line('w$', a:winid))
+            catch /.*/
+            endtry
+        endif
+    endif
+endfunction
+
 function! s:DeleteBuf()
     let l:buf = nvim_get_current_buf()
     let l:ind = index(s:new_bufs, l:buf)
@@ -516,8 +558,14 @@ augroup TagHighlightAu
     autocmd BufDelete * call s:DeleteBuf()
     autocmd VimLeavePre * call s:SendMessage('Exit')
     autocmd Syntax * call s:SendMessage('SyntaxChanged')
+    autocmd BufWinEnter,WinEnter * call s:ViewportChanged(win_getid())
+    if exists('##WinScrolled')
+        autocmd WinScrolled * call s:ViewportChanged(str2nr(expand('<amatch>')))
+    endif
 augroup END
 
+call dictwatcheradd(g:, 'tag_highlight#*', function('s:ConfigChanged'))
+
 "===============================================================================
 
 let g:tag_highlight#loaded = 1
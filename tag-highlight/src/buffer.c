@@ -1,6 +1,7 @@
 #include "Common.h"
 #include "highlight.h"
 #include "lang/golang/golang.h"
+#include "lang/lang.h"
 
 /* #include "buffers.h" */
 #include <signal.h>
@@ -22,6 +23,9 @@
 #define DOSCHECK(CH_) (false)
 #endif
 
+/* Number of lines either side of the visible ones that are treated as visible. */
+#define VIEWPORT_MARGIN (50)
+
 #define CTX buffer_talloc_ctx_
 void        *buffer_talloc_ctx_ = NULL;
 linked_list *buffer_list;
@@ -75,6 +79,7 @@ static inline bool         should_skip_buffer(bstring const *ft) __attribute__((
 static inline buffer_node *new_buffer_node(unsigned bufnum);
 static buffer_node        *find_buffer_node(unsigned bufnum);
 static Buffer             *make_new_buffer(buffer_node *bnode);
+static Buffer             *make_bufdata(unsigned bufnum, Filetype *ft, bstring *fullname);
 
 Buffer *
 new_buffer(unsigned const bufnum)
@@ -105,10 +110,19 @@ make_new_buffer(buffer_node *bnode)
             return NULL;
       }
 
+      /* Everything needed to set up the buffer is requested up front so that
+       * the whole lot costs a single round trip. */
+      nvim_future *futs[] = {
+            nvim_buf_get_option_async(bnode->num, B("ft")),
+            nvim_buf_get_name_async(bnode->num),
+            nvim_buf_get_changedtick_async(bnode->num),
+      };
+
       bnode->isopen    = true;
       Buffer   *ret    = NULL;
       Filetype *ft     = NULL;
-      bstring  *ftname = nvim_buf_get_option(bnode->num, B("ft"), E_STRING).ptr;
+      bstring  *ftname = nvim_future_await(futs[0], E_STRING).ptr;
+      futs[0] = NULL;
       if (!ftname || ftname->slen == 0)
             goto error;
 
@@ -120,16 +134,20 @@ make_new_buffer(buffer_node *bnode)
       }
 
       if (ft && !should_skip_buffer(ftname)) {
-            bnode->bdata = ret = get_bufdata(bnode->num, ft);
+            bnode->bdata = ret = make_bufdata(bnode->num, ft, nvim_buf_get_name_await(futs[1]));
+            futs[1] = NULL;
             if (!ret)
                   goto error;
             talloc_steal(bnode, ret);
             talloc_set_destructor(ret, destroy_buffer_wrapper);
-            unsigned tmp = nvim_buf_get_changedtick(ret->num);
+            unsigned tmp = (unsigned)nvim_future_await(futs[2], E_NUM).num;
+            futs[2] = NULL;
             p99_futex_init(&ret->ctick, tmp);
       }
 
 error:
+      /* Collect any responses we ended up not needing. */
+      nvim_future_await_all((unsigned)ARRSIZ(futs), futs, E_NUM, NULL);
       talloc_free(ftname);
       pthread_rwlock_unlock(bnode->lock);
       return ret;
@@ -185,12 +203,18 @@ static inline void init_buffer_mutexes(Buffer *bdata);
 
 Buffer *
 get_bufdata(unsigned const bufnum, Filetype *ft)
+{
+      return make_bufdata(bufnum, ft, nvim_buf_get_name(bufnum));
+}
+
+static Buffer *
+make_bufdata(unsigned const bufnum, Filetype *ft, bstring *fullname)
 {
       Buffer *bdata    = talloc_zero(CTX, Buffer);
-      bdata->name.full = nvim_buf_get_name(bufnum);
+      bdata->name.full = fullname;
       bdata->name.base = b_basename(bdata->name.full);
       bdata->name.path = b_dirname(bdata->name.full);
-      bdata->lines     = ll_make_new(bdata);
+      bdata->lines     = ls_create(bdata);
       bdata->num       = bufnum;
       bdata->ft        = ft;
       bdata->topdir    = init_topdir(bdata); // Topdir init must be the last step.
@@ -230,13 +254,22 @@ init_buffer_mutexes(Buffer *bdata)
             pthread_mutex_init(&bdata->lock.total, &attr);
             pthread_mutex_init(&bdata->lock.lang_mtx, &attr);
             pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
+            pthread_mutex_init(&bdata->lock.sched_mtx, &attr);
+            pthread_mutex_init(&bdata->lock.hl_mtx, &attr);
+            pthread_mutex_init(&bdata->hl_send.mtx, &attr);
+            pthread_cond_init(&bdata->hl_send.cond, NULL);
+            pthread_mutex_init(&bdata->lock.lines_mtx, &attr);
 #ifndef _WIN32
             pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
 #endif
       }
 
-      p99_count_init((p99_count *)&bdata->lock.hl_waiters, 0);
       p99_count_init((p99_count *)&bdata->lock.num_workers, 0);
+      bdata->sched.dirty_tick = 0;
+      bdata->sched.running    = false;
+      bdata->sched.dirty      = false;
+      bdata->dirty.first      = (-1);
+      bdata->dirty.last       = (-1);
       p99_futex_init(&bdata->ctick, 0);
       p99_futex_init(&bdata->ctick, 0);
 }
@@ -268,15 +301,184 @@ have_seen_bufnum(unsigned const bufnum)
 void
 get_initial_lines(Buffer *bdata)
 {
-      pthread_mutex_lock(&bdata->lock.total);
-      b_list *tmp = nvim_buf_get_lines(bdata->num);
-      if (bdata->lines->qty == 1)
-            ll_delete_node(bdata->lines, bdata->lines->head);
-      ll_insert_blist_after(bdata->lines, bdata->lines->head, tmp, 0, (-1));
+      uint32_t tick;
+
+      /* Not under `lock.lines_mtx': the event loop takes it for every line event
+       * and has to keep going to deliver the reply. Line events that come in
+       * meanwhile are queued, and those newer than the lines read are applied
+       * afterwards. */
+      b_list    *tmp  = nvimext_buf_get_lines_ticked(bdata->num, &tick);
+      bool const have = tmp != NULL;
+
+      pthread_mutex_lock(&bdata->lock.lines_mtx);
+      if (have) {
+            ls_splice(bdata->lines, 0, bdata->lines->qty, tmp);
+            if (bdata->lines->qty == 0)
+                  ls_append(bdata->lines, b_create(0));
+            atomic_store(&bdata->lines_tick, tick);
+            talloc_free(tmp);
+      }
+
+      for (struct line_event *ev = bdata->pending.head, *next; ev; ev = next) {
+            next = ev->next;
+            /* An event without a tick can't be placed, so it is dropped, unless
+             * there is nothing better to apply it to. */
+            if (!have || (ev->tick != 0 && (int32_t)(ev->tick - tick) > 0))
+                  buffer_apply_line_event(bdata, ev);
+            talloc_free(ev);
+      }
+      bdata->pending.head = bdata->pending.tail = NULL;
+      bdata->dirty.first  = bdata->dirty.last = (-1);
 
-      talloc_free(tmp);
       atomic_store(&bdata->initialized, true);
-      pthread_mutex_unlock(&bdata->lock.total);
+      pthread_mutex_unlock(&bdata->lock.lines_mtx);
+}
+
+/*
+ * The visible lines of the buffer plus some margin either side, clamped to the
+ * buffer. Returns false if no viewport has been reported yet.
+ */
+bool
+buffer_viewport(Buffer *bdata, int *first, int *last)
+{
+      int const vfirst = atomic_load_explicit(&bdata->viewport.first, memory_order_relaxed);
+      int const vlast  = atomic_load_explicit(&bdata->viewport.last, memory_order_relaxed);
+
+      pthread_mutex_lock(&bdata->lock.lines_mtx);
+      int const nlines = (int)bdata->lines->qty;
+      pthread_mutex_unlock(&bdata->lock.lines_mtx);
+
+      if (vlast <= vfirst)
+            return false;
+
+      *first = MAXOF(vfirst - VIEWPORT_MARGIN, 0);
+      *last  = MINOF(vlast + VIEWPORT_MARGIN, nlines);
+      return *first < *last;
+}
+
+struct buffer_snapshot *
+(buffer_snapshot)(Buffer *bdata, void *talloc_ctx, int const first, int const last)
+{
+      struct buffer_snapshot *snap = talloc(talloc_ctx, struct buffer_snapshot);
+
+      pthread_mutex_lock(&bdata->lock.lines_mtx);
+      snap->text   = ls_text(bdata->lines, snap);
+      snap->ctick  = atomic_load(&bdata->lines_tick);
+      snap->nlines = bdata->lines->qty;
+      if (last < 0) {
+            snap->start = 0;
+            snap->end   = snap->text->slen;
+      } else {
+            snap->start = ls_line_offset(bdata->lines, (unsigned)first);
+            snap->end   = ls_line_offset(bdata->lines, (unsigned)last + 1U);
+      }
+      snap->dirty_first  = bdata->dirty.first;
+      snap->dirty_last   = bdata->dirty.last;
+      bdata->dirty.first = bdata->dirty.last = (-1);
+      pthread_mutex_unlock(&bdata->lock.lines_mtx);
+
+      return snap;
+}
+
+/*
+ * Record a line event that replaced the lines [first, last) with `num_new' lines.
+ * The range already recorded is moved to follow the edit and then merged with the
+ * new lines. A pure deletion marks the line that the following text moved onto.
+ * Must be called with `lock.lines_mtx' held, after `lines' has been updated.
+ */
+void
+buffer_mark_dirty(Buffer *bdata, int const first, int const last, int const num_new)
+{
+      int const delta = num_new - (last - first);
+      int const end   = MINOF(first + MAXOF(num_new, 1), (int)bdata->lines->qty);
+      int       dfirst, dlast;
+
+      if (bdata->dirty.first < 0) {
+            dfirst = first;
+            dlast  = end;
+      } else {
+            dfirst = bdata->dirty.first;
+            dlast  = bdata->dirty.last;
+
+            if (dfirst >= last)
+                  dfirst += delta;
+            else if (dfirst > first)
+                  dfirst = first;
+            if (dlast >= last)
+                  dlast += delta;
+            else if (dlast > first)
+                  dlast = end;
+
+            dfirst = MINOF(dfirst, first);
+            dlast  = MAXOF(dlast, end);
+      }
+
+      /* Deleting the end of the buffer leaves nothing at `first'. */
+      dfirst             = MINOF(dfirst, (int)bdata->lines->qty - 1);
+      bdata->dirty.first = dfirst;
+      bdata->dirty.last  = MAXOF(MINOF(dlast, (int)bdata->lines->qty), dfirst + 1);
+}
+
+/*
+ * Apply a line event to `lines' and keep the dirty range and the record of applied
+ * highlights in step with it. Returns true if the event was the useless one that
+ * neovim sends for an empty buffer. Must be called with `lock.lines_mtx' held.
+ */
+bool
+buffer_apply_line_event(Buffer *bdata, struct line_event const *ev)
+{
+      int const first   = ev->first;
+      int const last    = ev->last;
+      int const num_new = ev->strings ? (int)ev->strings->qty : 0;
+      bool      empty   = false;
+
+      /*
+       * NOTE: For some reason neovim sometimes sends updates with an empty
+       *       list in which both the first and last line are the same. God
+       *       knows what this is supposed to indicate. I'll just ignore them.
+       */
+
+      if (num_new) {
+            if (last == (-1)) {
+                  /* An "initial" update, recieved only if asked for when attaching
+                   * to a buffer. We never ask for this, so this shouldn't occur. */
+                  errx(1, "Got initial update somehow...");
+            }
+            else if (bdata->lines->qty <= 1 && first == 0 && /* Empty buffer... */
+                     num_new == 1 &&                         /* with one string... */
+                     ev->strings->lst[0]->slen == 0          /* which is emtpy. */)
+            {
+                  /* Useless update, one empty string in an empty buffer. */
+                  empty = true;
+            }
+            else {
+                  /* The lines [first, last) are replaced by whatever we were sent,
+                   * which covers insertion (first == last) and any mixture of
+                   * replacing and deleting. */
+                  ls_splice(bdata->lines, first, last, ev->strings);
+            }
+      } else if (first != last) {
+            /* If the replacement list is empty then we're just deleting lines. */
+            ls_splice(bdata->lines, first, last, NULL);
+      }
+
+      /* Neovim always considers there to be at least one line in any buffer.
+       * An empty buffer therefore must have one empty line. */
+      if (bdata->lines->qty == 0)
+            ls_append(bdata->lines, b_create(0));
+
+      /* The tick goes first: a batch that is sent while the record is being shifted
+       * must already look stale, or it would be diffed against the shifted record. */
+      if (ev->tick != 0)
+            atomic_store(&bdata->lines_tick, ev->tick);
+
+      /* Keep the record of applied highlights lined up with neovim's extmarks. */
+      if (!empty && bdata->ft->has_parser && (num_new || first != last)) {
+            buffer_mark_dirty(bdata, first, last, num_new);
+            hl_applied_shift_lines(bdata, first, last, num_new);
+      }
+
+      return empty;
 }
 
 void
@@ -299,7 +501,7 @@ static Top_Dir *check_open_topdirs(Buffer const *bdata, bstring const *base);
 static void     get_tag_filename(bstring *gzfile, bstring const *base, Buffer *bdata);
 
 static inline void ensure_cache_directory(char const *dir);
-static inline void set_vim_tags_opt(char const *fname);
+static inline void set_vim_tags_opt(nvim_future *oldval_fut, char const *fname);
 
 /*
  * This struct is primarily for filetypes that use ctags. It is convenient to run the
@@ -326,7 +528,8 @@ init_topdir(Buffer *bdata)
 
       SHOUT("Initializing project directory \"%s\"", BS(dir));
 
-      bstring *tnam = nvim_call_function(B("tempname"), E_STRING).ptr;
+      nvim_future *tags_fut = nvim_get_option_async(B("tags"));
+      bstring     *tnam     = nvim_future_await(nvim_call_function_async(B("tempname")), E_STRING).ptr;
       bstring *cdir = b_strcpy(settings.cache_dir);
 
       tdir = talloc_zero(CTX, Top_Dir);
@@ -348,7 +551,7 @@ init_topdir(Buffer *bdata)
 
       /* Make sure the ctags cache directory exists. */
       ensure_cache_directory(BS(settings.cache_dir));
-      set_vim_tags_opt(BS(tdir->tmpfname));
+      set_vim_tags_opt(tags_fut, BS(tdir->tmpfname));
       get_tag_filename(tdir->gzfile, base, bdata);
       ll_append(top_dirs, tdir);
       if (!recurse)
@@ -443,10 +646,10 @@ ensure_cache_directory(char const *dir)
 }
 
 static inline void
-set_vim_tags_opt(char const *fname)
+set_vim_tags_opt(nvim_future *oldval_fut, char const *fname)
 {
       char     buf[2048];
-      bstring *oldval = nvim_get_option(B("tags"), E_STRING).ptr;
+      bstring *oldval = nvim_future_await(oldval_fut, E_STRING).ptr;
 
       int n = snprintf(buf, 2048, "%s,%s", BS(oldval), fname);
 
@@ -536,10 +739,11 @@ check_project_directories(bstring *dir, Filetype const *ft)
  * \--------------------------------------/
  *=====================================================================================*/
 
-static void      get_ignored_tags(Filetype *ft);
+static void      get_ignored_tags(Filetype *ft, nvim_future *restored_fut);
 static void      get_tags_from_restored_groups(Filetype *ft, b_list *restored_groups);
 static bstring * get_restore_cmds(b_list *restored_groups);
 static cmd_info *get_cmd_info(Filetype *ft);
+static bstring  *get_allbut(nvim_future *global_fut, nvim_future *ft_fut);
 
 /*
  * Populate the non-static portions of the filetype structure, including a list of
@@ -552,8 +756,14 @@ init_filetype(Filetype *ft)
             return;
       pthread_mutex_lock(&ftdata_mutex);
 
+      nvim_future *order_fut    = nvimext_get_var_fmt_async(PKG "%s#order", BTS(ft->vim_name));
+      nvim_future *restored_fut = nvim_get_var_async(B(PKG "restored_groups"));
+      nvim_future *equiv_fut    = nvimext_get_var_fmt_async(PKG "%s#equivalent", BTS(ft->vim_name));
+      nvim_future *allbut_fut   = nvim_get_var_async(B(PKG "allbut"));
+      nvim_future *ftallbut_fut = nvimext_get_var_fmt_async(PKG "%s#allbut", BTS(ft->vim_name));
+
       ft->initialized = true;
-      ft->order = nvimext_get_var_fmt(E_STRING, PKG "%s#order", BTS(ft->vim_name)).ptr;
+      ft->order = nvim_future_await(order_fut, E_STRING).ptr;
       mpack_array *tmp =
           mpack_dict_get_key(settings.ignored_tags, E_MPACK_ARRAY, &ft->vim_name).ptr;
 
@@ -571,9 +781,9 @@ init_filetype(Filetype *ft)
       }
 
       ft->restore_cmds = NULL;
-      get_ignored_tags(ft);
+      get_ignored_tags(ft, restored_fut);
 
-      mpack_dict *equiv = nvimext_get_var_fmt(E_MPACK_DICT, PKG "%s#equivalent", BTS(ft->vim_name)).ptr;
+      mpack_dict *equiv = nvim_future_await(equiv_fut, E_MPACK_DICT).ptr;
       if (equiv) {
             ft->equiv = b_list_create_alloc(equiv->qty);
 
@@ -592,18 +802,45 @@ init_filetype(Filetype *ft)
             ft->equiv = NULL;
       }
 
+      ft->allbut   = talloc_steal(ft, get_allbut(allbut_fut, ftallbut_fut));
       ft->cmd_info = get_cmd_info(ft);
       talloc_steal(ft, ft->cmd_info);
 
       pthread_mutex_unlock(&ftdata_mutex);
 }
 
+/*
+ * Called when the plugin reports that one of the group, prefix, suffix or allbut
+ * variables changed. The previous tables may still be in use by a highlighting
+ * thread, so they are left attached to the filetype rather than freed. Changes
+ * like this are rare enough that this costs nothing in practice.
+ */
+void
+reload_filetype_config(void)
+{
+      pthread_mutex_lock(&ftdata_mutex);
+
+      for (unsigned i = 0; i < ftdata_len; ++i) {
+            Filetype *ft = ftdata[i];
+            if (!ft->initialized || !ft->order)
+                  continue;
+
+            nvim_future *allbut_fut   = nvim_get_var_async(B(PKG "allbut"));
+            nvim_future *ftallbut_fut = nvimext_get_var_fmt_async(PKG "%s#allbut", BTS(ft->vim_name));
+
+            ft->allbut   = talloc_steal(ft, get_allbut(allbut_fut, ftallbut_fut));
+            ft->cmd_info = talloc_steal(ft, get_cmd_info(ft));
+      }
+
+      pthread_mutex_unlock(&ftdata_mutex);
+}
+
 /*--------------------------------------------------------------------------------------*/
 
 static void
-get_ignored_tags(Filetype *ft)
+get_ignored_tags(Filetype *ft, nvim_future *restored_fut)
 {
-      mpack_dict *tmp = nvim_get_var(B(PKG "restored_groups"), E_MPACK_DICT).ptr;
+      mpack_dict *tmp = nvim_future_await(restored_fut, E_MPACK_DICT).ptr;
       b_list *    restored_groups = mpack_dict_get_key(tmp, E_STRLIST, &ft->vim_name).ptr;
 
       if (restored_groups) {
@@ -746,23 +983,53 @@ get_cmd_info(Filetype *ft)
 {
       unsigned const   ngroups = ft->order->slen;
       struct cmd_info *info    = talloc_array(NULL, struct cmd_info, ngroups);
+      nvim_future     *futs[ngroups + 1];
+      mpack_retval     dicts[ngroups + 1];
+
+      /* There is one variable per kind; fetch them all in one go. */
+      for (unsigned i = 0; i < ngroups; ++i)
+            futs[i] = nvimext_get_var_fmt_async(PKG "%s#%c", BTS(ft->vim_name), ft->order->data[i]);
+      nvim_future_await_all(ngroups, futs, E_MPACK_DICT, dicts);
 
       for (unsigned i = 0; i < ngroups; ++i) {
-            int const   ch = ft->order->data[i];
-            mpack_dict *dict = nvimext_get_var_fmt(E_MPACK_DICT, PKG "%s#%c",
-                                                   BTS(ft->vim_name), ch).ptr;
+            int const   ch   = ft->order->data[i];
+            mpack_dict *dict = dicts[i].ptr;
 
-            info[i].kind  = ch;
-            info[i].group = mpack_dict_get_key(dict, E_STRING, B("group")).ptr;
-            info[i].num   = ngroups;
+            info[i].kind   = ch;
+            info[i].group  = mpack_dict_get_key(dict, E_STRING, B("group")).ptr;
+            info[i].prefix = mpack_dict_get_key(dict, E_STRING, B("prefix")).ptr;
+            info[i].suffix = mpack_dict_get_key(dict, E_STRING, B("suffix")).ptr;
+            info[i].num    = ngroups;
 
             talloc_steal(info, info[i].group);
+            if (info[i].prefix)
+                  talloc_steal(info, info[i].prefix);
+            if (info[i].suffix)
+                  talloc_steal(info, info[i].suffix);
             talloc_free(dict);
       }
 
       return info;
 }
 
+static bstring *
+get_allbut(nvim_future *global_fut, nvim_future *ft_fut)
+{
+      bstring *global_allbut = nvim_future_await(global_fut, E_STRING).ptr;
+      bstring *ft_allbut     = nvim_future_await(ft_fut, E_STRING).ptr;
+
+      if (ft_allbut) {
+            if (global_allbut) {
+                  b_append_all(global_allbut, B(","), ft_allbut);
+                  b_free(ft_allbut);
+            } else {
+                  global_allbut = ft_allbut;
+            }
+      }
+
+      return global_allbut;
+}
+
 /*--------------------------------------------------------------------------------------
  * /===========\
  * |Destructors|
@@ -791,6 +1058,7 @@ void
 
       unsigned cnt;
       atomic_store(&bdata->initialized, false);
+      unschedule_highlight(bdata);
       while ((cnt = p99_futex_load(&bdata->lock.num_workers)) > 0) {
             (void)cnt;
             usleep(1);
@@ -814,6 +1082,7 @@ void
       }
 
       if (bdata->ft->is_c) {
+            destroy_clangdata(bdata);
             if (bdata->headers)
                   TALLOC_FREE(bdata->headers);
       } else if (bdata->ft->id == FT_GO) {
@@ -827,6 +1096,11 @@ void
       /* pthread_mutex_destroy(&bdata->lock.total); */
       pthread_mutex_unlock(&bdata->lock.lang_mtx);
       pthread_mutex_destroy(&bdata->lock.lang_mtx);
+      pthread_mutex_destroy(&bdata->lock.sched_mtx);
+      pthread_mutex_destroy(&bdata->lock.hl_mtx);
+      pthread_mutex_destroy(&bdata->hl_send.mtx);
+      pthread_cond_destroy(&bdata->hl_send.cond);
+      pthread_mutex_destroy(&bdata->lock.lines_mtx);
 
       //p99_futex_wakeup(&destruction_futex[bdata->num]);
       if (flags & DES_BUF_TALLOC_FREE) {
@@ -85,7 +85,7 @@ get_initial_taglist(Buffer *bdata)
                               b_write(top->tmpfd, top->tags->lst[i], B("\n"));
                   } else {
                         warnd("Could not read file. Running ctags.");
-                        warnd("linecount -> %d", bdata->lines->qty);
+                        warnd("linecount -> %u", bdata->lines->qty);
                         goto force_ctags;
                   }
             }
@@ -2,7 +2,9 @@
 #include "events.h"
 #include "highlight.h"
 #include "lang/clang/clang.h"
+#include "lang/lang.h"
 #include "nvim_api/wait_node.h"
+#include "util/thread_pool.h"
 
 #include "contrib/p99/p99_atomic.h"
 
@@ -10,11 +12,6 @@
 
 /*--------------------------------------------------------------------------------------*/
 
-struct message_args {
-      mpack_obj *obj;
-      int fd;
-};
-
 const event_id event_list[] = {
       { BT("nvim_buf_lines_event"),       EVENT_BUF_LINES },
       { BT("nvim_buf_changedtick_event"), EVENT_BUF_CHANGED_TICK },
@@ -27,6 +24,8 @@ p99_futex volatile       event_loop_futex = P99_FUTEX_INITIALIZER(0);
 static pthread_mutex_t   handle_mutex;
 static pthread_mutex_t   nvim_event_handler_mutex;
 P99_FIFO(event_node_ptr) nvim_event_queue;
+thread_pool             *thl_worker_pool  = NULL;
+static thread_pool      *autocmd_pool     = NULL;
 
 #define CTX event_handlers_talloc_ctx_
 void *event_handlers_talloc_ctx_ = NULL;
@@ -42,10 +41,26 @@ static void event_handlers_initializer(void)
       p99_futex_init((p99_futex *)&event_loop_futex, 0);
 }
 
+void
+init_thread_pools(void)
+{
+      thl_worker_pool = thread_pool_create(MAXOF(find_num_cpus(), 4U), "worker");
+      /* Autocmds are handled one at a time, in order, on a thread of their own.
+       * Handling one can mean waiting on tasks in the worker pool (destroy_buffer()
+       * waits for the buffer's parses), so they mustn't occupy its threads. */
+      autocmd_pool    = thread_pool_create(1, "autocmd");
+}
+
+void
+report_thread_pool_stats(void)
+{
+      if (thl_worker_pool)
+            thread_pool_report_stats(thl_worker_pool);
+      if (autocmd_pool)
+            thread_pool_report_stats(autocmd_pool);
+}
+
 extern void exit_cleanup(void);
-extern NORETURN void *highlight_go_pthread_wrapper(void *vdata);
-static NORETURN void *wrap_update_highlight(void *vdata);
-static NORETURN void *wrap_handle_nvim_response(void *wrapper);
 static void           handle_nvim_response(mpack_obj *obj, int fd);
 static void           handle_nvim_notification(mpack_obj *event);
 
@@ -54,6 +69,7 @@ static void           handle_nvim_notification(mpack_obj *event);
 /*======================================================================================*/
 
 static void handle_buffer_update(Buffer *bdata, mpack_array *arr, event_idp type);
+static bool handle_viewport_update(mpack_array *arr);
 static bool check_mutex_consistency(pthread_mutex_t *mtx, int val, const char *msg);
 
 static bool      handle_line_event(Buffer *bdata, mpack_array *arr);
@@ -73,13 +89,10 @@ handle_nvim_message(struct event_data *data)
             handle_nvim_notification(obj);
             break;
       }
-      case MES_RESPONSE: {
-            struct message_args *tmp = malloc(sizeof(struct message_args));
-            tmp->obj = obj;
-            tmp->fd  = fd;
-            START_DETACHED_PTHREAD(wrap_handle_nvim_response, tmp);
+      case MES_RESPONSE:
+            /* Routing a response is a single lookup, so just do it here. */
+            handle_nvim_response(obj, fd);
             break;
-      }
       case MES_REQUEST:
             errx(1, "Recieved request in %s somehow. This should be "
                     "\"impossible\"?\n", FUNC_NAME);
@@ -89,11 +102,10 @@ handle_nvim_message(struct event_data *data)
       }
 }
 
-static void *
-destroy_buffer_thread(void *vdata)
+static void
+destroy_buffer_task(void *vdata)
 {
       destroy_buffer(vdata, DES_BUF_SHOULD_CLEAR | DES_BUF_DESTROY_NODE | DES_BUF_TALLOC_FREE);
-      pthread_exit();
 }
 
 static void
@@ -104,10 +116,14 @@ handle_nvim_notification(mpack_obj *event)
       event_idp    type = id_event(event);
 
       if (type->id == EVENT_VIM_UPDATE) {
-            /* It's hard to think of a more pointless use of the `sizeof' operator. */
-            uint64_t *tmp = malloc(sizeof(uint64_t));
-            *tmp          = mpack_expect(arr->lst[0], E_NUM).num;
-            START_DETACHED_PTHREAD(event_autocmd, tmp);
+            /* Viewport reports arrive on every scroll and are cheap to handle, so
+             * they don't go through the worker pool. */
+            if (!handle_viewport_update(arr)) {
+                  /* It's hard to think of a more pointless use of the `sizeof' operator. */
+                  uint64_t *tmp = malloc(sizeof(uint64_t));
+                  *tmp          = mpack_expect(arr->lst[0], E_NUM).num;
+                  thread_pool_submit(autocmd_pool, event_autocmd, tmp);
+            }
       } else {
             int const bufnum = mpack_expect(arr->lst[0], E_NUM).num;
             Buffer   *bdata  = find_buffer(bufnum);
@@ -123,7 +139,7 @@ handle_nvim_notification(mpack_obj *event)
                   break;
             case EVENT_BUF_DETACH:
                   echo("Detaching from buffer %d", bufnum);
-                  START_DETACHED_PTHREAD(destroy_buffer_thread, bdata);
+                  thread_pool_submit(thl_worker_pool, destroy_buffer_task, bdata);
                   break;
             default:
                   abort();
@@ -143,44 +159,24 @@ handle_buffer_update(Buffer *bdata, mpack_array *arr, event_idp type)
       if (type->id == EVENT_BUF_LINES) {
             handle_line_event(bdata, arr);
             if (bdata->ft->has_parser)
-                  START_DETACHED_PTHREAD(wrap_update_highlight, bdata);
+                  schedule_highlight(bdata);
       }
 }
 
 /*--------------------------------------------------------------------------------------*/
 
-static NORETURN void *
-wrap_handle_nvim_response(void *wrapper)
-{
-      mpack_obj *obj = ((struct message_args *)wrapper)->obj;
-      int        fd  = ((struct message_args *)wrapper)->fd;
-      free(wrapper);
-      handle_nvim_response(obj, fd);
-      pthread_exit(NULL);
-}
-
 static void
-handle_nvim_response(mpack_obj *obj, int fd)
+handle_nvim_response(mpack_obj *obj, UNUSED int fd)
 {
       unsigned const  count = mpack_expect(mpack_index(obj, 1), E_NUM).num;
-      nvim_wait_node *node  = NULL;
-
-      if (fd == 0)
-            ++fd;
-
-      for (;;) {
-            /* There's a potential race between the waiting thread pushing its node
-             * to the stack and our arrival, so we cycle through the queue and even
-             * wait if necessary. */
-            node = P99_FIFO_POP(&nvim_wait_queue);
-            if (node) {
-                  if (node->fd == fd && node->count == count)
-                        break;
-                  P99_FIFO_APPEND(&nvim_wait_queue, node);
-            } else {
-                  /* Nothing is in the queue at all. 5ms smoke break. */
-                  clock_nanosleep_for(0, UINTMAX_C(5000));
-            }
+      nvim_wait_node *node  = nvim_wait_node_take(count);
+
+      /* Waiters register before their request is written, so this can only mean
+       * neovim sent a response to something we never asked for. */
+      if (!node) {
+            warnx("Received response to unknown request %u.", count);
+            talloc_free(obj);
+            return;
       }
 
       atomic_store_explicit(&node->obj, obj, memory_order_seq_cst);
@@ -230,10 +226,6 @@ check_mutex_consistency(UNUSED pthread_mutex_t *mtx, int val, const char *const
 
 /*--------------------------------------------------------------------------------------*/
 
-static inline void replace_line(Buffer *bdata, b_list *new_strings, int lineno, int index);
-static inline void
-line_event_multi_op(Buffer *bdata, b_list *new_strings, int first, int num_to_modify);
-
 static bool
 handle_line_event(Buffer *bdata, mpack_array *arr)
 {
@@ -245,145 +237,37 @@ handle_line_event(Buffer *bdata, mpack_array *arr)
             errx(1, "Error: Continuation condition is unexpectedly true, "
                     "cannot continue.");
 
-      pthread_mutex_lock(&bdata->lock.total);
-
-      int const first     = mpack_expect(arr->lst[2], E_NUM, true).num;
-      int const last      = mpack_expect(arr->lst[3], E_NUM, true).num;
-      int const diff      = last - first;
-      bool      empty     = false;
-      b_list *new_strings = mpack_expect(arr->lst[4], E_STRLIST, true).ptr;
-
-      /*
-       * NOTE: For some reason neovim sometimes sends updates with an empty
-       *       list in which both the first and last line are the same. God
-       *       knows what this is supposed to indicate. I'll just ignore them.
-       */
-
-      if (new_strings->qty) {
-            if (last == (-1)) {
-                  /* An "initial" update, recieved only if asked for when attaching
-                   * to a buffer. We never ask for this, so this shouldn't occur. */
-                  errx(1, "Got initial update somehow...");
-            }
-            else if (bdata->lines->qty <= 1 && first == 0 && /* Empty buffer... */
-                     new_strings->qty == 1 &&                /* with one string... */
-                     new_strings->lst[0]->slen == 0          /* which is emtpy. */)
-            {
-                  /* Useless update, one empty string in an empty buffer. */
-                  empty = true;
-            }
-            else if (first == 0 && last == 0) {
-                  /* Inserting above the first line in the file. */
-                  ll_insert_blist_before_at(bdata->lines, first, new_strings, 0, (-1));
-            }
-            else {
-                  /* The most common scenario: we recieved at least one string which
-                   * may be empty only if the buffer is not empty. Moved to a helper
-                   * function for clarity. */
-                  line_event_multi_op(bdata, new_strings, first, diff);
-            }
-      } else if (first != last) {
-            /* If the replacement list is empty then we're just deleting lines. */
-            ll_delete_range_at(bdata->lines, first, diff);
+      struct line_event ev = {
+            .next    = NULL,
+            .tick    = (uint32_t)mpack_expect(arr->lst[1], E_NUM, false, E_MPACK_NIL).num,
+            .first   = (int)mpack_expect(arr->lst[2], E_NUM, true).num,
+            .last    = (int)mpack_expect(arr->lst[3], E_NUM, true).num,
+            .strings = mpack_expect(arr->lst[4], E_STRLIST, true).ptr,
+      };
+      bool empty = false;
+
+      pthread_mutex_lock(&bdata->lock.lines_mtx);
+
+      if (!atomic_load(&bdata->initialized)) {
+            /* get_initial_lines() is still waiting for the lines; it decides
+             * whether this edit is already part of them. */
+            struct line_event *queued = talloc(bdata, struct line_event);
+            *queued = ev;
+            talloc_steal(queued, ev.strings);
+            if (bdata->pending.tail)
+                  bdata->pending.tail->next = queued;
+            else
+                  bdata->pending.head = queued;
+            bdata->pending.tail = queued;
+      } else {
+            empty = buffer_apply_line_event(bdata, &ev);
+            talloc_free(ev.strings);
       }
 
-      /* Neovim always considers there to be at least one line in any buffer.
-       * An empty buffer therefore must have one empty line. */
-      if (bdata->lines->qty == 0)
-            ll_append(bdata->lines, b_create(0));
-
-      if (!bdata->initialized && !empty)
-            bdata->initialized = true;
-
-      talloc_free(new_strings);
-      pthread_mutex_unlock(&bdata->lock.total);
+      pthread_mutex_unlock(&bdata->lock.lines_mtx);
       return empty;
 }
 
-static inline void
-replace_line(Buffer *bdata, b_list *new_strings, int const lineno, int const index)
-{
-      pthread_mutex_lock(&bdata->lines->lock);
-      ll_node *node = ll_at(bdata->lines, lineno);
-      talloc_free(node->data);
-      node->data = talloc_move(node, &new_strings->lst[index]);
-      pthread_mutex_unlock(&bdata->lines->lock);
-}
-
-/*
- * first:         Index of the first string to replace in the buffer (if any)
- * num_to_modify: Number of existing buffer lines to replace and/or delete
- *
- * Handles a neovim line update event in which we received at least one string in a
- * buffer that is not empty. If diff is non-zero, we first delete the lines in the range
- * `first + diff`, and then insert the new line(s) after `first` if it is now the last
- * line in the file, and before it otherwise.
- */
-static inline void
-line_event_multi_op(Buffer *bdata, b_list *new_strings, int const first, int num_to_modify)
-{
-      int const num_new   = (int)new_strings->qty;
-      int const num_lines = MAXOF(num_to_modify, num_new);
-      int const olen      = bdata->lines->qty;
-
-      /* This loop is only meaningful when replacing lines.
-       * All other paths break after the first iteration. */
-      for (int i = 0; i < num_lines; ++i) {
-            int const index = first + i;
-            if (num_to_modify-- > 0 && i < olen) {
-                  /* There are still strings to be modified. If we still have a
-                   * replacement available then we use it. Otherwise we are instead
-                   * deleting a range of lines. */
-                  if (i < num_new) {
-                        replace_line(bdata, new_strings, index, i);
-                  } else {
-                        ll_delete_range_at(bdata->lines, index, num_to_modify + 1);
-                        break;
-                  }
-            } else {
-                  /* There are no more strings to be modified and there is one or
-                   * more strings remaining in the list. These are to be inserted
-                   * into the buffer.
-                   * If the first line to insert (first + i) is at the end of the
-                   * file then we append it, otherwise we prepend. */
-                  if ((first + i) >= bdata->lines->qty)
-                        ll_insert_blist_after_at(bdata->lines, index,
-                                                 new_strings, i, (-1));
-                  else
-                        ll_insert_blist_before_at(bdata->lines, index,
-                                                  new_strings, i, (-1));
-                  break;
-            }
-      }
-}
-
-
-/*
- * This just tries to address the fact that under the current scheme in which only a
- * limited number of threads will be allowed to wait for a chance to update, it's
- * possible to fail to update for the last handful of changes. This waiting thread should
- * hopefully belatedly fix the situation.
- */
-static NORETURN void *
-delayed_update_highlight(void *vdata)
-{
-      /* Sleep for 1 & 1/2 seconds. */
-      NANOSLEEP_FOR_SECOND_FRACTION(1, 1, 2);
-      update_highlight(vdata);
-      pthread_exit();
-}
-
-static NORETURN void *
-wrap_update_highlight(void *vdata)
-{
-      Buffer *bdata = vdata;
-      if (p99_futex_add(&bdata->lock.hl_waiters, 1U) == 0)
-            START_DETACHED_PTHREAD(delayed_update_highlight, bdata);
-      update_highlight(vdata);
-      p99_futex_add(&bdata->lock.hl_waiters, -(1U));
-      pthread_exit();
-}
-
 /*======================================================================================*/
 /*
  * Handle an update from the small vimscript plugin. Updates are recieved upon
@@ -404,7 +288,9 @@ P99_DECLARE_ENUM(vimscript_message_type, int,
                  VIML_UPDATE_TAGS_FORCE,
                  VIML_CLEAR_BUFFER,
                  VIML_STOP,
-                 VIML_EXIT
+                 VIML_EXIT,
+                 VIML_CONFIG_CHANGED,
+                 VIML_VIEWPORT
                  );
 P99_DEFINE_ENUM(vimscript_message_type);
 
@@ -415,6 +301,7 @@ static void event_force_update(void);
 static NORETURN void event_stop(void);
 static NORETURN void event_exit(void);
 static void attach_new_buffer(int num);
+static void set_initial_viewport(Buffer *bdata, nvim_future *fut);
 
 extern void global_previous_buffer_set(int num);
 extern int  global_previous_buffer_get(void);
@@ -429,7 +316,7 @@ void autocmd_constructor(void)
 
 /*--------------------------------------------------------------------------------------*/
 
-NORETURN void *
+void
 event_autocmd(void *vdata)
 {
       pthread_mutex_lock(&autocmd_mutex);
@@ -479,12 +366,41 @@ event_autocmd(void *vdata)
             clear_highlight();
             break;
 
+      case VIML_CONFIG_CHANGED:
+            /* A highlight group, prefix, suffix or allbut variable changed. The new
+             * values take effect on the next update. */
+            reload_filetype_config();
+            break;
+
       default:
             break;
       }
 
       pthread_mutex_unlock(&autocmd_mutex);
-      pthread_exit();
+}
+
+/*
+ * The plugin reports [bufnr, first, last] along with VIML_VIEWPORT whenever a window
+ * scrolls. Returns false if `arr' is some other message.
+ */
+static bool
+handle_viewport_update(mpack_array *arr)
+{
+      if (mpack_expect(arr->lst[0], E_NUM, false).num != VIML_VIEWPORT)
+            return false;
+      if (arr->qty < 4)
+            return true;
+
+      Buffer *bdata = find_buffer((unsigned)mpack_expect(arr->lst[1], E_NUM, false).num);
+      if (bdata) {
+            atomic_store_explicit(&bdata->viewport.first,
+                                  (int)mpack_expect(arr->lst[2], E_NUM, false).num,
+                                  memory_order_relaxed);
+            atomic_store_explicit(&bdata->viewport.last,
+                                  (int)mpack_expect(arr->lst[3], E_NUM, false).num,
+                                  memory_order_relaxed);
+      }
+      return true;
 }
 
 void
@@ -631,9 +547,14 @@ attach_new_buffer(int const num)
 
       if (bdata) {
             TIMER_START(&t);
-            nvim_buf_attach(num);
-
+            /* Neovim answers in order, so the lines can be requested before
+             * the attach has been acknowledged without missing any update. The
+             * buffer is in the current window, which gives the first viewport. */
+            nvim_future *attach   = nvim_buf_attach_async(num);
+            nvim_future *viewport = nvim_eval_async(B("[line('w0') - 1, line('w$')]"));
             get_initial_lines(bdata);
+            nvim_future_discard(attach);
+            set_initial_viewport(bdata, viewport);
             get_initial_taglist(bdata);
             update_highlight(bdata, HIGHLIGHT_UPDATE);
             settings.buffer_initialized = true;
@@ -643,3 +564,20 @@ attach_new_buffer(int const num)
             warnd("Failed to attach to buffer number %d.", num);
       }
 }
+
+static void
+set_initial_viewport(Buffer *bdata, nvim_future *fut)
+{
+      mpack_array *arr = nvim_future_await(fut, E_MPACK_ARRAY).ptr;
+      if (!arr)
+            return;
+      if (arr->qty == 2) {
+            atomic_store_explicit(&bdata->viewport.first,
+                                  (int)mpack_expect(arr->lst[0], E_NUM, false).num,
+                                  memory_order_relaxed);
+            atomic_store_explicit(&bdata->viewport.last,
+                                  (int)mpack_expect(arr->lst[1], E_NUM, false).num,
+                                  memory_order_relaxed);
+      }
+      talloc_free(arr);
+}
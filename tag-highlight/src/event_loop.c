@@ -214,10 +214,12 @@ event_loop_io_cb(evutil_socket_t fd, short const flags, UNUSED void *vdata)
             pthread_mutex_lock(&event_loop_cb_mutex);
 
             struct event_data data;
-            data.fd  = fd;
-            data.obj = mpack_decode_stream((intptr_t)fd);
-            talloc_steal(CTX, data.obj);
-            handle_nvim_message(&data);
+            data.fd = fd;
+            do {
+                  data.obj = mpack_decode_stream((intptr_t)fd);
+                  talloc_steal(CTX, data.obj);
+                  handle_nvim_message(&data);
+            } while (mpack_decode_stream_pending((intptr_t)fd));
 
             pthread_mutex_unlock(&event_loop_cb_mutex);
       }
@@ -308,12 +310,15 @@ UNUSED static void do_event_loop(uv_loop_t *loop, uv_poll_t *upoll, uv_signal_t
 UNUSED static void do_event_loop_pipe(uv_loop_t *loop, uv_pipe_t *phand, uv_signal_t signal_watchers[5], intptr_t fd);
 
 struct userdata {
-      uv_loop_t   *loop_handle;
-      uv_poll_t   *poll_handle;
-      uv_pipe_t   *pipe_handle;
-      uv_signal_t *signal_watchers;
-      intptr_t     fd;
-      bool         grace;
+      uv_loop_t     *loop_handle;
+      uv_poll_t     *poll_handle;
+      uv_pipe_t     *pipe_handle;
+      uv_signal_t   *signal_watchers;
+      intptr_t       fd;
+      bool           grace;
+      mpack_decoder *decoder;
+      char          *readbuf;
+      size_t         readbuf_size;
 };
 
 static uv_loop_t base_loop;
@@ -422,10 +427,12 @@ event_loop_io_cb(UNUSED uv_poll_t *handle, UNUSED int const status, int const ev
       } else if (events & UV_READABLE) {
             struct userdata *user = handle->data;
             struct event_data data;
-            data.fd  = (int)user->fd;
-            data.obj = mpack_decode_stream(data.fd);
-            talloc_steal(CTX, data.obj);
-            handle_nvim_message(&data);
+            data.fd = (int)user->fd;
+            do {
+                  data.obj = mpack_decode_stream(data.fd);
+                  talloc_steal(CTX, data.obj);
+                  handle_nvim_message(&data);
+            } while (mpack_decode_stream_pending(data.fd));
       }
 }
 
@@ -469,34 +476,50 @@ event_loop_signal_cb(uv_signal_t *handle, int const signum)
 }
 
 
+/*
+ * Only one read is ever in flight and the decoder copies out whatever it has to
+ * keep, so the same buffer can be handed to libuv every time.
+ */
 static void
-pipe_alloc_callback(UNUSED uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+pipe_alloc_callback(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
 {
-      char *tmp = realloc(buf->base, suggested_size);
-      if (!tmp)
-            err(1, "realloc()");
-      buf->base = tmp;
-      buf->len  = suggested_size;
+      struct userdata *user = handle->data;
+
+      if (user->readbuf_size < suggested_size) {
+            char *tmp = realloc(user->readbuf, suggested_size);
+            if (!tmp)
+                  err(1, "realloc()");
+            user->readbuf      = tmp;
+            user->readbuf_size = suggested_size;
+      }
+
+      buf->base = user->readbuf;
+      buf->len  = user->readbuf_size;
 }
 
 static void
-pipe_read_callback(UNUSED uv_stream_t *stream, ssize_t nread, uv_buf_t const *buf)
-{
-      if (nread <= 0)
-            errx(1, "Invalid read.");
-      bstring wrapper = {
-          .data  = (uchar *)buf->base,
-          .slen  = nread,
-          .mlen  = 0,
-          .flags = 0
-      };
+pipe_message_callback(mpack_obj *obj, void *arg)
+{
+      struct userdata  *user = arg;
       struct event_data data;
+      data.fd  = (int)user->fd;
+      data.obj = obj;
+      talloc_steal(CTX, data.obj);
+      handle_nvim_message(&data);
+}
 
-      while (wrapper.slen > 0) {
-            data.obj = mpack_decode_obj(&wrapper);
-            talloc_steal(CTX, data.obj);
-            handle_nvim_message(&data);
-      }
+static void
+pipe_read_callback(uv_stream_t *stream, ssize_t nread, uv_buf_t const *buf)
+{
+      struct userdata *user = stream->data;
+
+      if (nread == 0) /* EAGAIN */
+            return;
+      if (nread < 0)
+            errx(1, "Invalid read: %s", uv_strerror((int)nread));
+
+      mpack_decoder_feed(user->decoder, (uint8_t const *)buf->base, (size_t)nread,
+                         pipe_message_callback, user);
 }
 
 static void
@@ -508,10 +531,15 @@ do_event_loop_pipe(uv_loop_t *loop, uv_pipe_t *phand, uv_signal_t signal_watcher
                                  signal_watchers[4].data =
                    &data;
 
+      data.decoder = mpack_decoder_create(CTX);
+
       event_loop_start_watchers(signal_watchers);
       uv_read_start((uv_stream_t *)phand, &pipe_alloc_callback, &pipe_read_callback);
       uv_run(loop, UV_RUN_DEFAULT);
 
+      talloc_free(data.decoder);
+      free(data.readbuf);
+
       if (!data.grace)
             errx(1, "This shouldn't be reachable?...");
 }
@@ -579,17 +607,20 @@ run_event_loop(int const fd, char *servername)
 static void
 event_loop_io_cb(UNUSED EV_P, ev_io *w, UNUSED int revents)
 {
-        int const  fd  = w->fd;
-        mpack_obj *obj = mpack_decode_stream(fd);
-        talloc_steal(CTX, obj);
-
-        //struct event_data *data = malloc(sizeof *data);
-        struct event_data data;
-        data.obj = obj;
-        data.fd  = fd;
-        //START_DETACHED_PTHREAD(handle_nvim_message, data);
-        handle_nvim_message(&data);
-        //free(data);
+        int const fd = w->fd;
+
+        do {
+                mpack_obj *obj = mpack_decode_stream(fd);
+                talloc_steal(CTX, obj);
+
+                //struct event_data *data = malloc(sizeof *data);
+                struct event_data data;
+                data.obj = obj;
+                data.fd  = fd;
+                //START_DETACHED_PTHREAD(handle_nvim_message, data);
+                handle_nvim_message(&data);
+                //free(data);
+        } while (mpack_decode_stream_pending(fd));
 }
 
 static void
@@ -63,7 +63,9 @@ struct event_data {
 extern const struct event_id event_list[];
 extern p99_futex volatile _nvim_wait_futex;
 
-extern _Noreturn void *event_autocmd(void *vdata);
+extern void event_autocmd(void *vdata);
+extern void init_thread_pools(void);
+extern void report_thread_pool_stats(void);
 
 /*===========================================================================*/
 /* Event handlers */
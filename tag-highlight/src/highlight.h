@@ -5,6 +5,7 @@
 #include "Common.h"
 #include "mpack/mpack.h"
 #include "nvim_api/api.h"
+#include "util/line_store.h"
 #include "util/list.h"
 
 #include "contrib/p99/p99_count.h"
@@ -25,6 +26,7 @@ typedef enum { COMP_NONE, COMP_GZIP, COMP_LZMA } comp_type_t;
 
 P99_DECLARE_STRUCT(cmd_info);
 struct cmd_info;
+struct hl_batch;
 typedef struct bufdata  Buffer;
 typedef struct filetype Filetype;
 
@@ -42,6 +44,16 @@ struct settings_s {
 
       void *talloc_ctx;
 
+      uint32_t debounce_ms;
+      uint32_t clang_memory_budget;
+      uint32_t clang_ast_cache_mb;
+      uint32_t clang_skeleton_kb;
+      uint32_t clang_workers;
+      uint32_t clang_worker_max_mb;
+      uint32_t atomic_chunk_calls;
+      uint32_t atomic_chunk_kb;
+      uint32_t atomic_pipeline;
+      uint32_t atomic_yield_usec;
       uint16_t job_id;
       uint8_t  comp_type;
       uint8_t  comp_level;
@@ -50,6 +62,8 @@ struct settings_s {
       bool     verbose;
       bool     buffer_initialized;
       bool     run_ctags;
+      bool     packed_highlights;
+      bool     clang_ast_cache;
 };
 
 struct filetype {
@@ -57,6 +71,7 @@ struct filetype {
       b_list          *ignored_tags;
       bstring         *restore_cmds;
       bstring         *order;
+      bstring         *allbut; /* Global and filetype specific `allbut' joined by ','. */
       cmd_info        *cmd_info;
       bstring          vim_name;
       bstring          ctags_name;
@@ -94,11 +109,27 @@ struct bufdata {
       struct {
             pthread_mutex_t total;
             pthread_mutex_t lang_mtx;
+            pthread_mutex_t sched_mtx;
+            pthread_mutex_t hl_mtx;
+            pthread_mutex_t lines_mtx;
             p99_count       num_workers;
-            p99_count       hl_waiters;
             pthread_t       pids[4];
       } lock;
 
+      /* The lines [first, last) shown in the window most recently scrolled to this
+       * buffer, as reported by the plugin. `last' is 0 until the first report. */
+      struct {
+            atomic_int first;
+            atomic_int last;
+      } viewport;
+
+      /* State for the coalescing highlight scheduler. Protected by `lock.sched_mtx'. */
+      struct {
+            uint32_t dirty_tick; /* Newest ctick seen while a parse was running. */
+            bool     running;
+            bool     dirty;
+      } sched;
+
       struct {
             bstring *full;
             bstring *base;
@@ -106,10 +137,42 @@ struct bufdata {
             char     suffix[8];
       } name;
 
-      linked_list     *lines;
+      /* Edits to `lines' and `lines_tick' are made under `lock.lines_mtx' only, so
+       * they never wait on a parser. Parsers read a buffer_snapshot instead. */
+      line_store      *lines;
+      atomic_uint      lines_tick; /* The changedtick `lines' is up to date with. */
+
+      /* Lines [first, last) edited since the last buffer_snapshot, in current line
+       * numbers. `first' is -1 if there are none. Protected by `lock.lines_mtx'. */
+      struct {
+            int first;
+            int last;
+      } dirty;
+
+      /* Line events that came in before the initial lines were read, oldest first.
+       * get_initial_lines() applies those newer than what it read. Protected by
+       * `lock.lines_mtx'. */
+      struct {
+            struct line_event *head;
+            struct line_event *tail;
+      } pending;
+
       struct filetype *ft;
       struct top_dir  *topdir;
 
+      /* The highlights most recently sent to neovim by a parser, kept in step with
+       * line insertions and deletions. Protected by `lock.hl_mtx'. */
+      struct hl_batch *hl_applied;
+
+      /* Each send takes a ticket under `lock.hl_mtx' and goes out once `done' has
+       * reached it, so sends made outside that lock still keep their order. */
+      struct {
+            pthread_mutex_t mtx;
+            pthread_cond_t  cond;
+            uint32_t        next;
+            atomic_uint     done;
+      } hl_send;
+
       union {
             struct /*c_family*/ {
                   void   *clangdata;
@@ -130,6 +193,8 @@ struct cmd_info {
       unsigned num;
       int      kind;
       bstring *group;
+      bstring *prefix;
+      bstring *suffix;
 };
 
 extern struct settings_s settings;
@@ -150,6 +215,7 @@ extern void    destroy_buffer(Buffer *bdata, unsigned flags);
 extern Buffer *new_buffer(unsigned bufnum);
 extern Buffer *find_buffer(unsigned bufnum);
 extern Buffer *get_bufdata(unsigned bufnum, struct filetype *ft);
+extern void    reload_filetype_config(void);
 
 /*===========================================================================*/
 /* Old "highlight.h" */
@@ -165,6 +231,31 @@ enum update_taglist_opts {
       UPDATE_TAGLIST_FORCE_LANGUAGE,
 };
 
+/*
+ * An immutable copy of a buffer's contents, taken without holding up line events. The
+ * text has a newline after every line. `start' and `end' are the byte offsets of the
+ * line range asked for, or the whole text when `last' is negative. Taking a snapshot
+ * also takes the buffer's dirty line range, which is -1 to -1 if nothing changed.
+ */
+struct buffer_snapshot {
+      bstring *text;
+      uint32_t ctick;
+      unsigned nlines;
+      size_t   start;
+      size_t   end;
+      int      dirty_first;
+      int      dirty_last;
+};
+
+/* The lines [first, last) replaced by `strings', as of changedtick `tick'. */
+struct line_event {
+      struct line_event *next;
+      b_list            *strings;
+      uint32_t           tick;
+      int                first;
+      int                last;
+};
+
 enum update_highlight_type {
       HIGHLIGHT_NORMAL,
       HIGHLIGHT_UPDATE,
@@ -174,12 +265,23 @@ enum update_highlight_type {
 
 extern int  update_taglist(Buffer *bdata, enum update_taglist_opts opts);
 extern void update_highlight(Buffer *bdata, enum update_highlight_type type);
+extern void schedule_highlight(Buffer *bdata);
+extern void unschedule_highlight(Buffer *bdata);
 extern int  get_initial_taglist(Buffer *bdata);
 extern void clear_highlight(Buffer *bdata, bool blocking);
 extern void get_initial_lines(Buffer *bdata);
+extern struct buffer_snapshot *buffer_snapshot(Buffer *bdata, void *talloc_ctx, int first, int last) __aWUR;
+extern bool buffer_viewport(Buffer *bdata, int *first, int *last);
+extern void buffer_mark_dirty(Buffer *bdata, int first, int last, int num_new);
+extern bool buffer_apply_line_event(Buffer *bdata, struct line_event const *ev);
 extern void launch_event_loop(void);
 extern void b_list_dump_nvim(b_list const *list, char const *listname);
 
+#define buffer_snapshot(...)       P99_CALL_DEFARG(buffer_snapshot, 4, __VA_ARGS__)
+#define buffer_snapshot_defarg_1() NULL
+#define buffer_snapshot_defarg_2() 0
+#define buffer_snapshot_defarg_3() (-1)
+
 #include "macros.h"
 
 /*===========================================================================*/
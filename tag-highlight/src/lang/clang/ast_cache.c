@@ -0,0 +1,304 @@
+#include "clang.h"
+#include "intern.h"
+
+#include <sys/stat.h>
+#include <utime.h>
+
+#ifdef _WIN32
+#  define SEPCHAR       '\\'
+#  define SEPSTR        "\\"
+#  define DOSCHECK(CH_) ((CH_) == ':' || (CH_) == '/')
+#else
+#  define SEPCHAR       '/'
+#  define SEPSTR        "/"
+#  define DOSCHECK(CH_) (false)
+#endif
+
+/*
+ * A saved AST for each C or C++ file opened, so that the first highlight of a session
+ * doesn't have to wait for every header to be parsed again. Beside each AST is a key
+ * file recording what it was built from:
+ *
+ *     thl-ast 1
+ *     <hash of clang version and arguments> <hash of the file's text>
+ *     <mtime> <path>      (one line for every file it includes)
+ *
+ * The AST is only used if all of that still matches. An AST loaded from disk can't
+ * be reparsed, so it only ever provides a first paint; the buffer's real translation
+ * unit is still parsed afterwards and replaces it.
+ *
+ * An AST holds every header the file includes, so they easily run to hundreds of MB.
+ * Once the directory holds more than `tag_highlight#clang_ast_cache_mb' MiB of them,
+ * the least recently used are deleted. Loading an AST touches it for that purpose.
+ */
+
+#define AST_CACHE_MAGIC "thl-ast 1"
+
+static void     cache_paths(Buffer const *bdata, char *ast, char *key);
+static uint64_t hash_args(str_vector const *argv);
+static uint64_t hash_text(bstring const *text);
+static bool     key_matches(char const *key, uint64_t args_hash, uint64_t text_hash);
+static bool     file_matches(char const *fname, uint64_t text_hash);
+static void     inclusion_visitor(CXFile included, CXSourceLocation *stack, unsigned depth, CXClientData data);
+static void     prune_cache(char const *keep);
+
+//========================================================================================
+
+/*
+ * Returns a translation unit loaded from the cache if there is one for exactly
+ * this text, these arguments and the headers as they are now, or NULL.
+ */
+CXTranslationUnit
+ast_cache_load(Buffer *bdata, CXIndex idx, str_vector const *argv, bstring const *text)
+{
+        char              ast[SAFE_PATH_MAX + 1];
+        char              key[SAFE_PATH_MAX + 1];
+        CXTranslationUnit tu = NULL;
+
+        uint64_t const text_hash = hash_text(text);
+
+        cache_paths(bdata, ast, key);
+        if (!key_matches(key, hash_args(argv), text_hash))
+                return NULL;
+
+        /* Clang reads the main file from disk to tokenize a loaded AST, so the buffer
+         * must not have unsaved changes. */
+        if (!file_matches(BS(bdata->name.full), text_hash))
+                return NULL;
+
+        enum CXErrorCode const ret = clang_createTranslationUnit2(idx, ast, &tu);
+        if (ret != CXError_Success || !tu) {
+                warnd("Failed to load cached AST \"%s\" (%d)", ast, ret);
+                unlink(key);
+                unlink(ast);
+                return NULL;
+        }
+
+        utime(ast, NULL);
+        warnd("Loaded cached AST for \"%s\"", BS(bdata->name.full));
+        return tu;
+}
+
+/*
+ * Save `tu', freshly parsed from `text' with `argv', for the next session. The key
+ * is removed first and only written once the AST is in place, so a crash in between
+ * can't pair a key with the wrong AST.
+ */
+void
+ast_cache_save(Buffer *bdata, CXTranslationUnit tu, str_vector const *argv, bstring const *text)
+{
+        char ast[SAFE_PATH_MAX + 1];
+        char key[SAFE_PATH_MAX + 1];
+        char tmp[SAFE_PATH_MAX + 1];
+
+        cache_paths(bdata, ast, key);
+        if (key_matches(key, hash_args(argv), hash_text(text)))
+                return;
+
+        unlink(key);
+        snprintf(tmp, sizeof tmp, "%s.tmp", ast);
+        if (clang_saveTranslationUnit(tu, tmp, clang_defaultSaveOptions(tu)) != CXSaveError_None) {
+                warnd("Failed to save AST for \"%s\"", BS(bdata->name.full));
+                unlink(tmp);
+                return;
+        }
+        if (rename(tmp, ast) != 0) {
+                unlink(tmp);
+                return;
+        }
+
+        snprintf(tmp, sizeof tmp, "%s.tmp", key);
+        FILE *fp = fopen(tmp, "wb");
+        if (!fp)
+                return;
+        fprintf(fp, AST_CACHE_MAGIC "\n%016" PRIx64 " %016" PRIx64 "\n",
+                hash_args(argv), hash_text(text));
+        clang_getInclusions(tu, &inclusion_visitor, fp);
+
+        if (fclose(fp) != 0 || rename(tmp, key) != 0)
+                unlink(tmp);
+
+        prune_cache(ast);
+}
+
+//========================================================================================
+
+static void
+cache_paths(Buffer const *bdata, char *ast, char *key)
+{
+        char   name[SAFE_PATH_MAX + 1];
+        size_t n = 0;
+
+        /* Flatten the full path into one file name the same way the tags cache does. */
+        for (unsigned i = 0; i < bdata->name.full->slen && n < sizeof(name) - 3; ++i) {
+                int const ch = bdata->name.full->data[i];
+                if (ch == SEPCHAR || DOSCHECK(ch)) {
+                        name[n++] = '_';
+                        name[n++] = '_';
+                } else {
+                        name[n++] = (char)ch;
+                }
+        }
+        name[n] = '\0';
+
+        snprintf(ast, SAFE_PATH_MAX, "%s" SEPSTR "clang_ast", BS(settings.cache_dir));
+        mkdir(ast, 0755);
+        snprintf(key, SAFE_PATH_MAX, "%s" SEPSTR "%s.key", ast, name);
+        snprintf(ast + strlen(ast), SAFE_PATH_MAX - strlen(ast), SEPSTR "%s.ast", name);
+}
+
+static uint64_t
+hash_args(str_vector const *argv)
+{
+        CXString const version = clang_getClangVersion();
+        uint64_t       hash    = fnv1a(FNV1A_OFFSET_BASIS, CS(version), strlen(CS(version)) + 1);
+        clang_disposeString(version);
+
+        for (unsigned i = 0; i < argv->qty; ++i)
+                hash = fnv1a(hash, argv->lst[i], strlen(argv->lst[i]) + 1);
+        return hash;
+}
+
+static uint64_t
+hash_text(bstring const *text)
+{
+        return fnv1a(FNV1A_OFFSET_BASIS, text->data, text->slen);
+}
+
+static bool
+key_matches(char const *key, uint64_t const args_hash, uint64_t const text_hash)
+{
+        char     line[SAFE_PATH_MAX + 64];
+        uint64_t ahash, thash;
+        bool     ret = false;
+        FILE    *fp  = fopen(key, "rb");
+
+        if (!fp)
+                return false;
+        if (!fgets(line, sizeof line, fp) || strncmp(line, SLS(AST_CACHE_MAGIC "\n")) != 0)
+                goto done;
+        if (fscanf(fp, "%" SCNx64 " %" SCNx64 "\n", &ahash, &thash) != 2 ||
+            ahash != args_hash || thash != text_hash)
+                goto done;
+
+        /* Every header must still have the modification time it had when saved. */
+        while (fgets(line, sizeof line, fp)) {
+                struct stat st;
+                char       *path;
+                long long   mtime = strtoll(line, &path, 10);
+
+                if (*path++ != ' ')
+                        goto done;
+                path[strcspn(path, "\r\n")] = '\0';
+                if (stat(path, &st) != 0 || (long long)st.st_mtime != mtime)
+                        goto done;
+        }
+
+        ret = true;
+done:
+        fclose(fp);
+        return ret;
+}
+
+static bool
+file_matches(char const *fname, uint64_t const text_hash)
+{
+        uint8_t  buf[8192];
+        uint64_t hash = FNV1A_OFFSET_BASIS;
+        size_t   n;
+        FILE    *fp   = fopen(fname, "rb");
+
+        if (!fp)
+                return false;
+        while ((n = fread(buf, 1, sizeof buf, fp)) > 0)
+                hash = fnv1a(hash, buf, n);
+        fclose(fp);
+
+        return hash == text_hash;
+}
+
+struct cached_ast {
+        char  *path;
+        off_t  size;
+        time_t mtime;
+};
+
+static int
+cmp_oldest(void const *a, void const *b)
+{
+        time_t const x = ((struct cached_ast const *)a)->mtime;
+        time_t const y = ((struct cached_ast const *)b)->mtime;
+        return (x > y) - (x < y);
+}
+
+/*
+ * Delete the least recently used ASTs, other than `keep', until what is left fits
+ * within the limit.
+ */
+static void
+prune_cache(char const *keep)
+{
+        char               dir[SAFE_PATH_MAX + 1];
+        char               path[SAFE_PATH_MAX + 1];
+        struct cached_ast *asts    = NULL;
+        unsigned           n       = 0;
+        unsigned           removed = 0;
+        uint64_t           total   = 0;
+        uint64_t const     limit   = (uint64_t)settings.clang_ast_cache_mb << 20;
+        struct dirent     *ent;
+        DIR               *dp;
+
+        snprintf(dir, sizeof dir, "%s" SEPSTR "clang_ast", BS(settings.cache_dir));
+        if (limit == 0 || !(dp = opendir(dir)))
+                return;
+
+        while ((ent = readdir(dp))) {
+                struct stat  st;
+                size_t const len = strlen(ent->d_name);
+
+                if (len <= 4 || strcmp(ent->d_name + len - 4, ".ast") != 0)
+                        continue;
+                snprintf(path, sizeof path, "%s" SEPSTR "%s", dir, ent->d_name);
+                if (stat(path, &st) != 0)
+                        continue;
+
+                asts    = talloc_realloc(NULL, asts, struct cached_ast, n + 1);
+                asts[n] = (struct cached_ast){talloc_strdup(asts, path), st.st_size, st.st_mtime};
+                total  += (uint64_t)st.st_size;
+                ++n;
+        }
+        closedir(dp);
+
+        if (total > limit) {
+                qsort(asts, n, sizeof asts[0], cmp_oldest);
+                for (unsigned i = 0; i < n && total > limit; ++i) {
+                        if (strcmp(asts[i].path, keep) == 0)
+                                continue;
+                        /* The key goes first, as when saving. */
+                        snprintf(path, sizeof path, "%.*s.key",
+                                 (int)(strlen(asts[i].path) - 4), asts[i].path);
+                        unlink(path);
+                        if (unlink(asts[i].path) == 0) {
+                                total -= (uint64_t)asts[i].size;
+                                ++removed;
+                        }
+                }
+                warnd("Deleted %u cached ASTs to stay within %u MiB", removed, settings.clang_ast_cache_mb);
+        }
+
+        talloc_free(asts);
+}
+
+static void
+inclusion_visitor(CXFile included, UNUSED CXSourceLocation *stack, unsigned const depth, CXClientData data)
+{
+        FILE *fp = data;
+
+        /* The main file itself is covered by the hash of its text. */
+        if (depth == 0)
+                return;
+
+        CXString const name = clang_getFileName(included);
+        fprintf(fp, "%lld %s\n", (long long)clang_getFileTime(included), CS(name));
+        clang_disposeString(name);
+}
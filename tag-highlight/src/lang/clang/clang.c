@@ -11,27 +11,21 @@
  * again, let alone document it, let alone *refactor* it. Ugh.
  */
 
-#define TUFLAGS                                                    \
-        (  CXTranslationUnit_KeepGoing                             \
-         /* | CXTranslationUnit_Incomplete */                      \
-         | CXTranslationUnit_PrecompiledPreamble                   \
-         | CXTranslationUnit_CreatePreambleOnFirstParse      \
-         | CXTranslationUnit_IgnoreNonErrorsFromIncludedFiles      \
-         /* | CXTranslationUnit_RetainExcludedConditionalBlocks */ \
-         | CXTranslationUnit_DetailedPreprocessingRecord           \
-         /* | CXTranslationUnit_IncludeAttributedTypes */          \
-         /* | CXTranslationUnit_VisitImplicitAttributes */         \
-         /* | CXTranslationUnit_ForSerialization */                \
-         /* | CXTranslationUnit_CacheCompletionResults */          \
-         /* | CXTranslationUnit_SkipFunctionBodies */                    \
-         /* | CXTranslationUnit_LimitSkipFunctionBodiesToPreamble */     \
-         /* | CXTranslationUnit_CXXChainedPCH */                   \
-         /* | CXTranslationUnit_SingleFileParse */                 \
+/* For the throwaway first paint of a big file. Without a preamble, since the unit
+ * is disposed of straight away. */
+#define SKELETON_TUFLAGS                                       \
+        (  CXTranslationUnit_KeepGoing                         \
+         | CXTranslationUnit_IgnoreNonErrorsFromIncludedFiles  \
+         | CXTranslationUnit_DetailedPreprocessingRecord       \
+         | CXTranslationUnit_SkipFunctionBodies                \
         )
 
 #define INIT_ARGV (32)
 #define CTX       clang_talloc_ctx_
 
+/* Only worth a separate pass when the file is this many times taller than the window. */
+#define VIEWPORT_PREVIEW_RATIO (4U)
+
 static const char *default_includes[] = {
     "-I/usr/include/gblkid",           "-I/usr/include/gio-unix-2.0",
     "-I/usr/include/glib-2.0",         "-I/usr/include/json-glib-1.0",
@@ -53,12 +47,20 @@ static CXCompileCommands  get_clang_compile_commands_for_file(CXCompilationDatab
 
 static NORETURN void handle_libclang_error(Buffer *bdata, unsigned const err);
 static int         destroy_struct_translationunit(translationunit_t *stu);
+static bool        highlight_from_ast_cache(Buffer *bdata, struct clang_project *proj, bstring *text, uint32_t ctick);
+static void        highlight_from_skeleton(Buffer *bdata, struct clang_project *proj, bstring *text, uint32_t ctick);
+static bool        edit_within_function_body(translationunit_t *stu, CXFile file, int *first, int *last);
+static bool        lines_have_directive(bstring const *text, int64_t offset, int nlines);
+static int64_t     line_offset(translationunit_t *stu, CXFile file, int line);
 static int         do_destroy_clangdata(clangdata_t *cdata);
 static str_vector *get_backup_commands(Buffer *bdata);
-static str_vector *get_compile_commands(Buffer *bdata);
-static token_t    *get_token_data(translationunit_t *stu, CXToken *tok, CXCursor *cursor);
-static void        tokenize_range(translationunit_t *stu, CXFile *file, int64_t first, int64_t last);
-static inline void lines2bytes(Buffer *bdata, int64_t *startend, int first, int last);
+static str_vector *get_compile_commands(Buffer *bdata, CXCompilationDatabase db);
+
+static struct clang_project *project_acquire(Buffer *bdata);
+static void                  project_release(struct clang_project *proj);
+static void                  project_forget_commands(struct clang_project *proj);
+static str_vector           *project_compile_commands(struct clang_project *proj, Buffer *bdata);
+static bool        get_token_data(translationunit_t *stu, CXToken *tok, CXCursor *cursor, token_t *ret);
 
 __attribute__((__constructor__(500))) static void
 clang_initializer(void)
@@ -75,6 +77,7 @@ static void mutex_cleanup(void *arg);
 
 //static int do_libclang_highlight(void);
 static inline int do_libclang_highlight(Buffer *bdata, int first, int last, int type);
+static int        do_remote_highlight(Buffer *bdata, int first, int last, int type);
 
 void
 (libclang_highlight)(Buffer *bdata, int const first, int const last, int const type)
@@ -84,13 +87,10 @@ void
       if (bdata->total_failure)
             return;
 
-      uint32_t cnt_val = p99_count_inc(&bdata->lock.num_workers);
-      if (cnt_val > 3) {
-            p99_count_dec(&bdata->lock.num_workers);
-            return;
-      }
+      /* Concurrent parses are coalesced by schedule_highlight(); anything else that
+       * gets here simply waits its turn on the language mutex. */
+      p99_count_inc(&bdata->lock.num_workers);
 
-      bdata->lock.pids[cnt_val] = pthread_self();
       if (setjmp(jbuf) != 0)
             goto done;
 
@@ -105,7 +105,7 @@ void
 #if 0
       int                dummy;
       bstring           *joined = NULL;
-      mpack_arg_array   *calls;
+      hl_batch          *batch;
       translationunit_t *stu;
       int64_t            startend[2];
 
@@ -121,7 +121,7 @@ void
       //TIMER_START(&tm);
 
       pthread_mutex_lock(&bdata->lock.total);
-      joined = ll_join_bstrings(bdata->lines, '\n');
+      joined = ls_text(bdata->lines, NULL);
       //pthread_cleanup_push(bstr_cleanup, joined);
       pthread_mutex_unlock(&bdata->lock.total);
 
@@ -152,11 +152,10 @@ void
       CLD(bdata)->mainfile = clang_getFile(CLD(bdata)->tu, BS(bdata->name.full));
       tokenize_range(stu, &CLD(bdata)->mainfile, startend[0], startend[1]);
 
-      calls = create_nvim_calls(bdata, stu);
-      nvim_call_atomic(calls);
+      batch = create_nvim_calls(bdata, stu, 0, -1);
+      hl_batch_send(batch);
 
 
-      talloc_free(calls);
       talloc_free(stu);
 
       //TIMER_REPORT(&tm, "clang parse");
@@ -164,7 +163,6 @@ void
 
 done:
       pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-      bdata->lock.pids[cnt_val] = 0;
       p99_count_dec(&bdata->lock.num_workers);
       pthread_mutex_unlock(&bdata->lock.lang_mtx);
       pthread_cleanup_pop(0);
@@ -176,9 +174,16 @@ static inline int
 do_libclang_highlight(Buffer *bdata, int const first, int const last, int const type)
 {
       bstring           *joined = NULL;
-      mpack_arg_array   *calls;
+      hl_batch          *batch;
       translationunit_t *stu;
       int64_t            startend[2];
+      int64_t            viewbytes[2];
+      int                dirty[2];
+      size_t             textlen;
+      unsigned           nlines;
+      uint32_t           ctick;
+      int                vfirst, vlast;
+      bool               save_ast = false;
 
       if (bdata->num_failures > 10) {
             if (!bdata->total_failure) {
@@ -188,39 +193,159 @@ do_libclang_highlight(Buffer *bdata, int const first, int const last, int const
             return 1;
       }
 
-      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-      pthread_mutex_lock(&bdata->lock.total);
-      joined = ll_join_bstrings(bdata->lines, '\n');
-      pthread_mutex_unlock(&bdata->lock.total);
+      if (settings.clang_workers > 0)
+            return do_remote_highlight(bdata, first, last, type);
 
-      if (last == (-1)) {
-            startend[0] = 0;
-            startend[1] = joined->slen;
+      /* After an edit, only the lines it touched may need redoing. That needs a
+       * translation unit to reparse and a record of what is highlighted now. */
+      bool const incremental = type == HIGHLIGHT_NORMAL && last == (-1) &&
+                               bdata->clangdata && hl_applied_valid(bdata);
+
+      /* When a big file is highlighted in full, the lines on screen are done and
+       * sent first so they don't have to wait for the rest. */
+      bool const whole_view = !incremental && last == (-1) &&
+                              buffer_viewport(bdata, &vfirst, &vlast);
+
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+      /* The snapshot's offsets always agree with its text, and taking it doesn't
+       * hold up line events for the length of the parse. Whether the file is big
+       * enough for a preview is judged by the snapshot too, since `lines' may only
+       * be looked at under `lock.lines_mtx'. */
+      struct buffer_snapshot *snap = whole_view ? buffer_snapshot(bdata, NULL, vfirst, vlast - 1)
+                                                : buffer_snapshot(bdata, NULL, first, last);
+      bool const preview = whole_view &&
+                           snap->nlines > (unsigned)(vlast - vfirst) * VIEWPORT_PREVIEW_RATIO;
+
+      joined   = talloc_steal(NULL, snap->text);
+      ctick    = snap->ctick;
+      textlen  = joined->slen;
+      nlines   = snap->nlines;
+      dirty[0] = snap->dirty_first;
+      dirty[1] = snap->dirty_last;
+      if (whole_view) {
+            viewbytes[0] = (int64_t)snap->start;
+            viewbytes[1] = (int64_t)snap->end;
+            startend[0]  = 0;
+            startend[1]  = joined->slen;
       } else {
-            lines2bytes(bdata, startend, first, last);
+            startend[0] = (int64_t)snap->start;
+            startend[1] = (int64_t)snap->end;
       }
+      talloc_free(snap);
 
       if (type == HIGHLIGHT_REDO) {
-            if (bdata->clangdata)
+            /* Start over completely, including re-reading the compilation database. */
+            if (bdata->clangdata) {
+                  project_forget_commands(CLD(bdata)->project);
                   destroy_clangdata(bdata);
+            }
+            stu = init_compilation_unit(bdata, joined);
+      } else if (bdata->clangdata) {
+            stu = recover_compilation_unit(bdata, joined);
+      } else if (settings.clang_ast_cache || settings.clang_skeleton_kb) {
+            /* Put something on screen before the real parse, either from a saved
+             * AST or, for a big file, from a quick parse that skips function bodies.
+             * The project reference keeps its database loaded in between. */
+            struct clang_project *proj = project_acquire(bdata);
+            if (!(settings.clang_ast_cache && highlight_from_ast_cache(bdata, proj, joined, ctick)) &&
+                settings.clang_skeleton_kb && textlen >= (size_t)settings.clang_skeleton_kb << 10)
+                  highlight_from_skeleton(bdata, proj, joined, ctick);
             stu = init_compilation_unit(bdata, joined);
+            project_release(proj);
+            save_ast = settings.clang_ast_cache;
       } else {
-            stu = (bdata->clangdata) ? recover_compilation_unit(bdata, joined)
-                                     : init_compilation_unit(bdata, joined);
+            stu = init_compilation_unit(bdata, joined);
       }
       pthread_setcancelstate(PTHREAD_CANCEL_DEFERRED, NULL);
 
+      tu_manager_touch(CLD(bdata));
       CLD(bdata)->mainfile = clang_getFile(CLD(bdata)->tu, BS(bdata->name.full));
+
+      if (incremental && dirty[0] >= 0 &&
+          edit_within_function_body(stu, CLD(bdata)->mainfile, &dirty[0], &dirty[1]))
+      {
+            startend[0] = line_offset(stu, CLD(bdata)->mainfile, dirty[0]);
+            startend[1] = (unsigned)dirty[1] >= nlines
+                              ? (int64_t)textlen
+                              : line_offset(stu, CLD(bdata)->mainfile, dirty[1]);
+            tokenize_range(stu, &CLD(bdata)->mainfile, startend[0], startend[1]);
+
+            batch        = create_nvim_calls(bdata, stu, dirty[0], dirty[1]);
+            batch->ctick = ctick;
+            hl_batch_send(batch);
+
+            talloc_free(stu);
+            return 0;
+      }
+
+      if (preview) {
+            tokenize_range(stu, &CLD(bdata)->mainfile, viewbytes[0], viewbytes[1]);
+            batch          = create_nvim_calls(bdata, stu, vfirst, vlast);
+            batch->ctick   = ctick;
+            batch->preview = true;
+            hl_batch_send(batch);
+            release_tokens(stu);
+      }
+
       tokenize_range(stu, &CLD(bdata)->mainfile, startend[0], startend[1]);
 
-      calls = create_nvim_calls(bdata, stu);
-      nvim_call_atomic(calls);
+      batch        = create_nvim_calls(bdata, stu, 0, -1);
+      batch->ctick = ctick;
+      hl_batch_send(batch);
+
+      /* Only once the highlights are out, since writing the AST can take a while. */
+      if (save_ast)
+            ast_cache_save(bdata, stu->tu, CLD(bdata)->argv, stu->buf);
 
-      talloc_free(calls);
       talloc_free(stu);
       return 0;
 }
 
+/*
+ * The same, but with the parsing done by a worker process (see worker.c). The buffer
+ * then has a clangdata without a translation unit, which only keeps the project and
+ * the compile commands.
+ */
+static int
+do_remote_highlight(Buffer *bdata, int const first, int const last, int const type)
+{
+      if (type == HIGHLIGHT_REDO && bdata->clangdata) {
+            project_forget_commands(CLD(bdata)->project);
+            destroy_clangdata(bdata);
+      }
+      if (!bdata->clangdata) {
+            struct clang_project *proj = project_acquire(bdata);
+            clangdata_t          *cld  = talloc_zero(bdata, clangdata_t);
+            cld->bdata       = bdata;
+            cld->project     = proj;
+            cld->idx         = proj->idx;
+            cld->argv        = talloc_steal(cld, project_compile_commands(proj, bdata));
+            bdata->clangdata = cld;
+            talloc_set_destructor(cld, do_destroy_clangdata);
+      }
+
+      struct buffer_snapshot *snap  = buffer_snapshot(bdata, NULL, first, last);
+      hl_batch               *batch = new_hl_batch(bdata);
+
+      if (bdata->hl_id == 0)
+            bdata->hl_id = nvim_buf_add_highlight(bdata->num);
+      else
+            hl_batch_clear(batch, first, last);
+
+      if (clang_worker_highlight(bdata, CLD(bdata)->argv, snap->text,
+                                 (int64_t)snap->start, (int64_t)snap->end, batch))
+      {
+            batch->ctick = snap->ctick;
+            hl_batch_send(batch);
+      } else {
+            talloc_free(batch);
+            ++bdata->num_failures;
+      }
+
+      talloc_free(snap);
+      return 0;
+}
+
 /*--------------------------------------------------------------------------------------*/
 
 static
@@ -231,28 +356,6 @@ void mutex_cleanup(void *arg)
       pthread_mutex_unlock(&bdata->lock.lang_mtx);
 }
 
-static inline void
-lines2bytes(Buffer *bdata, int64_t *startend, int const first, int const last)
-{
-      int64_t startbyte = 0;
-      int64_t endbyte   = 0;
-      int64_t i         = 0;
-
-      LL_FOREACH_F (bdata->lines, node) {
-            bstring *line = node->data;
-            if (i < first)
-                  endbyte = (startbyte += line->slen + 1);
-            else if (i < last + 1)
-                  endbyte += line->slen + 1;
-            else
-                  break;
-            ++i;
-      }
-
-      startend[0] = startbyte;
-      startend[1] = endbyte;
-}
-
 /*--------------------------------------------------------------------------------------*/
 
 void *
@@ -282,7 +385,7 @@ libclang_suspend_translationunit(Buffer *bdata)
       fprintf(stderr, "Suspending translation unit \"%.*s\"\n", BSC(bdata->name.base));
       fflush(stderr);
       if (bdata->clangdata && CLD(bdata)->tu)
-            clang_suspendTranslationUnit(CLD(bdata)->tu);
+            tu_manager_suspend(CLD(bdata));
       pthread_mutex_unlock(&bdata->lock.lang_mtx);
 }
 
@@ -303,7 +406,7 @@ recover_compilation_unit(Buffer *bdata, bstring *buf)
             handle_libclang_error(bdata, ret);
       }
 
-      translationunit_t *stu = talloc(CTX, translationunit_t);
+      translationunit_t *stu = talloc_zero(CTX, translationunit_t);
       stu->tu                = CLD(bdata)->tu;
       stu->buf               = talloc_move(stu, &buf);
       stu->ftid              = bdata->ft->id;
@@ -315,7 +418,8 @@ recover_compilation_unit(Buffer *bdata, bstring *buf)
 static translationunit_t *
 init_compilation_unit(Buffer *bdata, bstring *buf)
 {
-      str_vector *comp_cmds = get_compile_commands(bdata);
+      struct clang_project *proj      = project_acquire(bdata);
+      str_vector           *comp_cmds = project_compile_commands(proj, bdata);
       b_regularize_path_sep(bdata->name.full, '\\');
       struct CXUnsavedFile unsaved = {.Filename = BS(bdata->name.full),
                                       .Contents = BS(buf),
@@ -326,8 +430,9 @@ init_compilation_unit(Buffer *bdata, bstring *buf)
       clangdata_t *cld = talloc_zero(bdata, clangdata_t);
       bdata->clangdata = cld;
       cld->bdata       = bdata;
-      cld->idx         = clang_createIndex(1, 0);
-      cld->argv        = comp_cmds;
+      cld->project     = proj;
+      cld->idx         = proj->idx;
+      cld->argv        = talloc_steal(cld, comp_cmds);
 
       talloc_set_destructor(cld, do_destroy_clangdata);
 
@@ -342,7 +447,7 @@ init_compilation_unit(Buffer *bdata, bstring *buf)
             handle_libclang_error(bdata, clerror);
       }
 
-      translationunit_t *stu = talloc(CTX, translationunit_t);
+      translationunit_t *stu = talloc_zero(CTX, translationunit_t);
       stu->buf  = talloc_move(stu, &buf);
       stu->tu   = cld->tu;
       stu->idx  = cld->idx;
@@ -551,16 +656,14 @@ clang_arg_append(str_vector *vec, char const *str, bool const cpy, int const fla
 }
 
 static str_vector *
-get_compile_commands(Buffer *bdata)
+get_compile_commands(Buffer *bdata, CXCompilationDatabase db)
 {
-      CXCompilationDatabase db = find_compilation_database(bdata);
       if (!db)
             return get_backup_commands(bdata);
 
       CXCompileCommands cmds = get_clang_compile_commands_for_file(&db, bdata);
       if (!cmds) {
             warnx("Using backup commands.\n");
-            clang_CompilationDatabase_dispose(db);
             return get_backup_commands(bdata);
       }
 
@@ -668,8 +771,6 @@ get_compile_commands(Buffer *bdata)
       argv_append(ret, BS(bdata->name.path), true);
 
       clang_CompileCommands_dispose(cmds);
-      clang_CompilationDatabase_dispose(db);
-
       return ret;
 }
 
@@ -772,29 +873,392 @@ find_compilation_database(Buffer *bdata)
       return db;
 }
 
+/*======================================================================================*/
+/*
+ * Everything the translation units of one project can share: a single index, and
+ * the compilation database together with the arguments already worked out for each
+ * file. Otherwise every buffer opened would re-read compile_commands.json, perhaps
+ * from several directories, and set up an index of its own. A project is keyed by
+ * its top_dir and lives as long as one of its buffers has a translation unit.
+ */
+struct clang_project {
+      bstring              *topdir;
+      CXIndex               idx;
+      CXCompilationDatabase db;
+      bool                  searched; /* Whether `db' has been looked for yet. */
+      unsigned              refs;
+      pthread_mutex_t       mtx;      /* Protects `db', `searched' and `files'. */
+      struct project_file  *files;
+      struct clang_project *next;
+};
+
+struct project_file {
+      bstring             *name;
+      str_vector          *argv;
+      struct project_file *next;
+};
+
+static struct clang_project *projects     = NULL;
+static pthread_mutex_t       projects_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct clang_project *
+project_acquire(Buffer *bdata)
+{
+      struct clang_project *proj;
+
+      pthread_mutex_lock(&projects_mtx);
+      for (proj = projects; proj; proj = proj->next)
+            if (b_iseq(proj->topdir, bdata->topdir->pathname))
+                  break;
+
+      if (!proj) {
+            proj         = talloc_zero(NULL, struct clang_project);
+            proj->topdir = talloc_steal(proj, b_strcpy(bdata->topdir->pathname));
+            proj->idx    = clang_createIndex(1, 0);
+            proj->next   = projects;
+            pthread_mutex_init(&proj->mtx);
+            projects = proj;
+      }
+
+      ++proj->refs;
+      pthread_mutex_unlock(&projects_mtx);
+      return proj;
+}
+
+/* Only to be called once the translation unit that used the project is disposed. */
+static void
+project_release(struct clang_project *proj)
+{
+      pthread_mutex_lock(&projects_mtx);
+      if (--proj->refs > 0) {
+            pthread_mutex_unlock(&projects_mtx);
+            return;
+      }
+
+      for (struct clang_project **pp = &projects; *pp; pp = &(*pp)->next) {
+            if (*pp == proj) {
+                  *pp = proj->next;
+                  break;
+            }
+      }
+      pthread_mutex_unlock(&projects_mtx);
+
+      if (proj->db)
+            clang_CompilationDatabase_dispose(proj->db);
+      clang_disposeIndex(proj->idx);
+      pthread_mutex_destroy(&proj->mtx);
+      talloc_free(proj);
+}
+
+static void
+project_forget_commands(struct clang_project *proj)
+{
+      pthread_mutex_lock(&proj->mtx);
+      if (proj->db)
+            clang_CompilationDatabase_dispose(proj->db);
+      proj->db       = NULL;
+      proj->searched = false;
+      while (proj->files) {
+            struct project_file *next = proj->files->next;
+            talloc_free(proj->files);
+            proj->files = next;
+      }
+      pthread_mutex_unlock(&proj->mtx);
+}
+
+/*
+ * Returns a fresh copy of the arguments to compile the buffer's file with. The
+ * database is loaded the first time any file of the project asks for it, and the
+ * arguments for each file are only worked out once.
+ */
+static str_vector *
+project_compile_commands(struct clang_project *proj, Buffer *bdata)
+{
+      struct project_file *file;
+
+      pthread_mutex_lock(&proj->mtx);
+      if (!proj->searched) {
+            proj->db       = find_compilation_database(bdata);
+            proj->searched = true;
+      }
+
+      for (file = proj->files; file; file = file->next)
+            if (b_iseq(file->name, bdata->name.full))
+                  break;
+
+      if (!file) {
+            file        = talloc(proj, struct project_file);
+            file->name  = talloc_steal(file, b_strcpy(bdata->name.full));
+            file->argv  = talloc_steal(file, get_compile_commands(bdata, proj->db));
+            file->next  = proj->files;
+            proj->files = file;
+      }
+
+      str_vector *ret = argv_create(file->argv->qty + 1U);
+      for (unsigned i = 0; i < file->argv->qty; ++i)
+            argv_append(ret, file->argv->lst[i], true);
+      pthread_mutex_unlock(&proj->mtx);
+
+      return ret;
+}
+
 /*======================================================================================*/
 
 static int
 destroy_struct_translationunit(translationunit_t *stu)
 {
-      if (stu->cxtokens && stu->num)
-            clang_disposeTokens(stu->tu, stu->cxtokens, stu->num);
-
-      genlist_destroy(stu->tokens);
+      release_tokens(stu);
       talloc_free(stu->buf);
-      talloc_free(stu->cxcursors);
       talloc_free(stu);
       return 0;
 }
 
+/*--------------------------------------------------------------------------------------*/
+
+struct body_search {
+      CXFile   file;
+      unsigned first; /* Lines are 1-based and inclusive here, as clang has them. */
+      unsigned last;
+      unsigned func_first;
+      unsigned func_last;
+      bool     found;
+};
+
+static void
+cursor_lines(CXCursor cursor, CXFile *file, unsigned *first, unsigned *last)
+{
+      CXSourceRange const ext = clang_getCursorExtent(cursor);
+      clang_getExpansionLocation(clang_getRangeStart(ext), file, first, NULL, NULL);
+      clang_getExpansionLocation(clang_getRangeEnd(ext), NULL, last, NULL, NULL);
+}
+
+static enum CXChildVisitResult
+body_visitor(CXCursor cursor, UNUSED CXCursor parent, CXClientData client_data)
+{
+      struct body_search *bs = client_data;
+      unsigned            first, last;
+
+      if (clang_getCursorKind(cursor) != CXCursor_CompoundStmt)
+            return CXChildVisit_Continue;
+
+      /* The lines holding the braces may also hold part of the signature. */
+      cursor_lines(cursor, NULL, &first, &last);
+      bs->found = first < bs->first && last > bs->last;
+      return CXChildVisit_Break;
+}
+
+static enum CXChildVisitResult
+decl_visitor(CXCursor cursor, UNUSED CXCursor parent, CXClientData client_data)
+{
+      struct body_search *bs = client_data;
+      CXFile              file;
+      unsigned            first, last;
+
+      if (!clang_Location_isFromMainFile(clang_getCursorLocation(cursor)))
+            return CXChildVisit_Continue;
+      cursor_lines(cursor, &file, &first, &last);
+      if (!clang_File_isEqual(file, bs->file) || first > bs->first || last < bs->last)
+            return CXChildVisit_Continue;
+
+      switch (clang_getCursorKind(cursor)) {
+      case CXCursor_Namespace:
+      case CXCursor_LinkageSpec:
+      case CXCursor_StructDecl:
+      case CXCursor_ClassDecl:
+      case CXCursor_UnionDecl:
+      case CXCursor_ClassTemplate:
+            return CXChildVisit_Recurse;
+
+      case CXCursor_FunctionDecl:
+      case CXCursor_CXXMethod:
+      case CXCursor_Constructor:
+      case CXCursor_Destructor:
+      case CXCursor_ConversionFunction:
+      case CXCursor_FunctionTemplate:
+            if (clang_isCursorDefinition(cursor)) {
+                  clang_visitChildren(cursor, &body_visitor, bs);
+                  bs->func_first = first;
+                  bs->func_last  = last;
+            }
+            return CXChildVisit_Break;
+
+      default:
+            return CXChildVisit_Break;
+      }
+}
+
+/*
+ * An edit confined to the body of one function can only change how the code in that
+ * function is classified. If the lines [*first, *last) are such an edit, widen them to
+ * the whole function and return true. Anything else, from a changed declaration to a
+ * preprocessor directive, may affect the rest of the file and needs a full pass.
+ */
+static bool
+edit_within_function_body(translationunit_t *stu, CXFile file, int *first, int *last)
+{
+      struct body_search bs = {
+          .file  = file,
+          .first = (unsigned)*first + 1U,
+          .last  = (unsigned)*last,
+          .found = false,
+      };
+
+      /* A directive inside a body still falls within its extent. */
+      if (lines_have_directive(stu->buf, line_offset(stu, file, *first), *last - *first))
+            return false;
+
+      clang_visitChildren(clang_getTranslationUnitCursor(stu->tu), &decl_visitor, &bs);
+      if (!bs.found)
+            return false;
+
+      *first = (int)bs.func_first - 1;
+      *last  = (int)bs.func_last;
+      return true;
+}
+
+/*
+ * Whether any of the `nlines' lines starting at byte `offset' is a preprocessing
+ * directive, or the first of them continues the line before it.
+ */
+static bool
+lines_have_directive(bstring const *text, int64_t const offset, int const nlines)
+{
+      uint8_t const *ptr = text->data + offset;
+      uint8_t const *end = text->data + text->slen;
+
+      if (offset >= 2 && ptr[-1] == '\n' &&
+          (ptr[-2] == '\\' || (offset >= 3 && ptr[-2] == '\r' && ptr[-3] == '\\')))
+            return true;
+
+      for (int i = 0; i < nlines && ptr < end; ++i) {
+            while (ptr < end && (*ptr == ' ' || *ptr == '\t'))
+                  ++ptr;
+            if (ptr < end && *ptr == '#')
+                  return true;
+            if (!(ptr = memchr(ptr, '\n', (size_t)PSUB(end, ptr))))
+                  break;
+            ++ptr;
+      }
+
+      return false;
+}
+
+static int64_t
+line_offset(translationunit_t *stu, CXFile file, int const line)
+{
+      unsigned offset;
+      clang_getFileLocation(clang_getLocation(stu->tu, file, (unsigned)line + 1U, 1),
+                            NULL, NULL, NULL, &offset);
+      return offset;
+}
+
+/*
+ * Paint the buffer from a saved AST while its translation unit is parsed for real.
+ * The full pass that follows is diffed against this, so normally it has little left
+ * to send. Returns false if there was no usable AST.
+ */
+static bool
+highlight_from_ast_cache(Buffer *bdata, struct clang_project *proj, bstring *text, uint32_t const ctick)
+{
+      str_vector       *argv = project_compile_commands(proj, bdata);
+      CXTranslationUnit tu   = ast_cache_load(bdata, proj->idx, argv, text);
+
+      if (tu) {
+            translationunit_t *stu  = talloc_zero(CTX, translationunit_t);
+            CXFile             file = clang_getFile(tu, BS(bdata->name.full));
+
+            stu->tu   = tu;
+            stu->idx  = proj->idx;
+            stu->buf  = text;
+            stu->ftid = bdata->ft->id;
+
+            tokenize_range(stu, &file, 0, text->slen);
+            hl_batch *batch = create_nvim_calls(bdata, stu, 0, -1);
+            batch->ctick    = ctick;
+            hl_batch_send(batch);
+
+            release_tokens(stu);
+            talloc_free(stu);
+            clang_disposeTranslationUnit(tu);
+      }
+
+      talloc_free(argv);
+      return tu != NULL;
+}
+
+/*
+ * Paint the buffer from a parse that skips every function body, which for a big
+ * file is a good deal quicker than the real thing. Types, functions, macros and
+ * everything else declared outside a function are all there; what is inside the
+ * bodies is filled in by the diffed full pass.
+ */
+static void
+highlight_from_skeleton(Buffer *bdata, struct clang_project *proj, bstring *text, uint32_t const ctick)
+{
+      str_vector          *argv    = project_compile_commands(proj, bdata);
+      CXTranslationUnit    tu      = NULL;
+      struct CXUnsavedFile unsaved = {.Filename = BS(bdata->name.full),
+                                      .Contents = BS(text),
+                                      .Length   = text->slen};
+
+      enum CXErrorCode const ret =
+          clang_parseTranslationUnit2(proj->idx, BS(bdata->name.full),
+                                      (char const **)argv->lst, (int)argv->qty,
+                                      &unsaved, 1, SKELETON_TUFLAGS, &tu);
+
+      if (ret == CXError_Success && tu) {
+            translationunit_t *stu  = talloc_zero(CTX, translationunit_t);
+            CXFile             file = clang_getFile(tu, BS(bdata->name.full));
+
+            stu->tu       = tu;
+            stu->idx      = proj->idx;
+            stu->buf      = text;
+            stu->ftid     = bdata->ft->id;
+            stu->skeleton = true;
+
+            tokenize_range(stu, &file, 0, text->slen);
+            hl_batch *batch = create_nvim_calls(bdata, stu, 0, -1);
+            batch->ctick    = ctick;
+            hl_batch_send(batch);
+
+            release_tokens(stu);
+            talloc_free(stu);
+      }
+
+      if (tu)
+            clang_disposeTranslationUnit(tu);
+      talloc_free(argv);
+}
+
+/* Drop the result of tokenize_range() so that it can be run again. */
+void
+release_tokens(translationunit_t *stu)
+{
+      if (stu->cxtokens && stu->num)
+            clang_disposeTokens(stu->tu, stu->cxtokens, stu->num);
+      talloc_free(stu->tokens);
+      talloc_free(stu->cxcursors);
+
+      stu->cxtokens  = NULL;
+      stu->cxcursors = NULL;
+      stu->tokens    = NULL;
+      stu->num       = 0;
+      stu->ntokens   = 0;
+}
+
 static int
 do_destroy_clangdata(clangdata_t *cdata)
 {
+      tu_manager_forget(cdata);
       if (cdata->argv)
             TALLOC_FREE(cdata->argv);
 
-      clang_disposeTranslationUnit(cdata->tu);
-      clang_disposeIndex(cdata->idx);
+      if (cdata->tu)
+            clang_disposeTranslationUnit(cdata->tu);
+      else if (settings.clang_workers > 0)
+            clang_worker_forget(cdata->bdata);
+      if (cdata->project)
+            project_release(cdata->project);
 
       return 0;
 }
@@ -802,15 +1266,30 @@ do_destroy_clangdata(clangdata_t *cdata)
 void
 destroy_clangdata(Buffer *bdata)
 {
-      clangdata_t *cdata = bdata->clangdata;
-      if (!cdata)
-            return;
-      do_destroy_clangdata(cdata);
-      bdata->clangdata = NULL;
+      /* The destructor does the work. Calling it directly would leave it to run a
+       * second time when the buffer is freed. */
+      if (bdata->clangdata)
+            TALLOC_FREE(bdata->clangdata);
 }
 
 /*======================================================================================*/
 
+static bool
+is_function_kind(enum CXCursorKind const kind)
+{
+      switch (kind) {
+      case CXCursor_FunctionDecl:
+      case CXCursor_FunctionTemplate:
+      case CXCursor_CXXMethod:
+      case CXCursor_Constructor:
+      case CXCursor_Destructor:
+      case CXCursor_ConversionFunction:
+            return true;
+      default:
+            return false;
+      }
+}
+
 static bool
 punctuation_sanity_check(CXCursor *cursor)
 {
@@ -820,10 +1299,9 @@ punctuation_sanity_check(CXCursor *cursor)
       return ret;
 }
 
-static token_t *
-get_token_data(translationunit_t *stu, CXToken *tok, CXCursor *cursor)
+static bool
+get_token_data(translationunit_t *stu, CXToken *tok, CXCursor *cursor, token_t *ret)
 {
-      token_t         *ret;
       resolved_range_t res;
       CXTokenKind      tokkind = clang_getTokenKind(*tok);
 
@@ -831,10 +1309,16 @@ get_token_data(translationunit_t *stu, CXToken *tok, CXCursor *cursor)
                                               punctuation_sanity_check(cursor))) ||
           !resolve_range(clang_getTokenExtent(stu->tu, *tok), &res))
       {
-            return NULL;
+            return false;
       }
 
-      ret = talloc_size(CTX, (size_t)offsetof(token_t, raw) + (size_t)res.len + SIZE_C(1));
+      /* With the bodies skipped, everything inside a function is annotated with the
+       * function itself. Only its name really refers to it. */
+      if (stu->skeleton && is_function_kind(cursor->kind) &&
+          !clang_equalLocations(clang_getCursorLocation(*cursor), clang_getTokenLocation(stu->tu, *tok)))
+      {
+            return false;
+      }
 
       ret->token      = *tok;
       ret->cursor     = *cursor;
@@ -846,21 +1330,17 @@ get_token_data(translationunit_t *stu, CXToken *tok, CXCursor *cursor)
       ret->offset     = res.offset1;
       ret->len        = res.len;
 
-      memcpy(ret->raw, stu->buf->data + res.offset1, res.len);
-
-      ret->raw[res.len] = '\0';
-      ret->text.data    = (unsigned char *)ret->raw;
-      ret->text.slen    = res.len;
-      ret->text.mlen    = res.len + 1;
-      ret->text.flags   = 0;
+      ret->text.data  = stu->buf->data + res.offset1;
+      ret->text.slen  = res.len;
+      ret->text.mlen  = 0;
+      ret->text.flags = 0;
 
-      return ret;
+      return true;
 }
 
-static void
+void
 tokenize_range(translationunit_t *stu, CXFile *file, int64_t const first, int64_t const last)
 {
-      token_t      *t;
       CXToken      *toks = NULL;
       unsigned      num  = 0;
       CXSourceRange rng =
@@ -874,9 +1354,11 @@ tokenize_range(translationunit_t *stu, CXFile *file, int64_t const first, int64_
       stu->cxtokens  = toks;
       stu->cxcursors = cursors;
       stu->num       = num;
-      stu->tokens    = genlist_create_alloc(stu, ((num * 2U) / 3U));
+      /* Room for every token up front, so the whole lot is one allocation. */
+      stu->tokens    = talloc_array(stu, token_t, num);
+      stu->ntokens   = 0;
 
       for (unsigned i = 0; i < num; ++i)
-            if ((t = get_token_data(stu, &toks[i], &cursors[i])))
-                  genlist_append(stu->tokens, t);
+            if (get_token_data(stu, &toks[i], &cursors[i], &stu->tokens[stu->ntokens]))
+                  ++stu->ntokens;
 }
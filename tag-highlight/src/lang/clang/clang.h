@@ -15,6 +15,10 @@ extern void destroy_clangdata(Buffer *bdata);
 extern NORETURN void *highlight_c_pthread_wrapper(void *vdata);
 extern void libclang_suspend_translationunit(Buffer *bdata);
 
+extern bool clang_worker_is_worker(char const *const *argv);
+extern int  clang_worker_main(void);
+extern void clang_worker_shutdown(void);
+
 
 #define libclang_highlight(...) P99_CALL_DEFARG(libclang_highlight, 4, __VA_ARGS__)
 #define libclang_highlight_defarg_1() (0)
@@ -54,8 +54,7 @@ __attribute__((used)) static const char *const idx_entity_kind_repr[] = {
                   if (0)                                                                 \
                         SHOUT("Adding call %d (aka \"%s\") in index on line %u\n", (CH), \
                               idx_entity_kind_repr[KIND], line_data.line);               \
-                  add_hl_call(data->calls, data->bdata->num, data->bdata->hl_id, group,  \
-                              &line_data);                                               \
+                  hl_batch_add(data->batch, group, &line_data);                          \
             }                                                                            \
       } while (0)
 
@@ -66,7 +65,7 @@ struct idx_data {
       Filetype          *ft;
       clangdata_t       *cdata;
       translationunit_t *stu;
-      mpack_arg_array   *calls;
+      hl_batch          *batch;
       unsigned           cnt;
       FILE              *fp;
 };
@@ -76,13 +75,13 @@ struct idx_data {
 #define DAT(data)   ((struct idx_data *)(data))
 
 void
-lc_index_file(Buffer *bdata, translationunit_t *stu, mpack_arg_array *calls)
+lc_index_file(Buffer *bdata, translationunit_t *stu, hl_batch *batch)
 {
       struct idx_data  data = {bdata,
                                bdata->ft,
                                CLD(bdata),
                                stu,
-                               calls,
+                               batch,
                                0U,
                                fopen_fmt("wb", "%*s/index.log", BSC(settings.cache_dir))};
       
@@ -111,8 +110,9 @@ UNUSED
 static token_t *
 mktok(const CXCursor *cursor, const CXString *dispname, const resolved_range_t *rng)
 {
-      size_t   len    = strlen(CS(*dispname)) + 1LLU;
-      token_t *ret    = malloc(offsetof(token_t, raw) + len);
+      size_t   len    = strlen(CS(*dispname));
+      token_t *ret    = malloc(sizeof(token_t) + len + 1LLU);
+      char    *raw    = (char *)(ret + 1);
       ret->cursor     = *cursor;
       ret->cursortype = clang_getCursorType(*cursor);
       ret->line       = rng->line - 1;
@@ -120,7 +120,11 @@ mktok(const CXCursor *cursor, const CXString *dispname, const resolved_range_t *
       ret->col2       = rng->end - 1;
       ret->len        = rng->end - rng->start;
 
-      memcpy(ret->raw, CS(*dispname), len);
+      memcpy(raw, CS(*dispname), len + 1LLU);
+      ret->text.data  = (unsigned char *)raw;
+      ret->text.slen  = len;
+      ret->text.mlen  = len + 1;
+      ret->text.flags = 0;
 
       return ret;
 }
@@ -12,6 +12,24 @@
 __BEGIN_DECLS
 /*======================================================================================*/
 
+#define TUFLAGS                                                    \
+        (  CXTranslationUnit_KeepGoing                             \
+         /* | CXTranslationUnit_Incomplete */                      \
+         | CXTranslationUnit_PrecompiledPreamble                   \
+         | CXTranslationUnit_CreatePreambleOnFirstParse      \
+         | CXTranslationUnit_IgnoreNonErrorsFromIncludedFiles      \
+         /* | CXTranslationUnit_RetainExcludedConditionalBlocks */ \
+         | CXTranslationUnit_DetailedPreprocessingRecord           \
+         /* | CXTranslationUnit_IncludeAttributedTypes */          \
+         /* | CXTranslationUnit_VisitImplicitAttributes */         \
+         /* | CXTranslationUnit_ForSerialization */                \
+         /* | CXTranslationUnit_CacheCompletionResults */          \
+         /* | CXTranslationUnit_SkipFunctionBodies */                    \
+         /* | CXTranslationUnit_LimitSkipFunctionBodiesToPreamble */     \
+         /* | CXTranslationUnit_CXXChainedPCH */                   \
+         /* | CXTranslationUnit_SingleFileParse */                 \
+        )
+
 #define TMPSIZ    (SAFE_PATH_MAX + 1)
 #define CS(CXSTR) (clang_getCString(CXSTR))
 #define CLD(s)                                                         \
@@ -25,24 +43,40 @@ typedef struct translationunit translationunit_t;
 typedef struct token           token_t;
 typedef struct resolved_range  resolved_range_t;
 
+struct clang_project;
+
 struct clangdata {
-        Buffer             *bdata;
-        str_vector         *argv;
-        CXIndex             idx;
-        CXTranslationUnit   tu;
-        CXFile              mainfile;
-        char                tmp_name[TMPSIZ];
+        Buffer               *bdata;
+        struct clang_project *project;
+        str_vector           *argv;
+        CXIndex               idx; /* Shared by the whole project; not ours to dispose. */
+        CXTranslationUnit     tu;
+        CXFile                mainfile;
+        char                  tmp_name[TMPSIZ];
+
+        struct { /* Guarded by the translation unit manager. */
+                clangdata_t *prev;
+                clangdata_t *next;
+                size_t       mem;
+                bool         tracked;
+                bool         suspended;
+        } lru;
 };
 
+struct type_cache;
+
 struct translationunit {
         bstring           *buf;
-        genlist           *tokens;
+        token_t           *tokens;    /* One flat array, `ntokens' long. */
+        struct type_cache *typecache; /* Lives exactly as long as this parse. */
         CXToken           *cxtokens;
         CXCursor          *cxcursors;
         CXTranslationUnit  tu;
         CXIndex            idx;
         unsigned           num;
+        unsigned           ntokens;
         nvim_filetype_id   ftid;
+        bool               skeleton; /* Parsed without function bodies. */
 };
 
 
@@ -52,8 +86,7 @@ struct token {
         CXToken     token;
         CXTokenKind tokenkind;
         unsigned    line, col1, col2, offset, len;
-        bstring     text;
-        char        raw[];
+        bstring     text; /* Points into the translation unit's buffer; not terminated. */
 };
 
 struct resolved_range {
@@ -66,13 +99,26 @@ struct resolved_range {
 
 #define INTERN __attribute__((__visibility__("hidden"))) extern
 
-INTERN mpack_arg_array  *create_nvim_calls(Buffer *bdata, translationunit_t *stu);
+INTERN hl_batch         *create_nvim_calls(Buffer *bdata, translationunit_t *stu, int first, int last);
 INTERN IndexerCallbacks *make_cb_struct(void);
 
-INTERN void lc_index_file(Buffer *bdata, translationunit_t *stu, mpack_arg_array *calls);
+INTERN void lc_index_file(Buffer *bdata, translationunit_t *stu, hl_batch *batch);
+INTERN int  lc_classify_token(translationunit_t *stu, token_t *tok, CXCursor *prev);
+INTERN void tokenize_range(translationunit_t *stu, CXFile *file, int64_t first, int64_t last);
+INTERN void release_tokens(translationunit_t *stu);
 INTERN bool resolve_range(CXSourceRange r, resolved_range_t *res);
 INTERN void get_tmp_path(char *buf);
 
+INTERN CXTranslationUnit ast_cache_load(Buffer *bdata, CXIndex idx, str_vector const *argv, bstring const *text);
+INTERN void              ast_cache_save(Buffer *bdata, CXTranslationUnit tu, str_vector const *argv, bstring const *text);
+
+INTERN void tu_manager_touch(clangdata_t *cld);
+INTERN void tu_manager_suspend(clangdata_t *cld);
+INTERN void tu_manager_forget(clangdata_t *cld);
+
+INTERN bool clang_worker_highlight(Buffer *bdata, str_vector const *argv, bstring const *text, int64_t first, int64_t last, hl_batch *batch);
+INTERN void clang_worker_forget(Buffer *bdata);
+
 // INTERN char const *const libclang_CXCursorKind_repr[];
 
 #undef INTERN
@@ -0,0 +1,173 @@
+#include "clang.h"
+#include "intern.h"
+
+/*
+ * Every live translation unit is kept on one list, most recently used first. A unit
+ * goes to the front whenever it is parsed or reparsed, which happens after every edit
+ * and whenever its buffer gains focus. Once their combined size passes the budget in
+ * `tag_highlight#clang_memory_budget' (MiB, 0 for no limit), the coldest units are
+ * suspended, and if that isn't enough they are disposed of. The buffer gets its unit
+ * back the next time it is highlighted either way: a suspended unit is restored by
+ * the reparse and a disposed one is simply parsed again.
+ *
+ * Another buffer's unit is only touched if its language mutex can be had without
+ * waiting, so a buffer that is busy is never held up and never freed from under it.
+ */
+
+static pthread_mutex_t tu_mtx = PTHREAD_MUTEX_INITIALIZER;
+static clangdata_t    *lru_head;
+static clangdata_t    *lru_tail;
+static size_t          lru_total;
+
+static size_t measure(CXTranslationUnit tu);
+static void   unlink_unit(clangdata_t *cld);
+static void   enforce_budget(clangdata_t const *keep);
+
+//========================================================================================
+
+/*
+ * Note that `cld' was just used. Its buffer's language mutex must be held.
+ */
+void
+tu_manager_touch(clangdata_t *cld)
+{
+        size_t const mem = measure(cld->tu);
+
+        pthread_mutex_lock(&tu_mtx);
+        if (cld->lru.tracked)
+                unlink_unit(cld);
+
+        cld->lru.mem       = mem;
+        cld->lru.suspended = false;
+        cld->lru.tracked   = true;
+        cld->lru.prev      = NULL;
+        cld->lru.next      = lru_head;
+        if (lru_head)
+                lru_head->lru.prev = cld;
+        else
+                lru_tail = cld;
+        lru_head   = cld;
+        lru_total += mem;
+        pthread_mutex_unlock(&tu_mtx);
+
+        enforce_budget(cld);
+}
+
+/*
+ * Suspend `cld' and account for the memory that gives back. Its buffer's language
+ * mutex must be held.
+ */
+void
+tu_manager_suspend(clangdata_t *cld)
+{
+        clang_suspendTranslationUnit(cld->tu);
+        size_t const mem = measure(cld->tu);
+
+        pthread_mutex_lock(&tu_mtx);
+        if (cld->lru.tracked) {
+                lru_total          = lru_total - cld->lru.mem + mem;
+                cld->lru.mem       = mem;
+                cld->lru.suspended = true;
+        }
+        pthread_mutex_unlock(&tu_mtx);
+}
+
+/*
+ * Called as `cld' is destroyed.
+ */
+void
+tu_manager_forget(clangdata_t *cld)
+{
+        pthread_mutex_lock(&tu_mtx);
+        if (cld->lru.tracked)
+                unlink_unit(cld);
+        pthread_mutex_unlock(&tu_mtx);
+}
+
+//========================================================================================
+
+static void
+enforce_budget(clangdata_t const *keep)
+{
+        size_t const budget  = (size_t)settings.clang_memory_budget << 20;
+        clangdata_t *victims = NULL;
+
+        if (budget == 0)
+                return;
+
+        pthread_mutex_lock(&tu_mtx);
+
+        /* A suspended unit comes back with a reparse, which has to happen anyway, so
+         * try that on everything cold before throwing any of them away. */
+        for (clangdata_t *cld = lru_tail; cld && lru_total > budget; cld = cld->lru.prev) {
+                if (cld == keep || cld->lru.suspended)
+                        continue;
+                if (pthread_mutex_trylock(&cld->bdata->lock.lang_mtx) != 0)
+                        continue;
+
+                size_t const before = cld->lru.mem;
+                clang_suspendTranslationUnit(cld->tu);
+                cld->lru.mem       = measure(cld->tu);
+                cld->lru.suspended = true;
+                lru_total          = lru_total - before + cld->lru.mem;
+                pthread_mutex_unlock(&cld->bdata->lock.lang_mtx);
+
+                warnd("Suspended translation unit \"%s\" (%zu KiB -> %zu KiB)",
+                      BS(cld->bdata->name.full), before >> 10, cld->lru.mem >> 10);
+        }
+
+        /* Each buffer stays locked until its unit is gone. They can't be destroyed
+         * here, since destroying one means taking this mutex again. */
+        for (clangdata_t *cld = lru_tail, *prev; cld && lru_total > budget; cld = prev) {
+                prev = cld->lru.prev;
+                if (cld == keep)
+                        continue;
+                if (pthread_mutex_trylock(&cld->bdata->lock.lang_mtx) != 0)
+                        continue;
+                unlink_unit(cld);
+                cld->lru.next = victims;
+                victims       = cld;
+        }
+
+        pthread_mutex_unlock(&tu_mtx);
+
+        while (victims) {
+                Buffer *bdata = victims->bdata;
+                victims       = victims->lru.next;
+
+                warnd("Disposing of translation unit \"%s\" to stay within %u MiB",
+                      BS(bdata->name.full), settings.clang_memory_budget);
+                destroy_clangdata(bdata);
+                pthread_mutex_unlock(&bdata->lock.lang_mtx);
+        }
+}
+
+static void
+unlink_unit(clangdata_t *cld)
+{
+        if (cld->lru.prev)
+                cld->lru.prev->lru.next = cld->lru.next;
+        else
+                lru_head = cld->lru.next;
+        if (cld->lru.next)
+                cld->lru.next->lru.prev = cld->lru.prev;
+        else
+                lru_tail = cld->lru.prev;
+
+        lru_total       -= cld->lru.mem;
+        cld->lru.prev    = cld->lru.next = NULL;
+        cld->lru.tracked = false;
+}
+
+static size_t
+measure(CXTranslationUnit tu)
+{
+        CXTUResourceUsage usage = clang_getCXTUResourceUsage(tu);
+        size_t            total = 0;
+
+        for (unsigned i = 0; i < usage.numEntries; ++i)
+                total += usage.entries[i].amount;
+
+        clang_disposeCXTUResourceUsage(usage);
+        return total;
+}
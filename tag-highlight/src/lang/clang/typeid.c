@@ -13,17 +13,25 @@
       P01_CLANG_DIAGNOSTIC_IGNORED(-Wgnu-case-range) \
       P01_GCC_DIAGNOSTIC_IGNORED(-Wpedantic)
 
-static void do_typeswitch(Buffer            *bdata,
-                          mpack_arg_array   *calls,
-                          token_t           *tok,
-                          CXCursor *last);
+struct type_cache;
+
+static int do_typeswitch(nvim_filetype_id   ftid,
+                         token_t           *tok,
+                         CXCursor *last,
+                         struct type_cache *cache);
 
 static UNUSED void translationunit_visitor(Buffer *bdata, translationunit_t *stu);
 
 static bool tok_in_skip_list(Buffer *bdata, token_t *tok) __attribute__((pure));
+static bool tok_text_eq(token_t const *tok, char const *str) __attribute__((pure));
 static bool sanity_check_name(token_t *tok, CXCursor cursor);
 static bool is_really_template_parameter(token_t *tok, CXCursor cursor);
 
+static struct type_cache *type_cache_get(translationunit_t *stu);
+static CXCursor           type_cache_reference(CXCursor cursor);
+static bool               type_cache_find(struct type_cache *cache, token_t const *tok, CXCursor ref, CXCursor *final, int *group);
+static void               type_cache_add(struct type_cache *cache, token_t const *tok, CXCursor ref, CXCursor final, int group);
+
 UNUSED static void braindead(token_t *tok, int ngotos, CXCursor *provided);
 UNUSED static void slightly_less_braindead(CXFile file, CXCursor cursor, int ngotos);
 
@@ -31,16 +39,24 @@ UNUSED static void slightly_less_braindead(CXFile file, CXCursor cursor, int ngo
 
 static thread_local FILE *dump_fp = NULL;
 
-mpack_arg_array *
-create_nvim_calls(Buffer *bdata, translationunit_t *stu)
+/*
+ * Turns the tokens of `stu' into highlights replacing any on the lines [first, last),
+ * where a `last' of -1 means the end of the buffer.
+ */
+hl_batch *
+create_nvim_calls(Buffer *bdata, translationunit_t *stu, int const first, int const last)
 {
-      CXCursor last = clang_getNullCursor();
-      mpack_arg_array  *calls = new_arg_array();
+      CXCursor           prev  = clang_getNullCursor();
+      hl_batch          *batch = new_hl_batch(bdata);
+      struct type_cache *cache = type_cache_get(stu);
+      unsigned const     hits  = cache->hits;
+      unsigned const     seen  = cache->hits + cache->misses;
+      struct timer       tm;
 
       if (bdata->hl_id == 0)
             bdata->hl_id = nvim_buf_add_highlight(bdata->num);
       else
-            add_clr_call(calls, (int)bdata->num, bdata->hl_id, 0, -1);
+            hl_batch_clear(batch, first, last);
 
 #if defined DEBUG
       dump_fp = fopen_fmt("wb", "%s/garbage.log", BS(settings.cache_dir));
@@ -48,20 +64,39 @@ create_nvim_calls(Buffer *bdata, translationunit_t *stu)
       /* translationunit_visitor(bdata, stu); */
       /* fputs("\n\n\n", dump_fp);            */
 
-      for (unsigned i = 0; i < stu->tokens->qty; ++i) {
-            token_t *tok = stu->tokens->lst[i];
+      TIMER_START(&tm);
+      for (unsigned i = 0; i < stu->ntokens; ++i) {
+            token_t *tok = &stu->tokens[i];
             if (((int)tok->line) == -1) {
                   if (dump_fp)
-                        fprintf(dump_fp, "Token \"%s\" isn't even in the damned file?!\n", tok->raw);
+                        fprintf(dump_fp, "Token \"%.*s\" isn't even in the damned file?!\n", BSC(&tok->text));
                   continue;
             }
             if (tok_in_skip_list(bdata, tok)) {
                   if (dump_fp)
-                        fprintf(dump_fp, "Token \"%s\" is to be skipped.\n", tok->raw);
+                        fprintf(dump_fp, "Token \"%.*s\" is to be skipped.\n", BSC(&tok->text));
                   continue;
             }
 
-            do_typeswitch(bdata, calls, tok, &last);
+            int const kind = do_typeswitch(bdata->ft->id, tok, &prev, cache);
+            if (kind) {
+                  bstring const *group = find_group(bdata->ft, kind);
+                  if (group)
+                        hl_batch_add(batch, group, (line_data[]){{tok->line, tok->col1, tok->col2}});
+            }
+      }
+
+      {
+            struct timespec diff;
+            (void)timespec_get(&tm.tv2, TIME_UTC);
+            TIMESPEC_SUB(&tm.tv2, &tm.tv1, &diff);
+
+            unsigned const nhits = cache->hits - hits;
+            unsigned const nall  = cache->hits + cache->misses - seen;
+            if (nall > 0)
+                  warnd("Classified %u tokens in %.2fms; %u of %u lookups (%.1f%%) came from the cache",
+                        stu->ntokens, TIMESPEC2DOUBLE(&diff) * 1000.0,
+                        nhits, nall, 100.0 * nhits / nall);
       }
 
 #if defined DEBUG
@@ -74,35 +109,45 @@ create_nvim_calls(Buffer *bdata, translationunit_t *stu)
 
 #if 0
       if (bdata->ft->id == FT_CXX)
-            lc_index_file(bdata, stu, calls);
+            lc_index_file(bdata, stu, batch);
 #endif
 
-      return calls;
+      return batch;
 }
 
 /*======================================================================================*/
 
 #define ADD_CALL(CH) (call_group = (CH))
 
-static void
-do_typeswitch(Buffer            *bdata,
-              mpack_arg_array   *calls,
+/*
+ * Returns the ctags kind `tok' is to be highlighted as, or 0 for none.
+ */
+static int
+do_typeswitch(nvim_filetype_id   ftid,
               token_t           *tok,
-              CXCursor *last)
+              CXCursor *last,
+              struct type_cache *cache)
 {
       CXCursor cursor = tok->cursor;
+      CXCursor ref    = type_cache_reference(cursor);
 
       int  goto_safety_count = 0;
       int  call_group        = 0;
       bool in_template       = false;
+      bool uses_last         = false;
 
 #ifdef DEBUG
       braindead(tok, 0, NULL);
 #endif
 
+      if (!clang_Cursor_isNull(ref) && type_cache_find(cache, tok, ref, &cursor, &call_group))
+            goto emit;
+
 retry:
-      if (goto_safety_count++ > 2)
+      if (goto_safety_count++ > 2) {
+            call_group = 0;
             goto skip;
+      }
 
       /*
        * XXX
@@ -140,7 +185,7 @@ retry:
              * declaration cursor and identify its type. The easiest way to do
              * this is to change the value of `cursor' and jump back to the top.
              */
-            if (bdata->ft->id == FT_CXX) {
+            if (ftid == FT_CXX) {
                   /* CXCursor newcurs = clang_getTypeDeclaration(tok->cursortype); */
                   /* CXType type      = clang_getCursorType(cursor);    */
                   /* CXCursor newcurs = clang_getTypeDeclaration(type); */
@@ -179,7 +224,7 @@ retry:
       /* Ordinary reference to a struct/class member. */
       case CXCursor_MemberRefExpr: {
             //CXType deftype = clang_getCanonicalType(clang_getCursorType(cursor));
-            if (bdata->ft->id == FT_CXX /*&& deftype.kind == CXType_Unexposed*/) {
+            if (ftid == FT_CXX /*&& deftype.kind == CXType_Unexposed*/) {
                   cursor = clang_getCursorReferenced(cursor);
                   /* slightly_less_braindead(NULL, cursor, goto_safety_count); */
                   /* cursor = clang_getCanonicalCursor(cursor); */
@@ -268,7 +313,7 @@ retry:
 
             if (what.kind == CXType_Int && clang_equalCursors(cursor, ref)) {
                   CXString spell = clang_getCursorSpelling(ref);
-                  if (STREQ(tok->raw, CS(spell)))
+                  if (tok_text_eq(tok, CS(spell)))
                         ADD_CALL(EXTENSION_TEMPLATE_TYPE_PARAM);
                   else
                         ADD_CALL(EXTENSION_TYPE_KEYWORD);
@@ -293,6 +338,7 @@ retry:
 
       /* Macros are trouble */
       case CXCursor_MacroDefinition:
+            uses_last = true;
             if (last->kind == CXCursor_PreprocessingDirective)
                   ADD_CALL(CTAGS_PREPROC);
             break;
@@ -314,7 +360,7 @@ retry:
             case CXType_FunctionNoProto:
             case CXType_Atomic:
             case CXType_Typedef:
-                  if (bdata->ft->id == FT_CXX) {
+                  if (ftid == FT_CXX) {
                         CXCursor ref = clang_getCursorReferenced(cursor);
                         switch (ref.kind) {
                         case CXCursor_NonTypeTemplateParameter:
@@ -352,7 +398,7 @@ retry:
             case CXType_Long:
             case CXType_LongLong:
             primative_type:
-                  if (bdata->ft->id == FT_C) {
+                  if (ftid == FT_C) {
                         CXCursor ref = clang_getCursorReferenced(cursor);
                         switch (ref.kind) {
                         case CXCursor_EnumConstantDecl:
@@ -368,8 +414,9 @@ retry:
                   break;
 
             case CXType_Dependent:
-                  if (bdata->ft->id == FT_CXX) {
+                  if (ftid == FT_CXX) {
                         CXType ltype = clang_getCursorType(*last);
+                        uses_last    = true;
                         if (ltype.kind == CXType_Enum)
                               ADD_CALL(CTAGS_ENUMCONST);
                   } else {
@@ -432,18 +479,177 @@ retry:
             break;
       }
 
-      if (call_group) {
-            const bstring *group = find_group(bdata->ft, call_group);
-            if (group)
-                  add_hl_call(calls, (int)bdata->num, bdata->hl_id, group,
-                              (line_data[]){{tok->line, tok->col1, tok->col2}});
-      }
-
 skip:
+      if (!clang_Cursor_isNull(ref) && !uses_last)
+            type_cache_add(cache, tok, ref, cursor, call_group);
+
+emit:
 #ifdef DEBUG
       /* braindead(tok, goto_safety_count, &cursor); */
 #endif
       *last = cursor;
+      return call_group;
+}
+
+/*
+ * Classify one token of `stu' on its own, for callers that have no Buffer to hand.
+ * Tokens must be given in order, with `prev' starting out as the null cursor.
+ */
+int
+lc_classify_token(translationunit_t *stu, token_t *tok, CXCursor *prev)
+{
+      return do_typeswitch(stu->ftid, tok, prev, type_cache_get(stu));
+}
+
+/*======================================================================================*/
+
+/*
+ * The same few declarations are referred to over and over again in a file, and
+ * working out what each one is can take several trips through libclang. The answer
+ * for a reference depends only on what kind of reference it is, what it refers to
+ * and the token's text, so it is remembered under those for as long as the
+ * translation unit stays the same, which is the life of `stu'. A reparse starts
+ * with a fresh cache.
+ */
+
+struct type_cache_entry {
+      CXCursor    ref;
+      CXCursor    final;
+      uint64_t    hash; /* 0 for an empty slot. */
+      uint64_t    texthash;
+      int         group;
+      int         kind;
+      CXTokenKind tokenkind;
+};
+
+struct type_cache {
+      struct type_cache_entry *tab;
+      unsigned                 size; /* Always a power of 2. */
+      unsigned                 qty;
+      unsigned                 hits;
+      unsigned                 misses;
+};
+
+#define TYPE_CACHE_INITIAL_SIZE 1024U
+
+static struct type_cache *
+type_cache_get(translationunit_t *stu)
+{
+      if (!stu->typecache) {
+            struct type_cache *cache = talloc_zero(stu, struct type_cache);
+            cache->size    = TYPE_CACHE_INITIAL_SIZE;
+            cache->tab     = talloc_zero_array(cache, struct type_cache_entry, cache->size);
+            stu->typecache = cache;
+      }
+      return stu->typecache;
+}
+
+/*
+ * Only references are worth caching; everything else is classified by its kind
+ * alone. Returns the null cursor for anything that isn't cached.
+ */
+static CXCursor
+type_cache_reference(CXCursor const cursor)
+{
+      switch (cursor.kind) {
+      case CXCursor_TypeRef:
+      case CXCursor_MemberRef:
+      case CXCursor_MemberRefExpr:
+      case CXCursor_DeclRefExpr:
+      case CXCursor_VariableRef:
+            return clang_getCursorReferenced(cursor);
+      default:
+            return clang_getNullCursor();
+      }
+}
+
+static uint64_t
+hash_text(bstring const *text)
+{
+      return fnv1a(FNV1A_OFFSET_BASIS, text->data, text->slen);
+}
+
+static uint64_t
+entry_hash(token_t const *tok, CXCursor const ref, uint64_t const texthash)
+{
+      uint64_t hash = texthash;
+      hash = (hash ^ clang_hashCursor(ref))       * FNV1A_PRIME;
+      hash = (hash ^ (uint64_t)tok->cursor.kind)  * FNV1A_PRIME;
+      hash = (hash ^ (uint64_t)tok->tokenkind)    * FNV1A_PRIME;
+      return hash ? hash : 1;
+}
+
+static struct type_cache_entry *
+find_slot(struct type_cache *cache, token_t const *tok, CXCursor const ref,
+          uint64_t const hash, uint64_t const texthash)
+{
+      unsigned const mask = cache->size - 1;
+      for (unsigned i = (unsigned)hash & mask;; i = (i + 1) & mask) {
+            struct type_cache_entry *ent = &cache->tab[i];
+            if (ent->hash == 0)
+                  return ent;
+            if (ent->hash == hash && ent->texthash == texthash &&
+                ent->kind == (int)tok->cursor.kind && ent->tokenkind == tok->tokenkind &&
+                clang_equalCursors(ent->ref, ref))
+                  return ent;
+      }
+}
+
+static bool
+type_cache_find(struct type_cache *cache, token_t const *tok, CXCursor const ref,
+                CXCursor *final, int *group)
+{
+      uint64_t const           texthash = hash_text(&tok->text);
+      struct type_cache_entry *ent      = find_slot(cache, tok, ref, entry_hash(tok, ref, texthash), texthash);
+
+      if (ent->hash == 0) {
+            ++cache->misses;
+            return false;
+      }
+      ++cache->hits;
+      *final = ent->final;
+      *group = ent->group;
+      return true;
+}
+
+static void
+type_cache_add(struct type_cache *cache, token_t const *tok, CXCursor const ref,
+               CXCursor const final, int const group)
+{
+      /* Keep the table at most half full. */
+      if ((cache->qty + 1) * 2 > cache->size) {
+            struct type_cache_entry *old  = cache->tab;
+            unsigned const           size = cache->size;
+
+            cache->size *= 2;
+            cache->tab   = talloc_zero_array(cache, struct type_cache_entry, cache->size);
+            for (unsigned i = 0; i < size; ++i) {
+                  if (old[i].hash) {
+                        unsigned j = (unsigned)old[i].hash & (cache->size - 1);
+                        while (cache->tab[j].hash)
+                              j = (j + 1) & (cache->size - 1);
+                        cache->tab[j] = old[i];
+                  }
+            }
+            talloc_free(old);
+      }
+
+      uint64_t const           texthash = hash_text(&tok->text);
+      uint64_t const           hash     = entry_hash(tok, ref, texthash);
+      struct type_cache_entry *ent      = find_slot(cache, tok, ref, hash, texthash);
+
+      if (ent->hash == 0) {
+            *ent = (struct type_cache_entry){
+                .ref       = ref,
+                .final     = final,
+                .hash      = hash,
+                .texthash  = texthash,
+                .group     = group,
+                .kind      = tok->cursor.kind,
+                .tokenkind = tok->tokenkind,
+            };
+            ++cache->qty;
+      }
 }
 
 /*======================================================================================*/
@@ -497,13 +703,21 @@ tok_in_skip_list(Buffer *bdata, token_t *tok)
       return B_LIST_BSEARCH_FAST(bdata->ft->ignored_tags, tmp) != NULL;
 }
 
+/* A token's text isn't terminated, since it points straight into the buffer. */
+static bool
+tok_text_eq(token_t const *tok, char const *str)
+{
+      size_t const len = strlen(str);
+      return len == tok->text.slen && memcmp(tok->text.data, str, len) == 0;
+}
+
 static bool
 sanity_check_name(token_t *tok, CXCursor cursor)
 {
       CXCursor newcurs = clang_getTypeDeclaration(tok->cursortype);
       CXString name1   = clang_getCursorSpelling(cursor);
       CXString name2   = clang_getCursorDisplayName(newcurs);
-      bool     tmp     = STREQ(tok->raw, CS(name1)) || STREQ(tok->raw, CS(name2));
+      bool     tmp     = tok_text_eq(tok, CS(name1)) || tok_text_eq(tok, CS(name2));
       free_cxstrings(name1, name2);
       return tmp;
 }
@@ -512,7 +726,7 @@ static bool
 is_really_template_parameter(token_t *tok, CXCursor cursor)
 {
       CXString   spell = clang_getCursorSpelling(cursor);
-      bool const ret   = !STREQ(tok->raw, CS(spell));
+      bool const ret   = !tok_text_eq(tok, CS(spell));
       clang_disposeString(spell);
       return ret;
 }
@@ -0,0 +1,634 @@
+#include "clang.h"
+#include "intern.h"
+
+#ifndef _WIN32
+#  include <poll.h>
+#  include <sys/socket.h>
+#  include <sys/wait.h>
+#  ifndef SOCK_CLOEXEC
+#    define SOCK_CLOEXEC 0
+#  endif
+#  ifndef MSG_NOSIGNAL
+#    define MSG_NOSIGNAL 0
+#  endif
+#endif
+
+/*
+ * With `tag_highlight#clang_workers' set above 0, C and C++ files are parsed in that
+ * many worker processes instead of in this one. A worker is this same program run
+ * with the single argument WORKER_ARG. It keeps the translation units of the buffers
+ * sent to it, and it does the classification as well, so only the results come back.
+ * All buffers of one project go to the same worker, and each new project goes to the
+ * worker with the fewest, so that different projects are parsed side by side.
+ *
+ * A worker that crashes, stops answering for WORKER_TIMEOUT_MS, or grows past
+ * `tag_highlight#clang_worker_max_mb' is replaced. Only the request it was busy with
+ * fails. The buffers it held are parsed from scratch by the new worker the next time
+ * they are highlighted.
+ *
+ * Each message is a msgpack array preceded by its length as a native 32 bit integer.
+ *
+ *   [WORKER_PARSE, bufnum, filename, [args...], text, filetype, first, last, [ignored...]]
+ *       -> [status, rss in KiB, results]
+ *   [WORKER_DISPOSE, bufnum]
+ *       -> (no reply)
+ *
+ * `first' and `last' are the byte range to report on. `results' is a string holding
+ * four native 32 bit integers per highlighted token: line, start column, end column
+ * and ctags kind. `status' is 0 or the libclang error code.
+ */
+
+#define WORKER_ARG        "--clang-worker"
+#define WORKER_TIMEOUT_MS (120 * 1000)
+#define WORKER_NFIELDS    (4U)
+
+enum worker_request {
+        WORKER_PARSE   = 0,
+        WORKER_DISPOSE = 1,
+};
+
+#ifdef _WIN32
+
+bool
+clang_worker_highlight(UNUSED Buffer *bdata, UNUSED str_vector const *argv, UNUSED bstring const *text,
+                       UNUSED int64_t first, UNUSED int64_t last, UNUSED hl_batch *batch)
+{
+        SHOUT("Clang worker processes are not supported on Windows.");
+        return false;
+}
+
+void clang_worker_forget(UNUSED Buffer *bdata) {}
+void clang_worker_shutdown(void) {}
+int  clang_worker_main(void) { return EXIT_FAILURE; }
+bool clang_worker_is_worker(UNUSED char const *const *argv) { return false; }
+
+#else
+
+struct clang_worker {
+        pthread_mutex_t mtx;
+        pid_t           pid;      /* 0 while not running. */
+        int             sock;
+        unsigned        load;     /* Number of projects sent here. */
+        unsigned        restarts;
+        struct {
+                int     *lst;     /* Buffers to drop before the next parse. */
+                unsigned qty;
+        } dispose;
+};
+
+struct project_assignment {
+        bstring                   *topdir;
+        unsigned                   worker;
+        struct project_assignment *next;
+};
+
+static pthread_mutex_t            pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct clang_worker       *workers;
+static unsigned                   nworkers;
+static struct project_assignment *assignments;
+
+static struct clang_worker *worker_for(Buffer const *bdata);
+static bool                 start_worker(struct clang_worker *wk);
+static void                 stop_worker(struct clang_worker *wk, bool force);
+static bool                 flush_disposals(struct clang_worker *wk);
+static mpack_obj           *encode_parse(Buffer const *bdata, str_vector const *argv, bstring const *text, int64_t first, int64_t last);
+static bool                 write_message(int fd, mpack_obj const *pack);
+static bstring             *read_message(int fd, int timeout_ms);
+
+//========================================================================================
+
+/*
+ * Have a worker parse `text' and add its highlights for the bytes [first, last) to
+ * `batch'. Returns false if the worker failed.
+ */
+bool
+clang_worker_highlight(Buffer *bdata, str_vector const *argv, bstring const *text,
+                       int64_t const first, int64_t const last, hl_batch *batch)
+{
+        struct clang_worker *wk    = worker_for(bdata);
+        mpack_obj           *pack  = encode_parse(bdata, argv, text, first, last);
+        bstring             *reply = NULL;
+        bool                 ret   = false;
+
+        pthread_mutex_lock(&wk->mtx);
+        if ((wk->pid != 0 || start_worker(wk)) && flush_disposals(wk) &&
+            write_message(wk->sock, pack))
+                reply = read_message(wk->sock, WORKER_TIMEOUT_MS);
+        talloc_free(pack);
+
+        if (!reply) {
+                warnd("Clang worker %d failed on \"%s\" (%s); restarting it",
+                      wk->pid, BS(bdata->name.full), errno ? strerror(errno) : "end of file");
+                stop_worker(wk, true);
+                ++wk->restarts;
+                pthread_mutex_unlock(&wk->mtx);
+                return false;
+        }
+
+        bstring    view   = *reply;
+        mpack_obj *obj    = mpack_decode_obj(&view);
+        int64_t    status = (int64_t)mpack_index(obj, 0)->num;
+        uint64_t   rss    = mpack_index(obj, 1)->num;
+        bstring   *res    = mpack_index(obj, 2)->str;
+
+        if (status != 0) {
+                warnd("Clang worker failed to parse \"%s\" (%" PRId64 ")", BS(bdata->name.full), status);
+        } else {
+                unsigned const n = res->slen / (unsigned)(sizeof(uint32_t) * WORKER_NFIELDS);
+                for (unsigned i = 0; i < n; ++i) {
+                        uint32_t rec[WORKER_NFIELDS];
+                        memcpy(rec, res->data + (size_t)i * sizeof rec, sizeof rec);
+                        bstring const *group = find_group(bdata->ft, (int)rec[3]);
+                        if (group)
+                                hl_batch_add(batch, group, (line_data[]){{rec[0], rec[1], rec[2]}});
+                }
+                ret = true;
+        }
+
+        /* Everything libclang leaks stays with the worker, so once it gets too big the
+         * only cure is a new one. */
+        if (settings.clang_worker_max_mb && rss > (uint64_t)settings.clang_worker_max_mb << 10) {
+                warnd("Recycling clang worker %d (%" PRIu64 " MiB)", wk->pid, rss >> 10);
+                stop_worker(wk, false);
+        }
+        pthread_mutex_unlock(&wk->mtx);
+
+        mpack_destroy_object(obj);
+        b_free(reply);
+        return ret;
+}
+
+/*
+ * Drop whatever the workers hold for `bdata'. This never waits on a busy worker; the
+ * request is sent ahead of the worker's next parse.
+ */
+void
+clang_worker_forget(Buffer *bdata)
+{
+        pthread_mutex_lock(&pool_mtx);
+        for (unsigned i = 0; i < nworkers; ++i) {
+                struct clang_worker *wk = &workers[i];
+                if (wk->pid == 0)
+                        continue;
+                wk->dispose.lst = talloc_realloc(workers, wk->dispose.lst, int, wk->dispose.qty + 1);
+                wk->dispose.lst[wk->dispose.qty++] = (int)bdata->num;
+        }
+        pthread_mutex_unlock(&pool_mtx);
+}
+
+void
+clang_worker_shutdown(void)
+{
+        for (unsigned i = 0; i < nworkers; ++i) {
+                struct clang_worker *wk = &workers[i];
+                if (wk->restarts)
+                        warnd("Clang worker %u was restarted %u times", i, wk->restarts);
+
+                /* Don't wait for one that is still busy; it won't be missed. */
+                if (pthread_mutex_trylock(&wk->mtx) == 0) {
+                        stop_worker(wk, false);
+                        pthread_mutex_unlock(&wk->mtx);
+                } else if (wk->pid != 0) {
+                        kill(wk->pid, SIGKILL);
+                }
+        }
+}
+
+//========================================================================================
+
+static struct clang_worker *
+worker_for(Buffer const *bdata)
+{
+        struct project_assignment *asg;
+        pthread_mutex_lock(&pool_mtx);
+
+        if (!workers) {
+                nworkers = settings.clang_workers;
+                workers  = talloc_zero_array(NULL, struct clang_worker, nworkers);
+                for (unsigned i = 0; i < nworkers; ++i)
+                        pthread_mutex_init(&workers[i].mtx);
+        }
+
+        for (asg = assignments; asg; asg = asg->next)
+                if (b_iseq(asg->topdir, bdata->topdir->pathname))
+                        break;
+
+        if (!asg) {
+                unsigned best = 0;
+                for (unsigned i = 1; i < nworkers; ++i)
+                        if (workers[i].load < workers[best].load)
+                                best = i;
+                asg         = talloc(workers, struct project_assignment);
+                asg->topdir = talloc_steal(asg, b_strcpy(bdata->topdir->pathname));
+                asg->worker = best;
+                asg->next   = assignments;
+                assignments = asg;
+                ++workers[best].load;
+        }
+
+        struct clang_worker *wk = &workers[asg->worker];
+        pthread_mutex_unlock(&pool_mtx);
+        return wk;
+}
+
+static bool
+start_worker(struct clang_worker *wk)
+{
+        static char const *const self = "/proc/self/exe";
+
+        char const *exe = access(self, X_OK) == 0 ? self : program_invocation_name;
+        int         fds[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+                warn("socketpair()");
+                return false;
+        }
+
+        pid_t const pid = fork();
+        if (pid == 0) {
+                /* dup2() clears close-on-exec on the copies. */
+                if (dup2(fds[1], STDIN_FILENO) == (-1) || dup2(fds[1], STDOUT_FILENO) == (-1))
+                        _exit(127);
+                execl(exe, exe, WORKER_ARG, (char *)NULL);
+                _exit(127);
+        }
+
+        close(fds[1]);
+        if (pid == (-1)) {
+                warn("fork()");
+                close(fds[0]);
+                return false;
+        }
+
+        /* Whatever it was told to drop died with the old one. */
+        pthread_mutex_lock(&pool_mtx);
+        TALLOC_FREE(wk->dispose.lst);
+        wk->dispose.qty = 0;
+        wk->pid         = pid;
+        wk->sock        = fds[0];
+        pthread_mutex_unlock(&pool_mtx);
+
+        warnd("Started clang worker %d", pid);
+        return true;
+}
+
+/* The caller holds the worker's mutex. */
+static void
+stop_worker(struct clang_worker *wk, bool const force)
+{
+        int status;
+        if (wk->pid == 0)
+                return;
+
+        /* A worker exits by itself at the end of its input. */
+        shutdown(wk->sock, SHUT_RDWR);
+        close(wk->sock);
+        if (force)
+                kill(wk->pid, SIGKILL);
+        while (waitpid(wk->pid, &status, 0) == (-1) && errno == EINTR)
+                ;
+
+        pthread_mutex_lock(&pool_mtx);
+        wk->pid  = 0;
+        wk->sock = -1;
+        pthread_mutex_unlock(&pool_mtx);
+}
+
+/* The caller holds the worker's mutex. */
+static bool
+flush_disposals(struct clang_worker *wk)
+{
+        bool ret = true;
+        pthread_mutex_lock(&pool_mtx);
+
+        for (unsigned i = 0; i < wk->dispose.qty && ret; ++i) {
+                mpack_obj *pack = mpack_make_new(0, false);
+                mpack_encode_array(pack, NULL, 2);
+                mpack_encode_integer(pack, NULL, WORKER_DISPOSE);
+                mpack_encode_integer(pack, NULL, wk->dispose.lst[i]);
+                ret = write_message(wk->sock, pack);
+                talloc_free(pack);
+        }
+
+        TALLOC_FREE(wk->dispose.lst);
+        wk->dispose.qty = 0;
+        pthread_mutex_unlock(&pool_mtx);
+        return ret;
+}
+
+static mpack_obj *
+encode_parse(Buffer const *bdata, str_vector const *argv, bstring const *text,
+             int64_t const first, int64_t const last)
+{
+        b_list const *ignored = bdata->ft->ignored_tags;
+        mpack_obj    *pack    = mpack_make_new(0, false);
+
+        mpack_encode_array(pack, NULL, 9);
+        mpack_encode_integer(pack, NULL, WORKER_PARSE);
+        mpack_encode_integer(pack, NULL, bdata->num);
+        mpack_encode_string(pack, NULL, bdata->name.full);
+
+        mpack_encode_array(pack, NULL, argv->qty);
+        for (unsigned i = 0; i < argv->qty; ++i)
+                mpack_encode_string(pack, NULL, btp_fromblk(argv->lst[i], strlen(argv->lst[i])));
+
+        mpack_encode_string(pack, NULL, text);
+        mpack_encode_integer(pack, NULL, bdata->ft->id);
+        mpack_encode_integer(pack, NULL, first);
+        mpack_encode_integer(pack, NULL, last);
+
+        mpack_encode_array(pack, NULL, ignored ? ignored->qty : 0);
+        for (unsigned i = 0; ignored && i < ignored->qty; ++i)
+                mpack_encode_string(pack, NULL, ignored->lst[i]);
+
+        return pack;
+}
+
+//========================================================================================
+
+static bool
+write_all(int const fd, void const *buf, size_t len)
+{
+        uint8_t const *ptr = buf;
+        while (len > 0) {
+                /* A dead worker mustn't take us down with a SIGPIPE. */
+                ssize_t const n = send(fd, ptr, len, MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+                ptr += n;
+                len -= (size_t)n;
+        }
+        return true;
+}
+
+static bool
+read_all(int const fd, void *buf, size_t len, int const timeout_ms)
+{
+        uint8_t *ptr = buf;
+        while (len > 0) {
+                if (timeout_ms >= 0) {
+                        struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+                        int const     ret = poll(&pfd, 1, timeout_ms);
+                        if (ret < 0 && errno == EINTR)
+                                continue;
+                        if (ret == 0)
+                                errno = ETIMEDOUT;
+                        if (ret <= 0)
+                                return false;
+                }
+                ssize_t const n = read(fd, ptr, len);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        if (n == 0)
+                                errno = 0;
+                        return false;
+                }
+                ptr += n;
+                len -= (size_t)n;
+        }
+        return true;
+}
+
+static bool
+write_message(int const fd, mpack_obj const *pack)
+{
+        bstring const *data = *pack->packed;
+        uint32_t const len  = data->slen;
+        return write_all(fd, &len, sizeof len) && write_all(fd, data->data, len);
+}
+
+/* Returns NULL at the end of input, on error, or after `timeout_ms' (-1 for never)
+ * without any data. */
+static bstring *
+read_message(int const fd, int const timeout_ms)
+{
+        uint32_t len;
+        errno = 0;
+        if (!read_all(fd, &len, sizeof len, timeout_ms))
+                return NULL;
+
+        bstring *ret = b_create(len + 1);
+        if (!read_all(fd, ret->data, len, timeout_ms)) {
+                b_free(ret);
+                return NULL;
+        }
+        ret->slen      = len;
+        ret->data[len] = '\0';
+        return ret;
+}
+
+/*======================================================================================*/
+/* The worker's side. */
+
+struct worker_unit {
+        CXTranslationUnit   tu;
+        uint64_t            args_hash;
+        int                 id;
+        struct worker_unit *next;
+};
+
+static void     worker_parse(CXIndex idx, struct worker_unit **units, mpack_obj *req);
+static void     worker_dispose(struct worker_unit **units, int id);
+static void     worker_reply(int status, uint32_t const *out, unsigned nout);
+static bool     is_ignored(mpack_array const *ignored, bstring const *text);
+static uint64_t resident_kib(void);
+
+bool
+clang_worker_is_worker(char const *const *argv)
+{
+        return argv[1] && STREQ(argv[1], WORKER_ARG) && !argv[2];
+}
+
+int
+clang_worker_main(void)
+{
+        CXIndex             idx   = clang_createIndex(0, 0);
+        struct worker_unit *units = NULL;
+        bstring            *msg;
+
+        while ((msg = read_message(STDIN_FILENO, -1))) {
+                bstring    view = *msg;
+                mpack_obj *req  = mpack_decode_obj(&view);
+
+                switch (mpack_index(req, 0)->num) {
+                case WORKER_PARSE:
+                        worker_parse(idx, &units, req);
+                        break;
+                case WORKER_DISPOSE:
+                        worker_dispose(&units, (int)mpack_index(req, 1)->num);
+                        break;
+                default:
+                        errx(1, "Unknown request %" PRIu64, mpack_index(req, 0)->num);
+                }
+
+                mpack_destroy_object(req);
+                b_free(msg);
+        }
+
+        while (units)
+                worker_dispose(&units, units->id);
+        clang_disposeIndex(idx);
+        return EXIT_SUCCESS;
+}
+
+static uint64_t
+hash_args(mpack_array const *args)
+{
+        uint64_t hash = FNV1A_OFFSET_BASIS;
+        for (unsigned i = 0; i < args->qty; ++i) {
+                bstring const *arg = args->lst[i]->str;
+                hash = fnv1a(fnv1a(hash, arg->data, arg->slen), "", 1);
+        }
+        return hash;
+}
+
+static void
+worker_parse(CXIndex idx, struct worker_unit **units, mpack_obj *req)
+{
+        int const              id      = (int)mpack_index(req, 1)->num;
+        bstring const         *name    = mpack_index(req, 2)->str;
+        mpack_array const     *args    = mpack_index(req, 3)->arr;
+        bstring               *text    = mpack_index(req, 4)->str;
+        nvim_filetype_id const ftid    = (nvim_filetype_id)mpack_index(req, 5)->num;
+        int64_t const          first   = (int64_t)mpack_index(req, 6)->num;
+        int64_t const          last    = (int64_t)mpack_index(req, 7)->num;
+        mpack_array const     *ignored = mpack_index(req, 8)->arr;
+        uint64_t const         hash    = hash_args(args);
+        struct worker_unit    *unit    = *units;
+        int                    status  = 0;
+        uint32_t              *out     = NULL;
+        unsigned               nout    = 0;
+
+        struct CXUnsavedFile unsaved = {.Filename = BS(name),
+                                        .Contents = BS(text),
+                                        .Length   = text->slen};
+
+        while (unit && unit->id != id)
+                unit = unit->next;
+
+        if (unit && unit->args_hash == hash) {
+                status = clang_reparseTranslationUnit(unit->tu, 1, &unsaved,
+                                                      clang_defaultReparseOptions(unit->tu));
+                if (status != 0) {
+                        worker_dispose(units, id);
+                        unit = NULL;
+                }
+        } else {
+                char const **argv = talloc_array(NULL, char const *, args->qty + 1);
+                for (unsigned i = 0; i < args->qty; ++i)
+                        argv[i] = BS(args->lst[i]->str);
+                argv[args->qty] = NULL;
+
+                if (unit)
+                        worker_dispose(units, id);
+                unit            = talloc_zero(NULL, struct worker_unit);
+                unit->id        = id;
+                unit->args_hash = hash;
+                status = clang_parseTranslationUnit2(idx, BS(name), argv, (int)args->qty,
+                                                     &unsaved, 1, TUFLAGS, &unit->tu);
+                talloc_free(argv);
+
+                if (status == 0 && unit->tu) {
+                        unit->next = *units;
+                        *units     = unit;
+                } else {
+                        if (unit->tu)
+                                clang_disposeTranslationUnit(unit->tu);
+                        TALLOC_FREE(unit);
+                        status = status ? status : CXError_Failure;
+                }
+        }
+
+        if (unit) {
+                translationunit_t *stu  = talloc_zero(NULL, translationunit_t);
+                CXFile             file = clang_getFile(unit->tu, BS(name));
+                CXCursor           prev = clang_getNullCursor();
+
+                stu->tu   = unit->tu;
+                stu->idx  = idx;
+                stu->buf  = text;
+                stu->ftid = ftid;
+                tokenize_range(stu, &file, first, last);
+                out = talloc_array(stu, uint32_t, (size_t)stu->ntokens * WORKER_NFIELDS);
+
+                for (unsigned i = 0; i < stu->ntokens; ++i) {
+                        token_t *tok = &stu->tokens[i];
+                        if ((int)tok->line == (-1))
+                                continue;
+                        if (is_ignored(ignored, &tok->text))
+                                continue;
+
+                        int const kind = lc_classify_token(stu, tok, &prev);
+                        if (kind) {
+                                out[nout++] = tok->line;
+                                out[nout++] = tok->col1;
+                                out[nout++] = tok->col2;
+                                out[nout++] = (uint32_t)kind;
+                        }
+                }
+
+                worker_reply(0, out, nout);
+                release_tokens(stu);
+                talloc_free(stu);
+        } else {
+                worker_reply(status, NULL, 0);
+        }
+}
+
+static void
+worker_reply(int const status, uint32_t const *out, unsigned const nout)
+{
+        mpack_obj *pack = mpack_make_new(0, false);
+        mpack_encode_array(pack, NULL, 3);
+        mpack_encode_integer(pack, NULL, status);
+        mpack_encode_unsigned(pack, NULL, resident_kib());
+        mpack_encode_string(pack, NULL, out ? btp_fromblk(out, nout * sizeof(uint32_t)) : NULL);
+
+        /* Nobody is left to answer to. */
+        if (!write_message(STDOUT_FILENO, pack))
+                err(1, "write");
+        talloc_free(pack);
+}
+
+/* There are rarely more than a few dozen of these, so a linear search is fine. */
+static bool
+is_ignored(mpack_array const *ignored, bstring const *text)
+{
+        for (unsigned i = 0; i < ignored->qty; ++i)
+                if (b_iseq(ignored->lst[i]->str, text))
+                        return true;
+        return false;
+}
+
+static void
+worker_dispose(struct worker_unit **units, int const id)
+{
+        for (struct worker_unit **ptr = units; *ptr; ptr = &(*ptr)->next) {
+                if ((*ptr)->id == id) {
+                        struct worker_unit *unit = *ptr;
+                        *ptr = unit->next;
+                        clang_disposeTranslationUnit(unit->tu);
+                        talloc_free(unit);
+                        return;
+                }
+        }
+}
+
+static uint64_t
+resident_kib(void)
+{
+        unsigned long long pages = 0;
+        FILE *fp = fopen("/proc/self/statm", "rb");
+        if (fp) {
+                if (fscanf(fp, "%*s %llu", &pages) != 1)
+                        pages = 0;
+                fclose(fp);
+        }
+        return (uint64_t)pages * (uint64_t)sysconf(_SC_PAGESIZE) / 1024U;
+}
+
+#endif /* _WIN32 */
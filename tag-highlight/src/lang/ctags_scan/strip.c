@@ -32,17 +32,11 @@ bstring *
 strip_comments(Buffer *bdata)
 {
         const struct comment_s *com = NULL;
-        unsigned bytenum = 0;
 
-        LL_FOREACH_F (bdata->lines, line)
-                bytenum += ((bstring *)line->data)->slen + 1;
-
-        bstring *joined = b_alloc_null(bytenum);
-
-        LL_FOREACH_F (bdata->lines, line) {
-                b_concat(joined, (bstring *)line->data);
-                b_conchar(joined, '\n');
-        }
+        /* The stripping happens in place, so this needs its own copy. */
+        struct buffer_snapshot *snap   = buffer_snapshot(bdata);
+        bstring                *joined = b_fromblk(snap->text->data, snap->text->slen);
+        talloc_free(snap);
 
         for (unsigned i = 0; i < ARRSIZ(lang_comment_groups); ++i) {
                 if (bdata->ft->id == lang_comment_groups[i].id) {
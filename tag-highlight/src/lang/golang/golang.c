@@ -38,7 +38,7 @@ struct go_output {
 
 #undef ALIGN
 
-static mpack_arg_array *parse_go_output(Buffer *bdata, b_list *output);
+static hl_batch *parse_go_output(Buffer *bdata, b_list *output);
 static b_list          *separate_and_sort(bstring *output);
 static inline bool ident_is_ignored(Buffer *bdata, bstring const *tok) __attribute__((pure));
 
@@ -47,13 +47,8 @@ static inline bool ident_is_ignored(Buffer *bdata, bstring const *tok) __attribu
 int
 highlight_go(Buffer *bdata)
 {
-        int      retval  = 0;
-        unsigned cnt_val = p99_count_inc(&bdata->lock.num_workers);
-        if (cnt_val > 3) {
-                p99_count_dec(&bdata->lock.num_workers);
-                return retval;
-        }
-
+        int retval = 0;
+        p99_count_inc(&bdata->lock.num_workers);
         pthread_mutex_lock(&bdata->lock.lang_mtx);
 
 #if 0 //ndef _WIN32
@@ -73,16 +68,19 @@ highlight_go(Buffer *bdata)
         }
 #endif
 
-        pthread_mutex_lock(&bdata->lock.total);
-        bstring *tmp = ll_join_bstrings(bdata->lines, '\n');
-        pthread_mutex_unlock(&bdata->lock.total);
+        struct buffer_snapshot *snap  = buffer_snapshot(bdata);
+        uint32_t const          ctick = snap->ctick;
+        bstring                *tmp   = talloc_steal(NULL, snap->text);
+        talloc_free(snap);
 
         struct golang_data *gd = bdata->godata.sock_info;
-        mpack_arg_array    *calls;
+        hl_batch           *batch;
         b_list *data;
 
-        if (!tmp || tmp->slen == 0)
+        if (!tmp || tmp->slen == 0) {
+                talloc_free(tmp);
                 goto error;
+        }
 
         golang_send_msg(gd, tmp);
         talloc_free(tmp);
@@ -92,7 +90,8 @@ highlight_go(Buffer *bdata)
                 goto error;
 
         data  = separate_and_sort(tmp);
-        calls = parse_go_output(bdata, data);
+        batch = parse_go_output(bdata, data);
+        batch->ctick = ctick;
         talloc_free(data);
         b_free(tmp);
 
@@ -100,8 +99,7 @@ highlight_go(Buffer *bdata)
         p99_count_dec(&bdata->lock.num_workers);
         pthread_mutex_unlock(&bdata->lock.lang_mtx);
 
-        nvim_call_atomic(calls);
-        talloc_free(calls);
+        hl_batch_send(batch);
         pthread_mutex_unlock(&bdata->lock.total);
         return retval;
 
@@ -114,18 +112,18 @@ error:
 
 /*--------------------------------------------------------------------------------------*/
 
-static mpack_arg_array *
+static hl_batch *
 parse_go_output(Buffer *bdata, b_list *output)
 {
         struct go_output out;
         bstring const   *group;
-        mpack_arg_array *calls = new_arg_array();
+        hl_batch        *batch = new_hl_batch(bdata);
         memset(&out, 0, sizeof(out));
 
         if (bdata->hl_id == 0)
                 bdata->hl_id = nvim_buf_add_highlight(bdata->num);
         else
-                add_clr_call(calls, (int)bdata->num, (int)bdata->hl_id, 0, -1);
+                hl_batch_clear(batch, 0, -1);
 
         B_LIST_FOREACH (output, tok) {
                 /* The out is so regular that we can get away with using scanf.
@@ -141,11 +139,11 @@ parse_go_output(Buffer *bdata, b_list *output)
                 group = find_group(bdata->ft, out.ch);
                 if (group) {
                         line_data const ln = {out.start.line, out.start.column, out.end.column};
-                        add_hl_call(calls, (int)bdata->num, (int)bdata->hl_id, group, &ln);
+                        hl_batch_add(batch, group, &ln);
                 }
         }
 
-        return calls;
+        return batch;
 }
 
 /*======================================================================================*/
@@ -17,6 +17,506 @@ find_group(Filetype *ft, int const ctags_kind)
 
 /*======================================================================================*/
 
+#define INIT_HL_BATCH_SIZE (512)
+#define HL_GROUP_STALE     (UINT_MAX)
+
+/* Batches with more spans than this are sent in pieces, the visible lines first. */
+#define HL_CHUNK_SPANS     (4096U)
+
+static_assert(sizeof(hl_span) == 4 * sizeof(unsigned), "hl_span must be four packed unsigned ints");
+static_assert(sizeof(hl_clear) == 2 * sizeof(int), "hl_clear must be two packed ints");
+
+static void      hl_batch_transmit(hl_batch const *batch);
+static void      transmit_whole(hl_batch const *batch);
+static void      transmit_lines(hl_batch const *batch, int lo, int hi);
+static void      transmit_chunked(hl_batch const *batch, int lo, int hi);
+static hl_batch *hl_batch_diff(hl_batch const *old, hl_batch *new);
+static void      hl_applied_patch(Buffer *bdata, hl_batch const *patch, int lo, int hi);
+static hl_batch *hl_batch_copy(hl_batch const *batch);
+static unsigned  first_span_on_line(hl_batch const *batch, unsigned line);
+static int       hl_span_cmp(void const *vA, void const *vB);
+
+hl_batch *
+new_hl_batch(Buffer *bdata)
+{
+        hl_batch *batch = talloc(NULL, hl_batch);
+        batch->bdata    = bdata;
+        batch->groups   = b_list_create();
+        batch->mlen     = INIT_HL_BATCH_SIZE;
+        batch->spans    = talloc_array(batch, hl_span, batch->mlen);
+        batch->qty      = 0;
+        batch->clears   = NULL;
+        batch->nclears  = 0;
+        batch->ctick    = 0;
+        batch->preview  = false;
+        talloc_steal(batch, batch->groups);
+        return batch;
+}
+
+static unsigned
+intern_group(hl_batch *batch, bstring const *group)
+{
+        /* There are rarely more than a dozen groups, so a linear search is fine. The
+         * pointers almost always match since they come straight from find_group(). */
+        for (unsigned i = 0; i < batch->groups->qty; ++i)
+                if (batch->groups->lst[i] == group || b_iseq(batch->groups->lst[i], group))
+                        return i;
+
+        b_list_append(batch->groups, b_strcpy(group));
+        return batch->groups->qty - 1;
+}
+
+static void
+append_span(hl_batch *batch, hl_span const *span)
+{
+        if (batch->qty >= batch->mlen) {
+                batch->mlen *= 2;
+                batch->spans = talloc_realloc(batch, batch->spans, hl_span, batch->mlen);
+        }
+        batch->spans[batch->qty++] = *span;
+}
+
+static hl_batch *
+hl_batch_copy(hl_batch const *batch)
+{
+        hl_batch *copy = new_hl_batch(batch->bdata);
+
+        for (unsigned i = 0; i < batch->groups->qty; ++i)
+                b_list_append(copy->groups, b_strcpy(batch->groups->lst[i]));
+        for (unsigned i = 0; i < batch->nclears; ++i)
+                hl_batch_clear(copy, batch->clears[i].start, batch->clears[i].end);
+        if (batch->qty > copy->mlen) {
+                copy->mlen  = batch->qty;
+                copy->spans = talloc_realloc(copy, copy->spans, hl_span, copy->mlen);
+        }
+
+        memcpy(copy->spans, batch->spans, batch->qty * sizeof(hl_span));
+        copy->qty   = batch->qty;
+        copy->ctick = batch->ctick;
+        return copy;
+}
+
+void
+hl_batch_add(hl_batch *batch, bstring const *group, line_data const *data)
+{
+        append_span(batch, (hl_span[]){{
+                .line  = data->line,
+                .start = data->start,
+                .end   = data->end,
+                .group = intern_group(batch, group),
+        }});
+}
+
+void
+hl_batch_clear(hl_batch *batch, int const line, int const end)
+{
+        batch->clears = talloc_realloc(batch, batch->clears, hl_clear, batch->nclears + 1);
+        batch->clears[batch->nclears++] = (hl_clear){line, end};
+}
+
+static inline bool
+is_full_repaint(hl_batch const *batch)
+{
+        return batch->nclears == 1 && batch->clears[0].start == 0 && batch->clears[0].end == (-1);
+}
+
+/* A batch that replaces everything on a limited range of lines. */
+static inline bool
+is_range_repaint(hl_batch const *batch)
+{
+        return batch->nclears == 1 && batch->clears[0].end >= 0;
+}
+
+void
+hl_batch_send(hl_batch *batch)
+{
+        Buffer   *bdata = batch->bdata;
+        hl_batch *out   = batch; /* What goes to neovim. */
+        hl_batch *spare = batch; /* Freed at the end unless it became the record. */
+        hl_batch *rec;
+        uint32_t  ticket;
+
+        qsort(batch->spans, batch->qty, sizeof(hl_span), hl_span_cmp);
+
+        /* The delta and the new record are worked out under the lock, but nothing is
+         * sent until it has been let go, since sending can wait on neovim for a long
+         * time and line events need the lock to shift the record. */
+        pthread_mutex_lock(&bdata->lock.hl_mtx);
+        rec = bdata->hl_applied;
+
+        /* A batch computed from text that has since been edited can't be compared
+         * with the record, which has already been shifted to follow the edits. This
+         * is checked under the lock, and line events store the new tick before they
+         * shift the record, so a batch can't slip in between the two. */
+        bool const current = batch->ctick == 0 ||
+                             batch->ctick == atomic_load(&bdata->lines_tick);
+
+        if (batch->preview) {
+                /* A preview is shown as is, but the record must still learn what it
+                 * painted. Its text was lexed without what comes before it, so it can
+                 * be wrong in ways the full batch that follows has to correct. */
+                if (rec && current && is_range_repaint(batch))
+                        hl_applied_patch(bdata, batch, batch->clears[0].start, batch->clears[0].end);
+                else
+                        TALLOC_FREE(bdata->hl_applied);
+        } else if (rec && current && is_full_repaint(batch)) {
+                out = hl_batch_diff(rec, batch);
+                talloc_free(rec);
+                bdata->hl_applied = talloc_steal(bdata, batch);
+                spare             = NULL;
+        } else if (rec && current && is_range_repaint(batch)) {
+                /* Only the part of the record on the repainted lines is compared, and
+                 * the new spans then take its place. */
+                int const      lo    = batch->clears[0].start;
+                int const      hi    = batch->clears[0].end;
+                unsigned const first = first_span_on_line(rec, (unsigned)lo);
+                unsigned const last  = first_span_on_line(rec, (unsigned)hi);
+                hl_batch       view  = *rec;
+
+                view.spans = rec->spans + first;
+                view.qty   = last - first;
+                out        = hl_batch_diff(&view, batch);
+                hl_applied_patch(bdata, batch, lo, hi);
+        } else if (current && (batch->nclears == 0 || is_full_repaint(batch))) {
+                /* A first paint, or a full one with nothing to compare it to. The batch
+                 * itself is about to be sent without the lock, so the record is a copy. */
+                talloc_free(rec);
+                bdata->hl_applied = talloc_steal(bdata, hl_batch_copy(batch));
+        } else {
+                /* Anything else leaves us with no reliable picture of what neovim has,
+                 * so the next repaint is sent whole. The same goes for a stale batch. */
+                TALLOC_FREE(bdata->hl_applied);
+        }
+
+        /* Sends go out in the order their records were made. */
+        ticket = bdata->hl_send.next++;
+        pthread_mutex_unlock(&bdata->lock.hl_mtx);
+
+        pthread_mutex_lock(&bdata->hl_send.mtx);
+        while (atomic_load(&bdata->hl_send.done) != ticket)
+                pthread_cond_wait(&bdata->hl_send.cond, &bdata->hl_send.mtx);
+        pthread_mutex_unlock(&bdata->hl_send.mtx);
+
+        if (out->nclears > 0 || out->qty > 0)
+                hl_batch_transmit(out);
+
+        pthread_mutex_lock(&bdata->hl_send.mtx);
+        atomic_store(&bdata->hl_send.done, ticket + 1);
+        pthread_cond_broadcast(&bdata->hl_send.cond);
+        pthread_mutex_unlock(&bdata->hl_send.mtx);
+
+        if (out != batch)
+                talloc_free(out);
+        talloc_free(spare);
+}
+
+/*
+ * Big batches are split by line. The lines on screen go first so that they show up
+ * without waiting on the rest; then everything below them, then everything above.
+ * Every piece is a separate request, so neovim gets to handle input in between.
+ */
+static void
+hl_batch_transmit(hl_batch const *batch)
+{
+        int vfirst, vlast;
+
+        if (batch->qty <= HL_CHUNK_SPANS) {
+                transmit_whole(batch);
+        } else if (buffer_viewport(batch->bdata, &vfirst, &vlast)) {
+                transmit_lines(batch, vfirst, vlast);
+                transmit_chunked(batch, vlast, INT_MAX);
+                transmit_chunked(batch, 0, vfirst);
+        } else {
+                transmit_chunked(batch, 0, INT_MAX);
+        }
+}
+
+static unsigned
+first_span_on_line(hl_batch const *batch, unsigned const line)
+{
+        unsigned lo = 0, hi = batch->qty;
+        while (lo < hi) {
+                unsigned const mid = lo + ((hi - lo) / 2U);
+                if (batch->spans[mid].line < line)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+/* Send the part of `batch' that falls on lines [lo, hi), where INT_MAX means the end. */
+static void
+transmit_lines(hl_batch const *batch, int const lo, int const hi)
+{
+        unsigned const first  = first_span_on_line(batch, (unsigned)lo);
+        unsigned const last   = hi == INT_MAX ? batch->qty : first_span_on_line(batch, (unsigned)hi);
+        hl_clear      *clears = talloc_array(NULL, hl_clear, batch->nclears + 1);
+        hl_batch       part   = *batch;
+
+        part.spans   = batch->spans + first;
+        part.qty     = last - first;
+        part.clears  = clears;
+        part.nclears = 0;
+
+        for (unsigned i = 0; i < batch->nclears; ++i) {
+                int const start = MAXOF(batch->clears[i].start, lo);
+                int const end   = batch->clears[i].end < 0 ? hi : MINOF(batch->clears[i].end, hi);
+                if (start < end)
+                        clears[part.nclears++] = (hl_clear){start, end == INT_MAX ? (-1) : end};
+        }
+
+        if (part.qty > 0 || part.nclears > 0)
+                transmit_whole(&part);
+        talloc_free(clears);
+}
+
+/* Send lines [lo, hi) in pieces of roughly HL_CHUNK_SPANS spans, split between lines. */
+static void
+transmit_chunked(hl_batch const *batch, int lo, int const hi)
+{
+        unsigned       i   = first_span_on_line(batch, (unsigned)lo);
+        unsigned const end = hi == INT_MAX ? batch->qty : first_span_on_line(batch, (unsigned)hi);
+
+        while (end - i > HL_CHUNK_SPANS) {
+                i += HL_CHUNK_SPANS;
+                unsigned const line = batch->spans[i].line;
+                while (i < end && batch->spans[i].line == line)
+                        ++i;
+                if (i >= end)
+                        break;
+                transmit_lines(batch, lo, (int)batch->spans[i].line);
+                lo = (int)batch->spans[i].line;
+        }
+
+        transmit_lines(batch, lo, hi);
+}
+
+static void
+transmit_whole(hl_batch const *batch)
+{
+        Buffer *bdata = batch->bdata;
+
+        if (settings.packed_highlights) {
+                nvimext_buf_apply_highlights(bdata->num, bdata->hl_id,
+                                             (int const *)batch->clears, batch->nclears * 2U,
+                                             batch->groups,
+                                             (unsigned const *)batch->spans, batch->qty * 4U);
+                return;
+        }
+
+        mpack_arg_array *calls = new_arg_array();
+        for (unsigned i = 0; i < batch->nclears; ++i)
+                add_clr_call(calls, (int)bdata->num, bdata->hl_id,
+                             batch->clears[i].start, batch->clears[i].end);
+
+        for (unsigned i = 0; i < batch->qty; ++i) {
+                hl_span const *sp = &batch->spans[i];
+                add_hl_call(calls, (int)bdata->num, bdata->hl_id, batch->groups->lst[sp->group],
+                            (line_data[]){{sp->line, sp->start, sp->end}});
+        }
+
+        nvim_call_atomic(calls);
+        talloc_free(calls);
+}
+
+/*--------------------------------------------------------------------------------------*/
+
+static bool
+line_equal(hl_span const *a, unsigned na, hl_span const *b, unsigned nb, unsigned const *group_map)
+{
+        if (na != nb)
+                return false;
+        for (unsigned i = 0; i < na; ++i)
+                if (a[i].start != b[i].start || a[i].end != b[i].end ||
+                    a[i].group == HL_GROUP_STALE || group_map[b[i].group] != a[i].group)
+                        return false;
+        return true;
+}
+
+/*
+ * Both batches must be sorted. Walk them a line at a time; every line whose spans
+ * differ in any way is cleared and its new spans added. Runs of adjacent changed
+ * lines are merged into one clear.
+ */
+static hl_batch *
+hl_batch_diff(hl_batch const *old, hl_batch *new)
+{
+        hl_batch *delta = new_hl_batch(new->bdata);
+        unsigned  group_map[new->groups->qty + 1];
+        unsigned  o = 0, n = 0;
+        int       run_start = (-1), run_end = (-1);
+
+        /* Translate the new batch's group indices into the old one's. */
+        for (unsigned i = 0; i < new->groups->qty; ++i) {
+                group_map[i] = HL_GROUP_STALE - 1;
+                for (unsigned x = 0; x < old->groups->qty; ++x) {
+                        if (b_iseq(new->groups->lst[i], old->groups->lst[x])) {
+                                group_map[i] = x;
+                                break;
+                        }
+                }
+        }
+
+        while (o < old->qty || n < new->qty) {
+                unsigned const oline = o < old->qty ? old->spans[o].line : UINT_MAX;
+                unsigned const nline = n < new->qty ? new->spans[n].line : UINT_MAX;
+                unsigned const line  = MINOF(oline, nline);
+                unsigned       oend  = o, nend = n;
+
+                while (oend < old->qty && old->spans[oend].line == line)
+                        ++oend;
+                while (nend < new->qty && new->spans[nend].line == line)
+                        ++nend;
+
+                if (!line_equal(old->spans + o, oend - o, new->spans + n, nend - n, group_map)) {
+                        if (run_end == (int)line) {
+                                ++run_end;
+                        } else {
+                                if (run_start >= 0)
+                                        hl_batch_clear(delta, run_start, run_end);
+                                run_start = (int)line;
+                                run_end   = (int)line + 1;
+                        }
+                        for (unsigned i = n; i < nend; ++i)
+                                append_span(delta, (hl_span[]){{
+                                        .line  = new->spans[i].line,
+                                        .start = new->spans[i].start,
+                                        .end   = new->spans[i].end,
+                                        .group = intern_group(delta, new->groups->lst[new->spans[i].group]),
+                                }});
+                }
+
+                o = oend;
+                n = nend;
+        }
+
+        if (run_start >= 0)
+                hl_batch_clear(delta, run_start, run_end);
+
+        return delta;
+}
+
+static int
+hl_span_cmp(void const *vA, void const *vB)
+{
+        hl_span const *a = vA;
+        hl_span const *b = vB;
+
+        if (a->line != b->line)
+                return a->line < b->line ? -1 : 1;
+        if (a->start != b->start)
+                return a->start < b->start ? -1 : 1;
+        if (a->end != b->end)
+                return a->end < b->end ? -1 : 1;
+        return (a->group > b->group) - (a->group < b->group);
+}
+
+/*--------------------------------------------------------------------------------------*/
+
+/*
+ * Mirror a line event onto the last applied highlights, the same way neovim moves its
+ * extmarks: lines after the edited range shift, and the edited lines themselves are
+ * marked stale so the next diff always clears and resends them.
+ */
+void
+hl_applied_shift_lines(Buffer *bdata, int const first, int const last, int const num_new)
+{
+        /* This runs on the event loop thread. The lock is only ever held to work on
+         * the record, never while waiting on neovim, so it is safe to wait for. */
+        pthread_mutex_lock(&bdata->lock.hl_mtx);
+        hl_batch *rec = bdata->hl_applied;
+
+        if (rec) {
+                int const      delta  = num_new - (last - first);
+                unsigned const nstale = (unsigned)MAXOF(num_new, 1);
+                unsigned const lo     = first_span_on_line(rec, (unsigned)first);
+                unsigned       hi     = first_span_on_line(rec, (unsigned)last);
+
+                /* Highlights still on their way were placed by line number in the text
+                 * before this edit, so if lines move there is no telling where they end
+                 * up. An edit within lines is covered by marking them stale. */
+                if (delta != 0 && bdata->hl_send.next != atomic_load(&bdata->hl_send.done)) {
+                        TALLOC_FREE(bdata->hl_applied);
+                        pthread_mutex_unlock(&bdata->lock.hl_mtx);
+                        return;
+                }
+
+                /* Whatever moves onto the stale lines is dropped along with them. */
+                while (hi < rec->qty && (int)rec->spans[hi].line + delta < first + (int)nstale)
+                        ++hi;
+
+                unsigned const tail = rec->qty - hi;
+                unsigned const qty  = lo + nstale + tail;
+
+                if (qty > rec->mlen) {
+                        rec->mlen  = MAXOF(rec->mlen * 2U, qty);
+                        rec->spans = talloc_realloc(rec, rec->spans, hl_span, rec->mlen);
+                }
+                memmove(rec->spans + lo + nstale, rec->spans + hi, tail * sizeof(hl_span));
+                for (unsigned i = 0; i < nstale; ++i)
+                        rec->spans[lo + i] = (hl_span){(unsigned)first + i, 0, 0, HL_GROUP_STALE};
+                if (delta != 0)
+                        for (unsigned i = lo + nstale; i < qty; ++i)
+                                rec->spans[i].line = (unsigned)((int)rec->spans[i].line + delta);
+                rec->qty = qty;
+        }
+
+        pthread_mutex_unlock(&bdata->lock.hl_mtx);
+}
+
+/*
+ * Replace the spans the record has on lines [lo, hi) with those of `patch', which
+ * must have none outside that range. Called with `lock.hl_mtx' held.
+ */
+static void
+hl_applied_patch(Buffer *bdata, hl_batch const *patch, int const lo, int const hi)
+{
+        hl_batch      *old    = bdata->hl_applied;
+        hl_batch      *merged = new_hl_batch(bdata);
+        unsigned const first  = first_span_on_line(old, (unsigned)lo);
+        unsigned const last   = first_span_on_line(old, (unsigned)hi);
+
+        talloc_free(merged->groups);
+        merged->groups = talloc_steal(merged, old->groups);
+        merged->ctick  = patch->ctick;
+
+        for (unsigned i = 0; i < first; ++i)
+                append_span(merged, &old->spans[i]);
+        for (unsigned i = 0; i < patch->qty; ++i)
+                append_span(merged, (hl_span[]){{
+                        .line  = patch->spans[i].line,
+                        .start = patch->spans[i].start,
+                        .end   = patch->spans[i].end,
+                        .group = intern_group(merged, patch->groups->lst[patch->spans[i].group]),
+                }});
+        for (unsigned i = last; i < old->qty; ++i)
+                append_span(merged, &old->spans[i]);
+
+        talloc_free(old);
+        bdata->hl_applied = talloc_steal(bdata, merged);
+}
+
+/* Whether there is a record of applied highlights that a partial repaint can patch. */
+bool
+hl_applied_valid(Buffer *bdata)
+{
+        pthread_mutex_lock(&bdata->lock.hl_mtx);
+        bool const ret = bdata->hl_applied != NULL;
+        pthread_mutex_unlock(&bdata->lock.hl_mtx);
+        return ret;
+}
+
+void
+hl_applied_forget(Buffer *bdata)
+{
+        pthread_mutex_lock(&bdata->lock.hl_mtx);
+        TALLOC_FREE(bdata->hl_applied);
+        pthread_mutex_unlock(&bdata->lock.hl_mtx);
+}
+
+/*======================================================================================*/
+
 #define INIT_ACALL_SIZE (128)
 
 struct mpack_arg_array *
@@ -17,6 +17,51 @@ struct line_data {
         unsigned end;
 };
 
+/*
+ * A set of highlights for one buffer, collected before anything is sent. Depending on
+ * `settings.packed_highlights' it goes to neovim either as one flat integer array
+ * applied by the bundled Lua module, or as an nvim_call_atomic full of
+ * nvim_buf_add_highlight calls.
+ *
+ * A batch that repaints the whole buffer, or a single range of lines, is compared
+ * against the previous one, and only the lines that differ are cleared and sent again.
+ */
+P99_DECLARE_STRUCT(hl_span);
+struct hl_span {
+        unsigned line;
+        unsigned start;
+        unsigned end;
+        unsigned group; /* Index into the batch's group table. */
+};
+
+P99_DECLARE_STRUCT(hl_clear);
+struct hl_clear {
+        int start;
+        int end;
+};
+
+P99_DECLARE_STRUCT(hl_batch);
+struct hl_batch {
+        Buffer   *bdata;
+        b_list   *groups;
+        hl_span  *spans;
+        hl_clear *clears;
+        unsigned  qty;
+        unsigned  mlen;
+        unsigned  nclears;
+        uint32_t  ctick;   /* Changedtick of the text the batch was computed from. */
+        bool      preview; /* Sent ahead of a full batch; never kept as the record. */
+};
+
+extern hl_batch *new_hl_batch  (Buffer *bdata);
+extern void      hl_batch_add  (hl_batch *batch, const bstring *group, const line_data *data);
+extern void      hl_batch_clear(hl_batch *batch, int line, int end);
+extern void      hl_batch_send (hl_batch *batch); /* Takes ownership of the batch. */
+
+extern void hl_applied_shift_lines(Buffer *bdata, int first, int last, int num_new);
+extern void hl_applied_forget     (Buffer *bdata);
+extern bool hl_applied_valid      (Buffer *bdata);
+
 extern void add_hl_call (mpack_arg_array *calls, int bufnum, int hl_id,
                          const bstring *group, const line_data *data);
 extern void add_clr_call(mpack_arg_array *calls, int bufnum, int hl_id, int line, int end);
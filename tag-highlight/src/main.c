@@ -1,5 +1,7 @@
 #include "Common.h"
 #include "highlight.h"
+#include "events.h"
+#include "lang/clang/clang.h"
 
 #include "contrib/p99/p99_futex.h"
 
@@ -103,6 +105,10 @@ main(UNUSED int argc, char *argv[])
 
       TIMER_START(&main_timer);
 
+      /* We may just be a clang worker process started by another instance. */
+      if (clang_worker_is_worker((char const *const *)argv))
+            return clang_worker_main();
+
       /* Accomodate for Win32 */
       platform_init((char const *const *)argv);
 
@@ -163,6 +169,7 @@ general_init(char const *const *argv)
       top_thread = pthread_self();
       open_logs(argv[1]);
       p99_futex_init(&first_buffer_initialized, 0);
+      init_thread_pools();
       START_DETACHED_PTHREAD(neovim_init);
 }
 
@@ -257,8 +264,9 @@ neovim_init(void *varg) //NOLINT(readability-function-cognitive-complexity)
 
       if (bdata) {
             global_previous_buffer_set((int)bdata->num);
-            nvim_buf_attach(bdata->num);
+            nvim_future *attach = nvim_buf_attach_async(bdata->num);
             get_initial_lines(bdata);
+            nvim_future_discard(attach);
             get_initial_taglist(bdata);
             update_highlight(bdata);
 
@@ -290,6 +298,18 @@ get_settings(void)
       settings.settings_file  = nvim_get_var(B(PKG "settings_file"),     E_STRING    ).ptr;
       settings.verbose        = nvim_get_var(B(PKG "verbose"),           E_BOOL      ).num;
       settings.run_ctags      = nvim_get_var(B(PKG "run_ctags"),         E_BOOL      ).num;
+      settings.debounce_ms    = nvim_get_var(B(PKG "debounce_ms"),       E_NUM       ).num;
+      settings.packed_highlights = nvim_get_var(B(PKG "packed_highlights"), E_BOOL  ).num;
+      settings.clang_ast_cache   = nvim_get_var(B(PKG "clang_ast_cache"),   E_BOOL  ).num;
+      settings.clang_memory_budget = nvim_get_var(B(PKG "clang_memory_budget"), E_NUM).num;
+      settings.clang_ast_cache_mb  = nvim_get_var(B(PKG "clang_ast_cache_mb"),  E_NUM).num;
+      settings.clang_skeleton_kb   = nvim_get_var(B(PKG "clang_skeleton_kb"),   E_NUM).num;
+      settings.clang_workers       = nvim_get_var(B(PKG "clang_workers"),       E_NUM).num;
+      settings.clang_worker_max_mb = nvim_get_var(B(PKG "clang_worker_max_mb"), E_NUM).num;
+      settings.atomic_chunk_calls  = nvim_get_var(B(PKG "atomic_chunk_calls"),  E_NUM).num;
+      settings.atomic_chunk_kb     = nvim_get_var(B(PKG "atomic_chunk_kb"),     E_NUM).num;
+      settings.atomic_pipeline     = nvim_get_var(B(PKG "atomic_pipeline"),     E_NUM).num;
+      settings.atomic_yield_usec   = nvim_get_var(B(PKG "atomic_yield_usec"),   E_NUM).num;
 
 #ifdef DEBUG /* Verbose output should be forcibly enabled in debug mode. */
       settings.verbose = true;
@@ -373,6 +393,10 @@ exit_cleanup(void)
 
       if (talloc_log_file)
             talloc_report_full(main_top_talloc_ctx_, talloc_log_file);
+      report_thread_pool_stats();
+      nvim_api_report_writer_stats();
+      nvim_api_report_atomic_stats();
+      clang_worker_shutdown();
       TALLOC_FREE(buffer_list);
       TALLOC_FREE(top_dirs);
       TALLOC_FREE(ftdata);
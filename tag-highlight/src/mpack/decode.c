@@ -16,7 +16,8 @@ static mpack_obj *decode_ext(read_fn READ, void *src, mpack_mask const *mask);
 static mpack_obj *decode_nil(void);
 static mpack_obj *decode_bool(mpack_mask const *mask);
 
-static void stream_read(void *restrict src, void *restrict dest, size_t nbytes);
+static void   stream_read(void *restrict src, void *restrict dest, size_t nbytes);
+static size_t stream_fill(mpack_stream *stream, void *dest, size_t nbytes);
 static void obj_read(void *restrict src, void *restrict dest, size_t nbytes);
 
 static mpack_mask const *id_pack_type(uint8_t ch) __attribute__((pure));
@@ -50,52 +51,40 @@ extern FILE *mpack_raw_read;
 #define decode_int32(NUM) MY_BSWAP_32(NUM)
 #define decode_int64(NUM) MY_BSWAP_64(NUM)
 #define NUM_MUTEXES (128)
-
-P99_DECLARE_STRUCT(mpack_mutex);
-struct mpack_mutex {
+#define STREAM_BUFSIZ (65536)
+
+/*
+ * Every connection gets a read buffer which is refilled with reads as large as
+ * possible, so decoding a message doesn't cost one syscall for every field.
+ */
+P99_DECLARE_STRUCT(mpack_stream);
+struct mpack_stream {
       intptr_t        fd;
       bool            init;
       pthread_mutex_t mut;
+      uint8_t        *buf;
+      size_t          start;
+      size_t          end;
+      unsigned        syscalls;
 } __attribute__((aligned(64)));
 
 void *mpack_decode_talloc_ctx_ = NULL;
 
 static pthread_mutex_t mpack_search_mutex = PTHREAD_MUTEX_INITIALIZER;
-static mpack_mutex     mpack_mutex_list[NUM_MUTEXES];
+static mpack_stream    mpack_stream_list[NUM_MUTEXES];
+
+static mpack_stream *find_stream(intptr_t fd);
 
 /*============================================================================*/
 
 mpack_obj *
-mpack_decode_stream(intptr_t fd)
+mpack_decode_stream(intptr_t const fd)
 {
-      pthread_mutex_lock(&mpack_search_mutex);
-      pthread_mutex_t *mut = NULL;
-      if (fd == 1)
-            fd = 0;
-
-      for (unsigned i = 0; i < NUM_MUTEXES; ++i) {
-            mpack_mutex *cur = &mpack_mutex_list[i];
-            if (cur->init && cur->fd == fd) {
-                  mut = &cur->mut;
-                  break;
-            }
-      }
-      if (!mut) {
-            unsigned i = 0;
-            while (i < NUM_MUTEXES && mpack_mutex_list[i].init)
-                  ++i;
-            if (i >= NUM_MUTEXES)
-                  errx(1, "Too many open file descriptors.");
-            mpack_mutex_list[i].init = true;
-            mpack_mutex_list[i].fd   = fd;
-            mut                      = &mpack_mutex_list[i].mut;
-            pthread_mutex_init(mut, NULL);
-      }
-
-      pthread_mutex_lock(mut);
-      pthread_mutex_unlock(&mpack_search_mutex);
+      mpack_stream *stream = find_stream(fd);
+      pthread_mutex_lock(&stream->mut);
+      stream->syscalls = 0;
 
-      mpack_obj *ret = do_decode(&stream_read, &fd);
+      mpack_obj *ret = do_decode(&stream_read, stream);
       if (!ret)
             errx(1, "Failed to decode stream.");
 
@@ -109,9 +98,61 @@ mpack_decode_stream(intptr_t fd)
       }
 #if defined DEBUG && defined DEBUG_LOGS
       mpack_print_object(mpack_log, ret, B("\033[1;32mDECODED MESSAGE\033[0m"));
+      if (mpack_log)
+            fprintf(mpack_log, "Message decoded with %u read syscall(s), %zu bytes left buffered.\n",
+                    stream->syscalls, stream->end - stream->start);
 #endif
-      pthread_mutex_unlock(mut);
+      pthread_mutex_unlock(&stream->mut);
+
+      return ret;
+}
+
+/*
+ * Returns true if there is at least the beginning of another message waiting in
+ * the read buffer for `fd'. Event loops that wait for the descriptor to become
+ * readable must drain these first, as the data will never trigger the poll.
+ */
+bool
+mpack_decode_stream_pending(intptr_t const fd)
+{
+      mpack_stream *stream = find_stream(fd);
+      pthread_mutex_lock(&stream->mut);
+      bool const ret = stream->end > stream->start;
+      pthread_mutex_unlock(&stream->mut);
+      return ret;
+}
+
+static mpack_stream *
+find_stream(intptr_t fd)
+{
+      mpack_stream *ret = NULL;
+      if (fd == 1)
+            fd = 0;
+
+      pthread_mutex_lock(&mpack_search_mutex);
+
+      for (unsigned i = 0; i < NUM_MUTEXES; ++i) {
+            mpack_stream *cur = &mpack_stream_list[i];
+            if (cur->init && cur->fd == fd) {
+                  ret = cur;
+                  break;
+            }
+      }
+      if (!ret) {
+            unsigned i = 0;
+            while (i < NUM_MUTEXES && mpack_stream_list[i].init)
+                  ++i;
+            if (i >= NUM_MUTEXES)
+                  errx(1, "Too many open file descriptors.");
+            ret        = &mpack_stream_list[i];
+            ret->init  = true;
+            ret->fd    = fd;
+            ret->buf   = malloc(STREAM_BUFSIZ);
+            ret->start = ret->end = 0;
+            pthread_mutex_init(&ret->mut, NULL);
+      }
 
+      pthread_mutex_unlock(&mpack_search_mutex);
       return ret;
 }
 
@@ -563,51 +604,49 @@ id_pack_type(uint8_t const ch)
       return mask;
 }
 
-#if defined _WIN32 && USE_EVENT_LIB != EVENT_LIB_LIBEVENT
-
-static void
-stream_read(void *restrict src, void *restrict dest, size_t const nbytes)
+/*
+ * Read at most `nbytes' (but at least one byte) from the stream's descriptor.
+ */
+static size_t
+stream_fill(mpack_stream *stream, void *dest, size_t const nbytes)
 {
-      int const fd    = (int)*((intptr_t *)src);
-      size_t    nread = 0;
-
-      while (nread < nbytes) {
-            int n = (int)read(fd, dest + nread, nbytes - nread);
-            if (unlikely(n < 0))
-                  err(1, "read() error");
-            nread += (size_t)n;
-      }
-
-#if defined DEBUG && defined DEBUG_LOGS
-      if (P99_LIKELY(mpack_raw_read))
-            fwrite(dest, 1, nbytes, mpack_raw_read);
+#if defined _WIN32 && USE_EVENT_LIB != EVENT_LIB_LIBEVENT
+      int const n = (int)read((int)stream->fd, dest, nbytes);
+      if (unlikely(n < 0))
+            err(1, "read() error");
+#else
+      ssize_t const n = recv((socket_t)stream->fd, dest, nbytes, 0);
+      if (unlikely(n < 0))
+            err(1, "recv() error");
 #endif
-}
+      if (unlikely(n == 0))
+            errx(1, "Connection to neovim closed unexpectedly.");
 
-#else /* !defined _WIN32 */
+      ++stream->syscalls;
+      return (size_t)n;
+}
 
 static void
 stream_read(void *restrict src, void *restrict dest, size_t const nbytes)
 {
-      socket_t const sock = *((socket_t *)src);
-      //eprintf("Reading %zu bytes from socket %llu\n", nbytes, (long long unsigned)sock);
-      //fflush(stderr);
-
-#if 0
-      ssize_t const nread = recv(sock, dest, nbytes, MSG_WAITALL);
-      if (unlikely(nread < 0))
-            err(1, "recv() error");
-      if (unlikely((size_t)nread != nbytes))
-            err(1, "recv() returned too few bytes (%zd != %zu)!", nread, nbytes);
-#endif
-
-      size_t nread = 0;
+      mpack_stream *stream = src;
+      size_t        nread  = 0;
 
       while (nread < nbytes) {
-            ssize_t n = recv(sock, (char *)dest + nread, nbytes - nread, 0);
-            if (unlikely(n < 0))
-                  err(1, "read() error");
-            nread += (size_t)n;
+            size_t const avail = stream->end - stream->start;
+
+            if (avail > 0) {
+                  size_t const n = MINOF(avail, nbytes - nread);
+                  memcpy((uint8_t *)dest + nread, stream->buf + stream->start, n);
+                  stream->start += n;
+                  nread         += n;
+            } else if (nbytes - nread >= STREAM_BUFSIZ) {
+                  /* Large strings go straight to their destination. */
+                  nread += stream_fill(stream, (uint8_t *)dest + nread, nbytes - nread);
+            } else {
+                  stream->start = 0;
+                  stream->end   = stream_fill(stream, stream->buf, STREAM_BUFSIZ);
+            }
       }
 
 #if defined DEBUG && defined DEBUG_LOGS
@@ -616,8 +655,6 @@ stream_read(void *restrict src, void *restrict dest, size_t const nbytes)
 #endif
 }
 
-#endif /* defined _WIN32 */
-
 
 static void
 obj_read(void *restrict src, void *restrict dest, size_t const nbytes)
@@ -633,5 +670,216 @@ obj_read(void *restrict src, void *restrict dest, size_t const nbytes)
       buf->slen -= nbytes;
 }
 
+/*============================================================================*/
+/*
+ * Incremental decoding.
+ *
+ * Chunks are run through a small state machine that only tracks where the
+ * current message ends: the number of items left in every open container, the
+ * bytes of a length field still missing, and the payload bytes still to skip.
+ * That state survives between calls, so each byte is scanned exactly once no
+ * matter how the stream is split up. Once a message is known to be complete it is
+ * decoded in one go, straight out of the caller's chunk if it lies entirely within
+ * it. Only the unfinished tail of a chunk is ever copied.
+ */
+
+enum decoder_len_kind {
+      LEN_BYTES,     /* Length field gives a payload size in bytes. */
+      LEN_EXT_BYTES, /* As above, plus the one byte ext type. */
+      LEN_ITEMS,     /* Length field gives an array's item count. */
+      LEN_PAIRS,     /* Length field gives a map's key/value pair count. */
+};
+
+struct mpack_decoder {
+      uint8_t  *pending;     /* Bytes of a message that began in an earlier chunk. */
+      size_t    pending_len;
+      size_t    pending_max;
+      uint64_t *stack;       /* Items remaining in each open container. */
+      unsigned  depth;
+      unsigned  stack_max;
+      uint64_t  skip;        /* Payload bytes still to be skipped. */
+      uint32_t  len;         /* Length field being assembled. */
+      uint8_t   len_need;    /* Bytes of the length field still missing. */
+      uint8_t   len_kind;
+      bool      in_msg;
+};
+
+static bool decoder_element_done(mpack_decoder *dec);
+static bool decoder_start_element(mpack_decoder *dec, uint8_t ch);
+static bool decoder_length_done(mpack_decoder *dec);
+static void decoder_stash(mpack_decoder *dec, uint8_t const *data, size_t len);
+
+mpack_decoder *
+mpack_decoder_create(void *talloc_ctx)
+{
+      mpack_decoder *dec = talloc_zero(talloc_ctx, mpack_decoder);
+      dec->stack_max     = 16;
+      dec->stack         = talloc_array(dec, uint64_t, dec->stack_max);
+      return dec;
+}
+
+void
+mpack_decoder_feed(mpack_decoder    *dec,
+                   uint8_t const    *data,
+                   size_t const      len,
+                   mpack_decoder_cb *callback,
+                   void             *arg)
+{
+      size_t msg_start = 0;
+      size_t i         = 0;
+
+      while (i < len) {
+            bool done;
+
+            if (dec->skip > 0) {
+                  size_t const n = (size_t)MINOF(dec->skip, (uint64_t)(len - i));
+                  dec->skip -= n;
+                  i         += n;
+                  done       = dec->skip == 0 && decoder_element_done(dec);
+            } else if (dec->len_need > 0) {
+                  dec->len = (dec->len << 8) | data[i++];
+                  done     = --dec->len_need == 0 && decoder_length_done(dec);
+            } else {
+                  if (!dec->in_msg) {
+                        dec->in_msg = true;
+                        msg_start   = i;
+                  }
+                  done = decoder_start_element(dec, data[i++]);
+            }
+
+            if (!done)
+                  continue;
+
+            /* A complete message ends at `i'. */
+            bstring    wrapper;
+            mpack_obj *obj;
+
+            if (dec->pending_len > 0) {
+                  decoder_stash(dec, data + msg_start, i - msg_start);
+                  wrapper = (bstring){.data = dec->pending, .slen = (unsigned)dec->pending_len};
+                  dec->pending_len = 0;
+            } else {
+                  wrapper = (bstring){.data = (uchar *)data + msg_start, .slen = (unsigned)(i - msg_start)};
+            }
+
+            dec->in_msg = false;
+            obj         = mpack_decode_obj(&wrapper);
+            callback(obj, arg);
+      }
+
+      if (dec->in_msg)
+            decoder_stash(dec, data + msg_start, len - msg_start);
+}
+
+/*
+ * Returns true if this element completes the message.
+ */
+static bool
+decoder_start_element(mpack_decoder *dec, uint8_t const ch)
+{
+      mpack_mask const *mask = id_pack_type(ch);
+      uint8_t           nlen = 0;
+
+      switch (mask->type) {
+      case M_STR_8:  case M_BIN_8:   nlen = 1; dec->len_kind = LEN_BYTES;     break;
+      case M_STR_16: case M_BIN_16:  nlen = 2; dec->len_kind = LEN_BYTES;     break;
+      case M_STR_32: case M_BIN_32:  nlen = 4; dec->len_kind = LEN_BYTES;     break;
+      case M_EXT_8:                  nlen = 1; dec->len_kind = LEN_EXT_BYTES; break;
+      case M_ARRAY_16:               nlen = 2; dec->len_kind = LEN_ITEMS;     break;
+      case M_ARRAY_32:               nlen = 4; dec->len_kind = LEN_ITEMS;     break;
+      case M_MAP_16:                 nlen = 2; dec->len_kind = LEN_PAIRS;     break;
+      case M_MAP_32:                 nlen = 4; dec->len_kind = LEN_PAIRS;     break;
+
+      case M_INT_8:  case M_UINT_8:  dec->skip = 1; break;
+      case M_INT_16: case M_UINT_16: dec->skip = 2; break;
+      case M_INT_32: case M_UINT_32: dec->skip = 4; break;
+      case M_INT_64: case M_UINT_64: dec->skip = 8; break;
+      case M_FIXEXT_1:               dec->skip = 2; break;
+      case M_FIXEXT_2:               dec->skip = 3; break;
+      case M_FIXEXT_4:               dec->skip = 5; break;
+      case M_FIXEXT_8:               dec->skip = 9; break;
+
+      case M_FIXSTR_F:
+            dec->skip = (uint64_t)(ch ^ mask->val);
+            break;
+      case M_ARRAY_F:
+            dec->len      = (uint32_t)(ch ^ mask->val);
+            dec->len_kind = LEN_ITEMS;
+            return decoder_length_done(dec);
+      case M_FIXMAP_F:
+            dec->len      = (uint32_t)(ch ^ mask->val);
+            dec->len_kind = LEN_PAIRS;
+            return decoder_length_done(dec);
+
+      default: /* Nil, bools and fixed integers are just the one byte. */
+            break;
+      }
+
+      if (nlen > 0) {
+            dec->len      = 0;
+            dec->len_need = nlen;
+            return false;
+      }
+      if (dec->skip > 0)
+            return false;
+      return decoder_element_done(dec);
+}
+
+static bool
+decoder_length_done(mpack_decoder *dec)
+{
+      uint64_t items;
+
+      switch (dec->len_kind) {
+      case LEN_BYTES:
+      case LEN_EXT_BYTES:
+            dec->skip = (uint64_t)dec->len + (dec->len_kind == LEN_EXT_BYTES);
+            return dec->skip == 0 && decoder_element_done(dec);
+      case LEN_ITEMS:
+            items = dec->len;
+            break;
+      case LEN_PAIRS:
+            items = (uint64_t)dec->len * UINT64_C(2);
+            break;
+      default:
+            abort();
+      }
+
+      if (items == 0)
+            return decoder_element_done(dec);
+
+      if (dec->depth >= dec->stack_max) {
+            dec->stack_max *= 2;
+            dec->stack      = talloc_realloc(dec, dec->stack, uint64_t, dec->stack_max);
+      }
+      dec->stack[dec->depth++] = items;
+      return false;
+}
+
+/*
+ * Returns true if the element just finished was the last one of the message.
+ */
+static bool
+decoder_element_done(mpack_decoder *dec)
+{
+      while (dec->depth > 0) {
+            if (--dec->stack[dec->depth - 1] > 0)
+                  return false;
+            --dec->depth;
+      }
+      return true;
+}
+
+static void
+decoder_stash(mpack_decoder *dec, uint8_t const *data, size_t const len)
+{
+      if (dec->pending_len + len > dec->pending_max) {
+            dec->pending_max = MAXOF(dec->pending_len + len, dec->pending_max * 2);
+            dec->pending     = talloc_realloc(dec, dec->pending, uint8_t, dec->pending_max);
+      }
+      memcpy(dec->pending + dec->pending_len, data, len);
+      dec->pending_len += len;
+}
+
 /*----------------------------------------------------------------------------*/
 
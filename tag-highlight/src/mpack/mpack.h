@@ -158,8 +158,16 @@ extern void        mpack_print_object     (FILE *fp, const mpack_obj *result, bs
 extern int         mpack_destroy_object   (mpack_obj *root);
 extern void        mpack_destroy_arg_array(mpack_arg_array *calls);
 extern mpack_obj * mpack_decode_stream    (intptr_t fd);
+extern bool        mpack_decode_stream_pending(intptr_t fd);
 extern mpack_obj * mpack_decode_obj       (bstring *buf);
 
+/* Incremental decoding of a byte stream delivered in arbitrary chunks. */
+P99_DECLARE_STRUCT(mpack_decoder);
+typedef void (mpack_decoder_cb)(mpack_obj *obj, void *arg);
+extern mpack_decoder *mpack_decoder_create(void *talloc_ctx);
+extern void           mpack_decoder_feed  (mpack_decoder *dec, uint8_t const *data, size_t len,
+                                           mpack_decoder_cb *callback, void *arg);
+
 /* Encode */
 extern mpack_obj * mpack_make_new         (unsigned len, bool encode);
 extern void        mpack_encode_array     (mpack_obj *root, mpack_obj **item, unsigned len);
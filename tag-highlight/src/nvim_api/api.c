@@ -145,16 +145,36 @@ b_list *
         return intern_mpack_expect(result, E_STRLIST).ptr;
 }
 
+/*
+ * The whole of a buffer together with the changedtick it is current as of. Both are
+ * read by one request so that no edit can come in between them. Returns NULL, with
+ * `*tick' set to 0, if neovim didn't answer with both.
+ */
+b_list *
+(nvimext_buf_get_lines_ticked)(unsigned const bufnum, uint32_t *tick)
+{
+        static bstring const fn   = bt_init("nvim_exec_lua");
+        static bstring const code = bt_init("local b = ... return {vim.api.nvim_buf_get_changedtick(b), "
+                                            "vim.api.nvim_buf_get_lines(b, 0, -1, false)}");
+
+        mpack_obj   *result = generic_call(true, &fn, B("s,[d]"), &code, bufnum);
+        mpack_array *arr    = intern_mpack_expect(result, E_MPACK_ARRAY).ptr;
+        b_list      *ret    = NULL;
+
+        *tick = 0;
+        if (arr && arr->qty == 2) {
+                *tick = (uint32_t)mpack_expect(arr->lst[0], E_NUM).num;
+                ret   = mpack_expect(arr->lst[1], E_STRLIST, true).ptr;
+        }
+
+        talloc_free(arr);
+        return ret;
+}
 
 bstring *
 (nvim_buf_get_name)(unsigned const bufnum)
 {
-        static bstring const fn = BS_FROMARR(__func__);
-        char       fullname[PATH_MAX + 1];
-        mpack_obj *result = generic_call(true, &fn, B("d"), bufnum);
-        bstring   *ret    = intern_mpack_expect(result, E_STRING).ptr;
-        b_assign_cstr(ret, realpath(BS(ret), fullname));
-        return ret;
+        return nvim_buf_get_name_await(nvim_buf_get_name_async(bufnum));
 }
 
 mpack_retval
@@ -187,6 +207,46 @@ unsigned
         return (unsigned)intern_mpack_expect(result, E_NUM).num;
 }
 
+/*--------------------------------------------------------------------------------------*/
+/* Pipelined variants. Each returns as soon as the request is queued for writing. */
+
+nvim_future *
+(nvim_buf_attach_async)(unsigned const bufnum)
+{
+        static bstring const fn = bt_init("nvim_buf_attach");
+        return future_call(&fn, B("d,B,[]"), bufnum, false);
+}
+
+nvim_future *
+(nvim_buf_get_changedtick_async)(unsigned const bufnum)
+{
+        static bstring const fn = bt_init("nvim_buf_get_changedtick");
+        return future_call(&fn, B("d"), bufnum);
+}
+
+nvim_future *
+(nvim_buf_get_name_async)(unsigned const bufnum)
+{
+        static bstring const fn = bt_init("nvim_buf_get_name");
+        return future_call(&fn, B("d"), bufnum);
+}
+
+bstring *
+(nvim_buf_get_name_await)(nvim_future *fut)
+{
+        char     fullname[PATH_MAX + 1];
+        bstring *ret = nvim_future_await(fut, E_STRING).ptr;
+        b_assign_cstr(ret, realpath(BS(ret), fullname));
+        return ret;
+}
+
+nvim_future *
+(nvim_buf_get_option_async)(unsigned const bufnum, bstring const *optname)
+{
+        static bstring const fn = bt_init("nvim_buf_get_option");
+        return future_call(&fn, B("d,s"), bufnum, optname);
+}
+
 /*--------------------------------------------------------------------------------------
  * /================\
  * |GLOBAL FUNCTIONS|
@@ -294,6 +354,48 @@ bool
         return ret;
 }
 
+nvim_future *
+(nvim_call_function_async)(bstring const *function)
+{
+        static bstring const fn = bt_init("nvim_call_function");
+        return future_call(&fn, B("s,[]"), function);
+}
+
+nvim_future *
+(nvim_eval_async)(bstring const *eval)
+{
+        static bstring const fn = bt_init("nvim_eval");
+        return future_call(&fn, B("s"), eval);
+}
+
+nvim_future *
+(nvim_get_option_async)(bstring const *optname)
+{
+        static bstring const fn = bt_init("nvim_get_option");
+        return future_call(&fn, B("s"), optname);
+}
+
+nvim_future *
+(nvim_get_var_async)(bstring const *varname)
+{
+        static bstring const fn = bt_init("nvim_get_var");
+        return future_call(&fn, B("s"), varname);
+}
+
+nvim_future *
+(nvimext_get_var_fmt_async)(char const *fmt, ...)
+{
+        va_list ap;
+        va_start(ap, fmt);
+        bstring *varname = b_vformat(fmt, ap);
+        va_end(ap);
+
+        /* The name is copied into the encoded request, so it can go right away. */
+        nvim_future *fut = nvim_get_var_async(varname);
+        b_destroy(varname);
+        return fut;
+}
+
 /*--------------------------------------------------------------------------------------*/
 /* Highlight related functions */
 
@@ -398,31 +500,302 @@ void
         assert(result == NULL);
 }
 
+/*======================================================================================*/
+
+/*
+ * Send a whole buffer's worth of highlights as one flat array of
+ * (line, start, end, group index) quadruples together with a table of group names,
+ * to be applied by the bundled Lua module with nvim_buf_set_extmark. `clears' is a
+ * flat array of (first, last) line ranges to clear beforehand. Compared to one
+ * nvim_buf_add_highlight per token this is a fraction of the size and is encoded
+ * straight into the output buffer without building an object tree.
+ */
+void
+(nvimext_buf_apply_highlights)(unsigned const       bufnum,
+                               int      const       ns_id,
+                               int      const      *clears,
+                               unsigned const       nclears,
+                               b_list   const      *groups,
+                               unsigned const      *data,
+                               unsigned const       ndata)
+{
+        static bstring const fn   = bt_init("nvim_exec_lua");
+        static bstring const code = bt_init("require'tag_highlight'.apply(...)");
+
+        int const  count = INC_COUNT();
+        mpack_obj *pack  = mpack_make_new(0, false);
+
+        mpack_encode_array(pack, NULL, 4);
+        mpack_encode_integer(pack, NULL, MES_REQUEST);
+        mpack_encode_integer(pack, NULL, count);
+        mpack_encode_string(pack, NULL, &fn);
+        mpack_encode_array(pack, NULL, 2);
+        mpack_encode_string(pack, NULL, &code);
+
+        mpack_encode_array(pack, NULL, 5);
+        mpack_encode_integer(pack, NULL, bufnum);
+        mpack_encode_integer(pack, NULL, ns_id);
+
+        mpack_encode_array(pack, NULL, nclears);
+        for (unsigned i = 0; i < nclears; ++i)
+                mpack_encode_integer(pack, NULL, clears[i]);
+
+        mpack_encode_array(pack, NULL, groups->qty);
+        for (unsigned i = 0; i < groups->qty; ++i)
+                mpack_encode_string(pack, NULL, groups->lst[i]);
+
+        mpack_encode_array(pack, NULL, ndata);
+        for (unsigned i = 0; i < ndata; ++i)
+                mpack_encode_unsigned(pack, NULL, data[i]);
+
+        mpack_obj *result = special_call(true, &fn, pack, count);
+        mpack_obj *error  = mpack_index(result, 2);
+        if (error && mpack_type(error) == MPACK_ARRAY) {
+                error = mpack_index(error, 1);
+                if (error && mpack_type(error) == MPACK_STRING)
+                        warnd("Failed to apply highlights: %s", BS(error->str));
+        }
+        talloc_free(result);
+}
+
 /*======================================================================================*/
 /* The single most important api function gets its own section for no reason. */
 
+/*
+ * Neovim applies a whole nvim_call_atomic before it looks at anything else, so a
+ * request carrying tens of thousands of highlights freezes the editor for as long as
+ * that takes. Bigger lists are therefore split into requests of at most
+ * `tag_highlight#atomic_chunk_calls' calls or about `tag_highlight#atomic_chunk_kb'
+ * KiB each. Up to `tag_highlight#atomic_pipeline' of those are in flight at once; if
+ * `tag_highlight#atomic_yield_usec' is non-zero we also wait that long after each
+ * answer before sending the next chunk, which leaves neovim idle time to handle
+ * input. That is off by default.
+ *
+ * Small and chunked requests alike are sent from the calling thread, which waits
+ * for the last answer, so that they can't be overtaken by whatever the caller sends
+ * next and so that any error neovim reports is logged.
+ */
+#define NVIM_ATOMIC_MAX_PIPELINE (16U)
+
+struct atomic_chunk {
+        mpack_obj *pack;
+        int        count;
+        unsigned   first;
+        unsigned   ncalls;
+};
+
+struct atomic_job {
+        unsigned            qty;
+        struct atomic_chunk chunk[];
+};
+
+static struct {
+        atomic_uint_least64_t requests;
+        atomic_uint_least64_t chunks;
+        atomic_uint_least64_t calls;
+        atomic_uint_least64_t total_ns;
+        atomic_uint_least64_t max_ns;
+} atomic_stats;
+
+static bstring const atomic_fn = bt_init("nvim_call_atomic");
+
+static mpack_obj *encode_atomic(mpack_arg_array const *calls, unsigned first, unsigned n, int count);
+static size_t     estimate_call_size(char const *fmt, mpack_argument const *args);
+static void       send_atomic_chunks(struct atomic_job *job);
+static void       check_atomic_result(mpack_obj *result, unsigned first);
+
 void
 (nvim_call_atomic)(mpack_arg_array const *calls)
 {
-        static bstring const fn     = BS_FROMARR(__func__);
-        static char const    base[] = "[d,d,s:[:";
+        struct atomic_job *job;
+        unsigned           nchunks   = 0;
+        unsigned           ncalls    = 0;
+        size_t             nbytes    = 0;
+        unsigned const     max_calls = settings.atomic_chunk_calls ? settings.atomic_chunk_calls : UINT_MAX;
+        size_t const       max_bytes = settings.atomic_chunk_kb ? (size_t)settings.atomic_chunk_kb << 10 : SIZE_MAX;
+
+        if (calls->qty <= max_calls) {
+                for (unsigned i = 0; i < calls->qty; ++i)
+                        nbytes += estimate_call_size(calls->fmt[i], calls->args[i]);
+                if (nbytes <= max_bytes) {
+                        int const  count = INC_COUNT();
+                        mpack_obj *pack  = encode_atomic(calls, 0, calls->qty, count);
+                        mpack_obj *result = special_call(true, &atomic_fn, pack, count);
+                        check_atomic_result(result, 0);
+                        talloc_free(result);
+                        return;
+                }
+        }
+
+        /* Worst case every call needs a chunk of its own. */
+        job    = malloc(offsetof(struct atomic_job, chunk) +
+                        (sizeof(struct atomic_chunk) * calls->qty));
+        nbytes = 0;
+
+        for (unsigned i = 0; i < calls->qty; ++i) {
+                size_t const size = estimate_call_size(calls->fmt[i], calls->args[i]);
+
+                if (ncalls > 0 && (ncalls >= max_calls || nbytes + size > max_bytes))
+                {
+                        job->chunk[nchunks++] = (struct atomic_chunk){.first = i - ncalls, .ncalls = ncalls};
+                        ncalls = 0;
+                        nbytes = 0;
+                }
+                ++ncalls;
+                nbytes += size;
+        }
+        job->chunk[nchunks++] = (struct atomic_chunk){.first = calls->qty - ncalls, .ncalls = ncalls};
+        job->qty = nchunks;
+
+        for (unsigned i = 0; i < nchunks; ++i) {
+                struct atomic_chunk *ch = &job->chunk[i];
+                ch->count = INC_COUNT();
+                ch->pack  = encode_atomic(calls, ch->first, ch->ncalls, ch->count);
+        }
+
+        atomic_fetch_add_explicit(&atomic_stats.requests, 1, memory_order_relaxed);
+        send_atomic_chunks(job);
+        free(job);
+}
+
+static mpack_obj *
+encode_atomic(mpack_arg_array const *calls, unsigned const first, unsigned const n, int const count)
+{
+        static char const base[] = "[d,d,s:[:";
 
         bstring *fmt = b_create(4096);
         memcpy(fmt->data, base, sizeof(base));
         fmt->slen = sizeof(base) - 1;
 
-        if (calls->qty) {
-                b_sprintfa(fmt, "[ @[%n],", calls->fmt[0]);
-                for (unsigned i = 1; i < calls->qty; ++i)
-                        b_sprintfa(fmt, "[*%n],", calls->fmt[i]);
+        if (n) {
+                b_sprintfa(fmt, "[ @[%n],", calls->fmt[first]);
+                for (unsigned i = 1; i < n; ++i)
+                        b_sprintfa(fmt, "[*%n],", calls->fmt[first + i]);
                 b_catlit(fmt, " ]");
         }
         b_catlit(fmt, ":]]");
 
-        int const  count = INC_COUNT();
-        mpack_obj *pack  = mpack_encode_fmt(calls->qty, BS(fmt), MES_REQUEST,
-                                            count, &fn, calls->args);
+        mpack_obj *pack = mpack_encode_fmt(n, BS(fmt), MES_REQUEST, count,
+                                           &atomic_fn, calls->args + first);
         b_destroy(fmt);
-        UNUSED mpack_obj *result = special_call(false, &fn, pack, count);
-        assert(result == NULL);
+        return pack;
+}
+
+/* A rough upper bound on the encoded size of one call, good enough to size chunks. */
+static size_t
+estimate_call_size(char const *fmt, mpack_argument const *args)
+{
+        size_t   size = 1;
+        unsigned n    = 0;
+
+        for (; *fmt; ++fmt) {
+                switch (*fmt) {
+                case 's': case 'S':
+                        size += 5 + (args[n].str ? args[n].str->slen : 0);
+                        ++n;
+                        break;
+                case 'c': case 'C':
+                        size += 5 + (args[n].c_str ? strlen(args[n].c_str) : 0);
+                        ++n;
+                        break;
+                case 'b': case 'B': case 'd': case 'D':
+                case 'l': case 'L': case 'u': case 'U':
+                        size += 9;
+                        ++n;
+                        break;
+                case 'n': case 'N':
+                        size += 1;
+                        break;
+                case '[': case '{':
+                        size += 5;
+                        break;
+                default:
+                        break;
+                }
+        }
+
+        return size;
+}
+
+/*
+ * Neovim handles the chunks one after another, so the time a chunk took to apply is
+ * measured from when it was sent or when the answer to the previous chunk arrived,
+ * whichever was later.
+ */
+static void
+send_atomic_chunks(struct atomic_job *job)
+{
+        nvim_future    *futs[NVIM_ATOMIC_MAX_PIPELINE];
+        struct timespec sent[NVIM_ATOMIC_MAX_PIPELINE];
+        struct timespec prev  = {0, 0};
+        unsigned        next  = 0;
+        unsigned const  depth = MAXOF(MINOF(settings.atomic_pipeline, NVIM_ATOMIC_MAX_PIPELINE), 1U);
+
+        for (unsigned done = 0; done < job->qty; ++done) {
+                while (next < job->qty && next - done < depth) {
+                        unsigned const slot = next % depth;
+                        clock_gettime(CLOCK_MONOTONIC, &sent[slot]);
+                        futs[slot] = future_special_call(job->chunk[next].pack, job->chunk[next].count);
+                        ++next;
+                }
+
+                struct timespec       now, diff;
+                unsigned const        slot   = done % depth;
+                mpack_obj            *result = nvim_future_get(futs[slot]);
+                struct timespec const *from  = &sent[slot];
+
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                if (prev.tv_sec > from->tv_sec || (prev.tv_sec == from->tv_sec && prev.tv_nsec > from->tv_nsec))
+                        from = &prev;
+                TIMESPEC_SUB(&now, from, &diff);
+                prev = now;
+
+                uint64_t const ns  = ((uint64_t)diff.tv_sec * NSEC2SECOND) + (uint64_t)diff.tv_nsec;
+                uint64_t       max = atomic_load_explicit(&atomic_stats.max_ns, memory_order_relaxed);
+                while (ns > max && !atomic_compare_exchange_weak(&atomic_stats.max_ns, &max, ns))
+                        ;
+                atomic_fetch_add_explicit(&atomic_stats.total_ns, ns, memory_order_relaxed);
+                atomic_fetch_add_explicit(&atomic_stats.calls, job->chunk[done].ncalls, memory_order_relaxed);
+                atomic_fetch_add_explicit(&atomic_stats.chunks, 1, memory_order_relaxed);
+
+                check_atomic_result(result, job->chunk[done].first);
+                talloc_free(result);
+
+                if (settings.atomic_yield_usec > 0 && next < job->qty)
+                        fsleep((double)settings.atomic_yield_usec / 1000000.0);
+        }
+}
+
+/* The result of nvim_call_atomic is [results, error], where error is nil or
+ * [index, type, message] describing the call that failed. */
+static void
+check_atomic_result(mpack_obj *result, unsigned const first)
+{
+        mpack_obj *data  = mpack_index(result, 3);
+        mpack_obj *error = data && mpack_type(data) == MPACK_ARRAY ? mpack_index(data, 1) : NULL;
+
+        if (error && mpack_type(error) == MPACK_ARRAY) {
+                mpack_obj *index = mpack_index(error, 0);
+                mpack_obj *msg   = mpack_index(error, 2);
+                warnd("nvim_call_atomic failed at call %" PRId64 ": %s",
+                      (int64_t)first + (index ? mpack_expect(index, E_NUM, false).num : 0),
+                      msg && mpack_type(msg) == MPACK_STRING ? BS(msg->str) : "?");
+        }
+}
+
+void
+nvim_api_report_atomic_stats(void)
+{
+        uint64_t const requests = atomic_load_explicit(&atomic_stats.requests, memory_order_relaxed);
+        uint64_t const chunks   = atomic_load_explicit(&atomic_stats.chunks, memory_order_relaxed);
+
+        if (chunks == 0)
+                return;
+
+        warnd("Atomic calls: %" PRIu64 " requests split into %" PRIu64 " chunks of avg %.1f calls; "
+              "apply time per chunk avg %.2fms max %.2fms",
+              requests, chunks,
+              (double)atomic_load_explicit(&atomic_stats.calls, memory_order_relaxed) / (double)chunks,
+              ((double)atomic_load_explicit(&atomic_stats.total_ns, memory_order_relaxed) / (double)chunks) / 1000000.0,
+              (double)atomic_load_explicit(&atomic_stats.max_ns, memory_order_relaxed) / 1000000.0);
 }
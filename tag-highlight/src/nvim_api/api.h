@@ -28,6 +28,9 @@ typedef enum nvim_message_type    nvim_message_type;
 typedef enum nvim_filetype_id     nvim_filetype_id;
 typedef enum nvim_connection_type nvim_connection_type;
 
+/* A request that has been sent but whose response has not yet been collected. */
+typedef struct nvim_future nvim_future;
+
 struct nvim_wait {
         int32_t    fd;
         int32_t    count;
@@ -68,6 +71,25 @@ extern void           nvim_subscribe           (bstring const *event);
 extern bool           nvim_set_var             (bstring const *varname, bstring const *fmt, ...);
 extern bool           nvim_set_option          (bstring const *optname, bstring const *value);
 
+/*----------------------------------------------------------------------------*/
+/* Pipelined requests: issue any number of these, then await each future exactly once. */
+
+extern nvim_future  * nvim_buf_attach_async          (unsigned bufnum) __aWUR;
+extern nvim_future  * nvim_buf_get_changedtick_async (unsigned bufnum) __aWUR;
+extern nvim_future  * nvim_buf_get_name_async        (unsigned bufnum) __aWUR;
+extern bstring      * nvim_buf_get_name_await        (nvim_future *fut) __aWUR;
+extern nvim_future  * nvim_buf_get_option_async      (unsigned bufnum, bstring const *optname) __aWUR;
+extern nvim_future  * nvim_call_function_async       (bstring const *function) __aWUR;
+extern nvim_future  * nvim_eval_async                (bstring const *eval) __aWUR;
+extern nvim_future  * nvim_get_option_async          (bstring const *optname) __aWUR;
+extern nvim_future  * nvim_get_var_async             (bstring const *varname) __aWUR;
+extern nvim_future  * nvimext_get_var_fmt_async      (char const *fmt, ...) __aFMT(1, 2) __aWUR;
+
+extern mpack_obj    * nvim_future_get       (nvim_future *fut) __aWUR;
+extern mpack_retval   nvim_future_await     (nvim_future *fut, mpack_expect_t expect, uint64_t defval) __aWUR;
+extern void           nvim_future_await_all (unsigned nfuts, nvim_future *futs[], mpack_expect_t expect, mpack_retval results[]);
+extern void           nvim_future_discard   (nvim_future *fut);
+
 extern mpack_retval nvim_command_output(bstring const *cmd, mpack_expect_t expect) __aWUR
         __attribute__((error("deprecated"))) __aDEPMSG("Deprecated in v7: see nvim_exec");
 extern void nvim_buf_clear_highlight(unsigned bufnum, int hl_id, unsigned start, int end, bool blocking)
@@ -77,6 +99,9 @@ extern void nvim_set_client_info(bstring const *name, unsigned major, unsigned m
                                  bstring const *type, void const *methods, void const *attributes);
 
 
+extern void nvimext_buf_apply_highlights(unsigned bufnum, int ns_id, int const *clears, unsigned nclears,
+                                        b_list const *groups, unsigned const *data, unsigned ndata);
+extern b_list     * nvimext_buf_get_lines_ticked(unsigned bufnum, uint32_t *tick) __aWUR;
 extern mpack_retval nvimext_get_var_fmt (mpack_expect_t expect, char const *fmt, ...) __aFMT(2, 3) __aWUR;
 extern mpack_retval nvimext_call_function_fmt (bstring const *function, mpack_expect_t expect, char const *fmt, ...) __aWUR __aDEP;
 
@@ -97,6 +122,13 @@ extern mpack_retval nvimext_call_function_fmt (bstring const *function, mpack_ex
  */
 extern int nvimext_get_tmpfile(bstring *restrict*restrict name, const bstring *restrict suffix);
 
+/* Log how many messages and bytes each flush of the RPC writer thread carried. */
+extern void nvim_api_report_writer_stats(void);
+
+/* Log how many chunks large nvim_call_atomic requests were split into and how long
+ * neovim took to apply them. */
+extern void nvim_api_report_atomic_stats(void);
+
 
 /*============================================================================*/
 extern int _nvim_api_read_fd;
@@ -135,6 +167,9 @@ extern int _nvim_api_read_fd;
 #define nvim_get_var(...)          P99_CALL_DEFARG(nvim_get_var, 3, __VA_ARGS__)
 #define nvim_get_var_defarg_2()    (UINT64_C(0))
 
+#define nvim_future_await(...)       P99_CALL_DEFARG(nvim_future_await, 3, __VA_ARGS__)
+#define nvim_future_await_defarg_2() (UINT64_C(0))
+
 #define nvim_buf_get_option(...)       P99_CALL_DEFARG(nvim_buf_get_option, 4, __VA_ARGS__)
 #define nvim_buf_get_option_defarg_3() (UINT64_C(0))
 #define nvim_buf_get_var(...)          P99_CALL_DEFARG(nvim_buf_get_var, 4, __VA_ARGS__)
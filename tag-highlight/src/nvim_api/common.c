@@ -1,15 +1,22 @@
 #include "Common.h"
+#include <sched.h>
 
 #include "intern.h"
 #include "mpack/mpack.h"
 #include "nvim_api/api.h"
 #include "nvim_api/wait_node.h"
+#include "util/thread_pool.h"
 
-P99_FIFO(nvim_wait_node_ptr) nvim_wait_queue;
+static _Atomic(nvim_wait_node *) nvim_wait_slots[NVIM_WAIT_SLOTS];
 
 typedef volatile p99_futex vfutex_t;
 typedef unsigned char      byte;
 
+struct nvim_future {
+      nvim_wait_node node;
+      mpack_obj     *pack;
+};
+
 struct gencall {
     //alignas(32)
       int count;
@@ -18,16 +25,19 @@ struct gencall {
       bstring const *fn;
 };
 
-extern intptr_t global_output_descriptor;
+extern intptr_t             global_output_descriptor;
+extern thread_pool         *thl_worker_pool;
 extern _Atomic(mpack_obj *) event_loop_mpack_obj;
 extern vfutex_t             event_loop_futex, nvim_wait_futex;
 static pthread_mutex_t      await_package_mutex = PTHREAD_MUTEX_INITIALIZER;
 vfutex_t                    nvim_wait_futex     = P99_FUTEX_INITIALIZER(0);
 
-static NORETURN void *make_async_call(void *arg);
+static void       make_async_call(void *arg);
 static mpack_obj *make_call(bool blocking, bstring const *fn, mpack_obj *pack, int count);
 static mpack_obj *write_and_clean(mpack_obj *pack, int count, bstring const *func);
 static mpack_obj *await_package(nvim_wait_node *node) __aWUR;
+static mpack_obj *encode_request(int count, bstring const *fn, bstring const *fmt, va_list *ap);
+static void       log_outgoing(mpack_obj *pack);
 
 void *nvim_common_talloc_ctx_ = NULL;
 #define CTX nvim_common_talloc_ctx_
@@ -47,20 +57,32 @@ make_call(bool const blocking, bstring const *fn, mpack_obj *pack, int const cou
             gc->pack           = pack;
             gc->fn             = fn;
             result             = NULL;
-            START_DETACHED_PTHREAD(make_async_call, gc);
+            thread_pool_submit(thl_worker_pool, make_async_call, gc);
       }
 
       return result;
 }
 
-static NORETURN void *
+static void
 make_async_call(void *arg)
 {
       struct gencall *gc  = arg;
       mpack_obj      *ret = write_and_clean(gc->pack, gc->count, gc->fn);
       talloc_free(ret);
       free(gc);
-      pthread_exit();
+}
+
+static mpack_obj *
+encode_request(int const count, bstring const *fn, bstring const *fmt, va_list *ap)
+{
+      if (fmt) {
+            const unsigned size = fmt->slen + 16U;
+            char           buf[size];
+            snprintf(buf, size, "[d,d,s:[!%s]]", BS(fmt));
+            return mpack_encode_fmt(0, buf, MES_REQUEST, count, fn, ap);
+      }
+
+      return mpack_encode_fmt(0, "[d,d,s:[]]", MES_REQUEST, count, fn);
 }
 
 mpack_obj *
@@ -69,21 +91,12 @@ nvim_api_intern_make_generic_call(bool    const        blocking,
                                   bstring const *const fmt,
                                   ...)
 {
-      mpack_obj *pack;
+      va_list    ap;
       int const  count = INC_COUNT();
 
-      if (fmt) {
-            const unsigned size = fmt->slen + 16U;
-            va_list        ap;
-            char           buf[size];
-            snprintf(buf, size, "[d,d,s:[!%s]]", BS(fmt));
-
-            va_start(ap, fmt);
-            pack = mpack_encode_fmt(0, buf, MES_REQUEST, count, fn, &ap);
-            va_end(ap);
-      } else {
-            pack = mpack_encode_fmt(0, "[d,d,s:[]]", MES_REQUEST, count, fn);
-      }
+      va_start(ap, fmt);
+      mpack_obj *pack = encode_request(count, fn, fmt, &ap);
+      va_end(ap);
 
       return make_call(blocking, fn, pack, count);
 }
@@ -99,6 +112,87 @@ nvim_api_intern_make_special_call(bool const     blocking,
 
 /*======================================================================================*/
 
+/*
+ * Futures let a caller put any number of requests on the wire before waiting for
+ * the first answer. Neovim handles the requests of a channel in order, so N
+ * independent calls issued this way cost roughly one round trip instead of N.
+ */
+nvim_future *
+nvim_api_intern_make_future_call(bstring const *fn, bstring const *fmt, ...)
+{
+      va_list    ap;
+      int const  count = INC_COUNT();
+      mpack_obj *pack;
+
+      va_start(ap, fmt);
+      pack = encode_request(count, fn, fmt, &ap);
+      va_end(ap);
+
+      return nvim_api_intern_make_future_special_call(pack, count);
+}
+
+/* Like the above, for a request that has already been encoded as number `count'. */
+nvim_future *
+nvim_api_intern_make_future_special_call(mpack_obj *pack, int const count)
+{
+      nvim_future *fut = calloc(1, sizeof(nvim_future));
+
+      fut->pack       = pack;
+      fut->node.fd    = 1;
+      fut->node.count = count;
+      p99_futex_init(&fut->node.fut, 0);
+
+      log_outgoing(fut->pack);
+      nvim_wait_node_register(&fut->node);
+      write_packet(*fut->pack->packed);
+
+      return fut;
+}
+
+mpack_obj *
+nvim_future_get(nvim_future *fut)
+{
+      mpack_obj *obj = await_package(&fut->node);
+      talloc_free(fut->pack);
+      free(fut);
+      return obj;
+}
+
+mpack_retval
+(nvim_future_await)(nvim_future *fut, mpack_expect_t const expect, uint64_t const defval)
+{
+      return intern_mpack_expect(nvim_future_get(fut), expect, defval);
+}
+
+void
+nvim_future_await_all(unsigned const       nfuts,
+                      nvim_future         *futs[],
+                      mpack_expect_t const expect,
+                      mpack_retval         results[])
+{
+      for (unsigned i = 0; i < nfuts; ++i) {
+            if (!futs[i]) {
+                  if (results)
+                        results[i].ptr = NULL;
+                  continue;
+            }
+            if (results)
+                  results[i] = nvim_future_await(futs[i], expect);
+            else
+                  talloc_free(nvim_future_get(futs[i]));
+            futs[i] = NULL;
+      }
+}
+
+void
+nvim_future_discard(nvim_future *fut)
+{
+      if (fut)
+            talloc_free(nvim_future_get(fut));
+}
+
+/*======================================================================================*/
+
 __attribute__((__constructor__(200))) static void
 nvim_api_wrapper_init(void)
 {
@@ -127,26 +221,21 @@ await_package(nvim_wait_node *node)
 static mpack_obj *
 write_and_clean(mpack_obj *pack, int const count, UNUSED bstring const *func)
 {
-#if defined DEBUG && defined DEBUG_LOGS
-      if (mpack_raw_write) {
-            size_t n = fwrite((*pack->packed)->data, 1, (*pack->packed)->slen, mpack_raw_write);
-            assert(!ferror(mpack_raw_write) && (unsigned)n == (*pack->packed)->slen);
-      }
-      mpack_print_object(mpack_log, pack, B("\033[1;34mSENDING MESSAGE\033[0m"));
-#endif
-
       mpack_obj      *ret;
       nvim_wait_node *node;
 
-      b_write(1, *pack->packed);
-      /* b_send(global_output_descriptor, *pack->packed); */
+      log_outgoing(pack);
 
       node        = calloc(1, sizeof(*node));
       node->fd    = 1;
       node->count = count;
-
       p99_futex_init(&node->fut, 0);
-      P99_FIFO_APPEND(&nvim_wait_queue, node);
+
+      /* The node must be findable before neovim can possibly respond. */
+      nvim_wait_node_register(node);
+
+      write_packet(*pack->packed);
+      /* b_send(global_output_descriptor, *pack->packed); */
 
       ret = await_package(node);
 
@@ -155,6 +244,51 @@ write_and_clean(mpack_obj *pack, int const count, UNUSED bstring const *func)
       return ret;
 }
 
+static void
+log_outgoing(UNUSED mpack_obj *pack)
+{
+#if defined DEBUG && defined DEBUG_LOGS
+      if (mpack_raw_write) {
+            size_t n = fwrite((*pack->packed)->data, 1, (*pack->packed)->slen, mpack_raw_write);
+            assert(!ferror(mpack_raw_write) && (unsigned)n == (*pack->packed)->slen);
+      }
+      mpack_print_object(mpack_log, pack, B("\033[1;34mSENDING MESSAGE\033[0m"));
+#endif
+}
+
+void
+nvim_wait_node_register(nvim_wait_node *node)
+{
+      _Atomic(nvim_wait_node *) *slot = &nvim_wait_slots[node->count & (NVIM_WAIT_SLOTS - 1U)];
+      nvim_wait_node            *expect;
+
+      /* The slot can only be occupied if NVIM_WAIT_SLOTS requests are outstanding
+       * at once, in which case we have to wait for the oldest one to finish. */
+      for (;;) {
+            expect = NULL;
+            if (atomic_compare_exchange_weak_explicit(slot, &expect, node,
+                                                      memory_order_acq_rel,
+                                                      memory_order_relaxed))
+                  break;
+            sched_yield();
+      }
+}
+
+nvim_wait_node *
+nvim_wait_node_take(unsigned const count)
+{
+      _Atomic(nvim_wait_node *) *slot = &nvim_wait_slots[count & (NVIM_WAIT_SLOTS - 1U)];
+      nvim_wait_node            *node = atomic_load_explicit(slot, memory_order_acquire);
+
+      if (!node || node->count != count)
+            return NULL;
+      if (!atomic_compare_exchange_strong_explicit(slot, &node, NULL,
+                                                   memory_order_acq_rel,
+                                                   memory_order_relaxed))
+            return NULL;
+      return node;
+}
+
 /*======================================================================================*/
 
 mpack_retval
@@ -35,11 +35,17 @@ INTERN int          nvim_api_intern_get_fd_count(int fd, bool inc);
 INTERN mpack_obj   *nvim_api_intern_make_generic_call(bool blocking, const bstring *fn, const bstring *fmt, ...);
 INTERN mpack_obj   *nvim_api_intern_make_special_call(bool blocking, const bstring *fn, mpack_obj *pack, int count);
 INTERN mpack_retval nvim_api_intern_mpack_expect_wrapper(mpack_obj *root, mpack_expect_t type, uint64_t defval) __aWUR;
+INTERN void         nvim_api_intern_write_packet(bstring const *packed);
+INTERN nvim_future *nvim_api_intern_make_future_call(const bstring *fn, const bstring *fmt, ...) __aWUR;
+INTERN nvim_future *nvim_api_intern_make_future_special_call(mpack_obj *pack, int count) __aWUR;
 
 #undef INTERN
 #define generic_call nvim_api_intern_make_generic_call
 #define special_call nvim_api_intern_make_special_call
 #define intern_mpack_expect nvim_api_intern_mpack_expect_wrapper
+#define write_packet nvim_api_intern_write_packet
+#define future_call nvim_api_intern_make_future_call
+#define future_special_call nvim_api_intern_make_future_special_call
 
 
 #define nvim_api_intern_mpack_expect_wrapper(...) P99_CALL_DEFARG(nvim_api_intern_mpack_expect_wrapper, 3, __VA_ARGS__)
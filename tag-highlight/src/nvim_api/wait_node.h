@@ -13,18 +13,23 @@ extern "C" {
 #endif
 
 
-P99_DECLARE_FIFO(nvim_wait_node);
+/* Must be a power of 2. This is the maximum number of outstanding requests. */
+#define NVIM_WAIT_SLOTS 1024U
+
+P99_DECLARE_STRUCT(nvim_wait_node);
 struct nvim_wait_node {
         int        fd;
         unsigned   count;
         p99_futex  fut;
         _Atomic(mpack_obj *) obj;
-        pthread_mutex_t mtx;
-        pthread_cond_t cond;
-
-        nvim_wait_node_ptr p99_fifo;
 };
-extern P99_FIFO(nvim_wait_node_ptr) nvim_wait_queue;
+
+/*
+ * Waiters register themselves in a slot indexed by their msgid before the request is
+ * written, so the response can always be routed with a single lookup.
+ */
+extern void            nvim_wait_node_register(nvim_wait_node *node);
+extern nvim_wait_node *nvim_wait_node_take(unsigned count);
 
 
 #ifdef __cplusplus
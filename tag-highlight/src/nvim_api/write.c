@@ -0,0 +1,241 @@
+#include "Common.h"
+
+#include "intern.h"
+#include "mpack/mpack.h"
+#include "nvim_api/api.h"
+
+#ifndef _WIN32
+#  include <sys/uio.h>
+#endif
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+/*
+ * Every encoded request is handed to a single writer thread instead of being
+ * written by whichever thread made the call. Concurrent callers can no longer
+ * interleave their messages, and whatever has piled up while the writer was busy
+ * goes out with one writev().
+ *
+ * If NVIM_WRITER_CORK_USEC is non-zero the writer waits up to that long for more
+ * packets whenever it has less than NVIM_WRITER_CORK_BYTES ready, trading a little
+ * latency for fewer syscalls. This is off by default.
+ */
+#define NVIM_WRITER_CORK_USEC  (0)
+#define NVIM_WRITER_CORK_BYTES (4096)
+
+struct write_node {
+      uint8_t const     *data;
+      size_t             len;
+      struct write_node *next;
+};
+
+static struct {
+      pthread_mutex_t    mtx;
+      pthread_cond_t     cond;
+      pthread_once_t     once;
+      struct write_node *head;
+      struct write_node *tail;
+      size_t             queued_bytes;
+} writer = {.once = PTHREAD_ONCE_INIT};
+
+static struct {
+      atomic_uint_least64_t flushes;
+      atomic_uint_least64_t messages;
+      atomic_uint_least64_t bytes;
+      atomic_uint_least64_t max_messages;
+      atomic_uint_least64_t max_bytes;
+} writer_stats;
+
+static NORETURN void *writer_thread(void *arg);
+static void           writer_start(void);
+static void           write_batch(struct write_node *batch, unsigned nmsgs, size_t nbytes);
+static void           update_max(atomic_uint_least64_t *max, uint64_t val);
+
+__attribute__((__constructor__(200))) static void
+nvim_api_writer_init(void)
+{
+      pthread_mutex_init(&writer.mtx);
+      pthread_cond_init(&writer.cond, NULL);
+}
+
+/*======================================================================================*/
+
+/*
+ * Queue `packed' to be written to neovim. The data is not copied, so it must stay
+ * alive until the write has happened; blocking callers get that for free since no
+ * response can arrive before the request has been sent.
+ */
+void
+nvim_api_intern_write_packet(bstring const *packed)
+{
+      struct write_node *node = malloc(sizeof(struct write_node));
+      node->data = packed->data;
+      node->len  = packed->slen;
+      node->next = NULL;
+
+      pthread_once(&writer.once, writer_start);
+
+      pthread_mutex_lock(&writer.mtx);
+      if (writer.tail)
+            writer.tail->next = node;
+      else
+            writer.head = node;
+      writer.tail          = node;
+      writer.queued_bytes += node->len;
+      pthread_mutex_unlock(&writer.mtx);
+
+      pthread_cond_signal(&writer.cond);
+}
+
+static void
+writer_start(void)
+{
+      START_DETACHED_PTHREAD(writer_thread, NULL);
+}
+
+static NORETURN void *
+writer_thread(UNUSED void *arg)
+{
+      for (;;) {
+            struct write_node *batch;
+            size_t             nbytes;
+            unsigned           nmsgs = 0;
+
+            pthread_mutex_lock(&writer.mtx);
+            while (!writer.head)
+                  pthread_cond_wait(&writer.cond, &writer.mtx);
+
+#if NVIM_WRITER_CORK_USEC > 0
+            if (writer.queued_bytes < NVIM_WRITER_CORK_BYTES) {
+                  struct timespec deadline;
+                  clock_gettime(CLOCK_REALTIME, &deadline);
+                  deadline.tv_nsec += NVIM_WRITER_CORK_USEC * 1000L;
+                  if (deadline.tv_nsec >= (long)NSEC2SECOND) {
+                        deadline.tv_nsec -= (long)NSEC2SECOND;
+                        ++deadline.tv_sec;
+                  }
+                  while (writer.queued_bytes < NVIM_WRITER_CORK_BYTES)
+                        if (pthread_cond_timedwait(&writer.cond, &writer.mtx, &deadline) == ETIMEDOUT)
+                              break;
+            }
+#endif
+
+            batch               = writer.head;
+            nbytes              = writer.queued_bytes;
+            writer.head         = writer.tail = NULL;
+            writer.queued_bytes = 0;
+            pthread_mutex_unlock(&writer.mtx);
+
+            for (struct write_node *node = batch; node; node = node->next)
+                  ++nmsgs;
+
+            write_batch(batch, nmsgs, nbytes);
+      }
+}
+
+/*--------------------------------------------------------------------------------------*/
+
+#ifdef _WIN32
+static void
+write_batch(struct write_node *batch, unsigned const nmsgs, size_t const nbytes)
+{
+      while (batch) {
+            struct write_node *next = batch->next;
+            size_t             done = 0;
+
+            while (done < batch->len) {
+                  int const n = (int)write(1, batch->data + done, (unsigned)(batch->len - done));
+                  if (n < 0)
+                        err(1, "write()");
+                  done += (size_t)n;
+            }
+
+            free(batch);
+            batch = next;
+      }
+
+      atomic_fetch_add_explicit(&writer_stats.flushes, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&writer_stats.messages, nmsgs, memory_order_relaxed);
+      atomic_fetch_add_explicit(&writer_stats.bytes, nbytes, memory_order_relaxed);
+      update_max(&writer_stats.max_messages, nmsgs);
+      update_max(&writer_stats.max_bytes, nbytes);
+}
+#else
+static void
+write_batch(struct write_node *batch, unsigned const nmsgs, size_t const nbytes)
+{
+      struct iovec iov[IOV_MAX];
+
+      while (batch) {
+            int cnt = 0;
+
+            for (struct write_node *node = batch; node && cnt < IOV_MAX; node = node->next, ++cnt) {
+                  iov[cnt].iov_base = (void *)node->data;
+                  iov[cnt].iov_len  = node->len;
+            }
+
+            /* Write this group of packets in full, resuming after short writes. */
+            struct iovec *cur = iov;
+            int           rem = cnt;
+
+            while (rem > 0) {
+                  ssize_t n = writev(1, cur, rem);
+                  if (n < 0) {
+                        if (errno == EINTR)
+                              continue;
+                        err(1, "writev()");
+                  }
+                  while (rem > 0 && (size_t)n >= cur->iov_len) {
+                        n -= (ssize_t)cur->iov_len;
+                        ++cur;
+                        --rem;
+                  }
+                  if (rem > 0) {
+                        cur->iov_base  = (uint8_t *)cur->iov_base + n;
+                        cur->iov_len  -= (size_t)n;
+                  }
+            }
+
+            while (cnt-- > 0) {
+                  struct write_node *next = batch->next;
+                  free(batch);
+                  batch = next;
+            }
+      }
+
+      atomic_fetch_add_explicit(&writer_stats.flushes, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&writer_stats.messages, nmsgs, memory_order_relaxed);
+      atomic_fetch_add_explicit(&writer_stats.bytes, nbytes, memory_order_relaxed);
+      update_max(&writer_stats.max_messages, nmsgs);
+      update_max(&writer_stats.max_bytes, nbytes);
+}
+#endif
+
+static void
+update_max(atomic_uint_least64_t *max, uint64_t const val)
+{
+      uint64_t cur = atomic_load_explicit(max, memory_order_relaxed);
+      while (val > cur && !atomic_compare_exchange_weak(max, &cur, val))
+            ;
+}
+
+/*======================================================================================*/
+
+void
+nvim_api_report_writer_stats(void)
+{
+      uint64_t const flushes  = atomic_load_explicit(&writer_stats.flushes, memory_order_relaxed);
+      uint64_t const messages = atomic_load_explicit(&writer_stats.messages, memory_order_relaxed);
+      uint64_t const bytes    = atomic_load_explicit(&writer_stats.bytes, memory_order_relaxed);
+
+      if (flushes == 0)
+            return;
+
+      warnd("Writer: %" PRIu64 " flushes, %" PRIu64 " messages, %" PRIu64 " bytes; "
+            "per flush avg %.2f messages / %.1f bytes, max %" PRIu64 " messages / %" PRIu64 " bytes",
+            flushes, messages, bytes,
+            (double)messages / (double)flushes, (double)bytes / (double)flushes,
+            (uint64_t)atomic_load_explicit(&writer_stats.max_messages, memory_order_relaxed),
+            (uint64_t)atomic_load_explicit(&writer_stats.max_bytes, memory_order_relaxed));
+}
@@ -1,24 +1,21 @@
 #include "Common.h"
 #include "highlight.h"
 #include "lang/clang/clang.h"
+#include "lang/lang.h"
 #include "lang/ctags_scan/scan.h"
+#include "util/thread_pool.h"
 
-extern int highlight_go(Buffer *bdata);
-
-struct cmd_call_info {
-      int      kind;
-      bstring *group;
-      bstring *prefix;
-      bstring *suffix;
-};
+extern int          highlight_go(Buffer *bdata);
+extern thread_pool *thl_worker_pool;
 
 static mpack_arg_array *update_commands(Buffer *bdata, struct taglist *tags);
 static void update_from_cache(Buffer *bdata);
 static void add_cmd_call(mpack_arg_array **calls, bstring *cmd);
 static void update_c_like(Buffer *bdata, int type);
 static void update_other(Buffer *bdata);
+static void scheduled_highlight_task(void *vdata);
 static int  handle_kind(bstring *cmd, unsigned i,   struct filetype const *ft,
-                        struct taglist const *tags, struct cmd_call_info const *info);
+                        struct taglist const *tags, struct cmd_info const *info);
 
 #if defined DEBUG && defined DEBUG_LOGS
 extern FILE                 *cmd_log;
@@ -73,6 +70,110 @@ void
       }
 }
 
+/*======================================================================================*/
+/*
+ * Coalescing scheduler for highlight updates triggered by line events. At most one
+ * scheduled parse runs per buffer. Line events that arrive while it is running only
+ * mark the buffer dirty at their changedtick; once the parse finishes exactly one
+ * follow-up parse is run for the newest tick, after waiting for the buffer to stay
+ * quiet for `settings.debounce_ms'.
+ */
+
+void
+schedule_highlight(Buffer *bdata)
+{
+      if (!bdata || !atomic_load(&bdata->initialized))
+            return;
+
+      uint32_t const tick = p99_futex_load(&bdata->ctick);
+      bool           run  = false;
+
+      pthread_mutex_lock(&bdata->lock.sched_mtx);
+      if (bdata->sched.running) {
+            bdata->sched.dirty      = true;
+            bdata->sched.dirty_tick = tick;
+      } else {
+            bdata->sched.running = run = true;
+            bdata->sched.dirty   = false;
+            /* Keeps destroy_buffer() waiting until the scheduler lets go. */
+            p99_count_inc(&bdata->lock.num_workers);
+      }
+      pthread_mutex_unlock(&bdata->lock.sched_mtx);
+
+      if (run)
+            thread_pool_submit(thl_worker_pool, scheduled_highlight_task, bdata);
+}
+
+/*
+ * Take back a scheduled parse that no worker has started yet, so that destroy_buffer()
+ * doesn't have to wait for a worker to come free just to run a parse it will discard.
+ */
+void
+unschedule_highlight(Buffer *bdata)
+{
+      if (thread_pool_cancel(thl_worker_pool, scheduled_highlight_task, bdata) == 0)
+            return;
+
+      pthread_mutex_lock(&bdata->lock.sched_mtx);
+      bdata->sched.running = false;
+      bdata->sched.dirty   = false;
+      pthread_mutex_unlock(&bdata->lock.sched_mtx);
+      p99_count_dec(&bdata->lock.num_workers);
+}
+
+static void
+debounce_wait(Buffer *bdata)
+{
+      uint32_t const ms = settings.debounce_ms;
+      uint32_t       tick;
+
+      if (ms == 0)
+            return;
+
+      /* Keep waiting for as long as the user keeps typing. */
+      do {
+            tick = p99_futex_load(&bdata->ctick);
+            clock_nanosleep_for(ms / 1000U, (ms % 1000U) * UINTMAX_C(1000000));
+      } while (tick != p99_futex_load(&bdata->ctick) && atomic_load(&bdata->initialized));
+}
+
+static void
+scheduled_highlight_task(void *vdata)
+{
+      Buffer *bdata = vdata;
+
+      for (;;) {
+            /* Not `ctick', which is published before the edit it belongs to is applied
+             * to `lines'. The parse sees at least the lines as of `lines_tick', so a
+             * follow-up is only skipped if no newer edit has come in. */
+            uint32_t const tick = atomic_load(&bdata->lines_tick);
+            update_highlight(bdata, HIGHLIGHT_NORMAL);
+            atomic_store_explicit(&bdata->last_ctick, tick, memory_order_release);
+
+            pthread_mutex_lock(&bdata->lock.sched_mtx);
+            if (!bdata->sched.dirty || bdata->sched.dirty_tick == tick ||
+                !atomic_load(&bdata->initialized))
+            {
+                  bdata->sched.running = false;
+                  bdata->sched.dirty   = false;
+                  pthread_mutex_unlock(&bdata->lock.sched_mtx);
+                  break;
+            }
+            pthread_mutex_unlock(&bdata->lock.sched_mtx);
+
+            debounce_wait(bdata);
+
+            /* Anything that arrived during the wait is covered by the next parse. */
+            pthread_mutex_lock(&bdata->lock.sched_mtx);
+            bdata->sched.dirty = false;
+            pthread_mutex_unlock(&bdata->lock.sched_mtx);
+      }
+
+      p99_count_dec(&bdata->lock.num_workers);
+}
+
+/*======================================================================================*/
+
 static void
 update_c_like(Buffer *bdata, int const type)
 {
@@ -146,27 +247,9 @@ retry:
 static mpack_arg_array *
 update_commands(Buffer *bdata, struct taglist *tags)
 {
-      unsigned const        ngroups = bdata->ft->order->slen;
-      struct cmd_call_info *info    = talloc_array(CTX, struct cmd_call_info, ngroups);
-
-      for (unsigned i = 0; i < ngroups; ++i) {
-            int const   ch = bdata->ft->order->data[i];
-            mpack_dict *dict =
-                nvimext_get_var_fmt(E_MPACK_DICT, PKG "%s#%c", BTS(bdata->ft->vim_name), ch)
-                    .ptr;
-
-            info[i].kind   = ch;
-            info[i].group  = mpack_dict_get_key(dict, E_STRING, B("group")).ptr;
-            info[i].prefix = mpack_dict_get_key(dict, E_STRING, B("prefix")).ptr;
-            info[i].suffix = mpack_dict_get_key(dict, E_STRING, B("suffix")).ptr;
-
-            talloc_steal(info, info[i].group);
-            if (info[i].prefix)
-                  talloc_steal(info, info[i].prefix);
-            if (info[i].suffix)
-                  talloc_steal(info, info[i].suffix);
-            talloc_free(dict);
-      }
+      /* The group settings are cached in the filetype by init_filetype(). */
+      unsigned const         ngroups = bdata->ft->order->slen;
+      struct cmd_info const *info    = bdata->ft->cmd_info;
 
       mpack_arg_array *calls = NULL;
       add_cmd_call(&calls, b_fromlit("ownsyntax"));
@@ -191,7 +274,6 @@ update_commands(Buffer *bdata, struct taglist *tags)
       fflush(cmd_log);
 #endif
 
-      talloc_free(info);
       return calls;
 }
 
@@ -200,29 +282,12 @@ handle_kind(bstring                    *cmd,
             unsigned                    i,
             struct filetype const      *ft,
             struct taglist const       *tags,
-            struct cmd_call_info const *info)
+            struct cmd_info const      *info)
 {
-      bstring *group_id = b_sprintf("_tag_highlight_%s_%c_%s", &ft->vim_name, info->kind, info->group);
+      bstring const *global_allbut = ft->allbut;
+      bstring       *group_id      = b_sprintf("_tag_highlight_%s_%c_%s", &ft->vim_name, info->kind, info->group);
       b_sprintfa(cmd, "silent! syntax clear %s | ", group_id);
 
-      bstring *global_allbut = nvim_get_var(B("tag_highlight#allbut"), E_STRING).ptr;
-      bstring *ft_allbut =
-          nvimext_get_var_fmt(E_STRING, "tag_highlight#%s#allbut", BTS(ft->vim_name)).ptr;
-
-#ifdef DEBUG
-      talloc_steal(CTX, global_allbut);
-      talloc_steal(CTX, global_allbut);
-#endif
-
-      if (ft_allbut) {
-            if (global_allbut) {
-                  b_append_all(global_allbut, B(","), ft_allbut);
-                  b_free(ft_allbut);
-            } else {
-                  global_allbut = ft_allbut;
-            }
-      }
-
       if (info->prefix || info->suffix) {
             bstring const *const prefix = (info->prefix) ? info->prefix : B("\\C\\<");
             bstring const *const suffix = (info->suffix) ? info->suffix : B("\\>");
@@ -245,7 +310,6 @@ handle_kind(bstring                    *cmd,
       }
 
 
-      b_free(global_allbut);
       b_free(group_id);
       return ((i > 0) ? (int)i : 0);
 }
@@ -268,28 +332,24 @@ void
       if (bdata->ft->order && !(bdata->ft->has_parser)) {
             bstring *cmd = b_alloc_null(8192);
 
-            for (unsigned i = 0; i < bdata->ft->order->slen; ++i) {
-                  int const   ch   = bdata->ft->order->data[i];
-                  mpack_dict *dict = nvimext_get_var_fmt(E_MPACK_DICT, PKG "%s#%c",
-                                                         BTS(bdata->ft->vim_name), ch).ptr;
-                  bstring *group = mpack_dict_get_key(dict, E_STRING, B("group")).ptr;
+            struct cmd_info const *info = bdata->ft->cmd_info;
 
+            for (unsigned i = 0; i < bdata->ft->order->slen; ++i) {
                   b_sprintfa(cmd, "silent! syntax clear _tag_highlight_%s_%c_%s",
-                             &bdata->ft->vim_name, ch, group);
+                             &bdata->ft->vim_name, info[i].kind, info[i].group);
 
                   if (i < (bdata->ft->order->slen - 1))
                         b_catlit(cmd, " | ");
-
-                  b_free(group);
-                  talloc_free(dict);
             }
 
             nvim_command(cmd);
             b_free(cmd);
       }
 
-      if (bdata->hl_id > 0)
+      if (bdata->hl_id > 0) {
             nvim_buf_clear_namespace(bdata->num, bdata->hl_id, 0, (-1), blocking);
+            hl_applied_forget(bdata);
+      }
 
       pthread_mutex_unlock(&bdata->lock.total);
 }
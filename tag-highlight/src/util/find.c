@@ -6,139 +6,505 @@
 //#  include <direct.h>
 #  define B_FILE_EQ(FILE1_, FILE2_) (b_iseq_caseless((FILE1_), (FILE2_)))
 #  define SEPSTR "\\"
+#  define FIND_EXTERNAL
 #else
 #  define B_FILE_EQ(FILE1_, FILE2_) (b_iseq((FILE1_), (FILE2_)))
 #  define SEPSTR "/"
-#  include <sys/wait.h>
+#  include <dirent.h>
+#  include <fnmatch.h>
+#  include <regex.h>
 #endif
 
-#define CNULL ((char *)0)
+/*
+ * Files are found without leaving the process. The first search under a directory
+ * walks the whole tree with a few threads and keeps every directory's listing. Later
+ * searches under the same directory only stat each directory again, and re-read the
+ * ones whose modification time changed. Directories modified within a second of being
+ * read may have changed again in that same second, so they are always re-read. A tree
+ * is checked at most once every FIND_RECHECK_SECS seconds, and the results of the last
+ * few searches are kept until something in the tree changes, so a repeated search
+ * costs a string comparison.
+ *
+ * Patterns are POSIX extended regular expressions matched anywhere in the full path,
+ * or with FIND_GLOB, shell globs matched against the file's name. As with `fd -u',
+ * hidden and ignored files are included and symbolic links are not followed.
+ */
 
-static bstring *run_find(const char *path, const char *search);
-/* static void unquote(bstring *orig); */
+#define FIND_MAX_THREADS  8
+#define FIND_MAX_ROOTS    8
+#define FIND_MEMO_SIZE    8
+#define FIND_RECHECK_SECS 2
+
+#define PUSH(CTX_, ARR_, N_, MAX_, VAL_)                                                      \
+        do {                                                                                  \
+                if ((N_) >= (MAX_)) {                                                         \
+                        (MAX_) = (MAX_) ? (MAX_) * 2 : 16;                                    \
+                        (ARR_) = talloc_realloc((CTX_), (ARR_), __typeof__(*(ARR_)), (MAX_)); \
+                }                                                                             \
+                (ARR_)[(N_)++] = (VAL_);                                                      \
+        } while (0)
+
+struct find_dir {
+        char    *path;
+        char   **files;    /* Names of everything but subdirectories, sorted. */
+        char   **subdirs;  /* Full paths. */
+        unsigned nfiles;
+        unsigned nsubdirs;
+        time_t   mtime;
+        bool     racy;
+        bool     reused;
+};
+
+struct find_memo {
+        char    *pattern;
+        char   **matches;
+        unsigned nmatches;
+        bool     glob;
+};
+
+struct find_index {
+        char               *root;
+        struct find_dir   **dirs;  /* Sorted by path. */
+        unsigned            ndirs;
+        unsigned            users;
+        unsigned            memo_next;
+        time_t              checked;
+        pthread_mutex_t     mtx;
+        struct find_memo   *memo[FIND_MEMO_SIZE];
+        struct find_index  *next;
+};
+
+struct walk {
+        pthread_mutex_t    mtx;
+        pthread_cond_t     cond;
+        struct find_index *idx;
+        char const       **queue;
+        struct find_dir  **dirs;
+        unsigned           nqueue, qmax;
+        unsigned           ndirs, dmax;
+        unsigned           active;
+        time_t             started;
+};
+
+static b_list *lookup(char const *path, char const *search, bool glob, bool first);
 
 /*======================================================================================*/
 
 void *
 find_file(const char *path, const char *search, const enum find_flags flags)
 {
-        bstring *result = run_find(path, search);
-        if (!result)
+        enum find_flags const mode    = flags & FIND_MODE_MASK;
+        b_list               *matches = lookup(path, search, (flags & FIND_GLOB) != 0,
+                                               mode == FIND_FIRST);
+        void   *ret;
+
+        if (!matches)
                 return NULL;
 
-        switch (flags) {
+        switch (mode) {
         case FIND_SHORTEST: {
-                b_list  *split    = b_split_char(result, '\n', true);
-                bstring *shortest = split->lst[0];
-
-                B_LIST_FOREACH (split, str, i)
+                bstring *shortest = matches->lst[0];
+                B_LIST_FOREACH (matches, str, i)
                         if (str->slen < shortest->slen)
                                 shortest = str;
-
-                b_writeprotect(shortest);
-                b_list_destroy(split);
-                b_writeallow(shortest);
-                b_chomp(shortest);
-
-                return shortest;
-        }
-        case FIND_FIRST: {
-                bstring *first;
-                unsigned pos = b_strchr(result, '\n');
-                if (pos > 0) {
-                        first = b_fromblk(result->data, pos);
-                        b_destroy(result);
-                } else
-                        first = result;
-
-                return first;
+                ret = b_strcpy(shortest);
+                break;
         }
+        case FIND_FIRST:
+                ret = b_strcpy(matches->lst[0]);
+                break;
         case FIND_SPLIT: // b_list *
-                return b_split_char(result, '\n', true);
+                return matches;
         default:
         case FIND_LITERAL:
-                return result;
+                ret = b_join(matches, B("\n"));
+                break;
         }
+
+        b_list_destroy(matches);
+        return ret;
 }
 
 /*======================================================================================*/
+#ifdef FIND_EXTERNAL
 
-static bstring *
-run_find(const char *path, const char *search)
+static b_list *
+lookup(const char *path, const char *search, UNUSED bool glob, UNUSED bool first)
 {
-        int status = 0;
-#ifdef HAVE_FORK
-        int pipefds[2] = {0, 0};
-#  ifdef HAVE_PIPE2
-        if (pipe2(pipefds, O_NONBLOCK|O_CLOEXEC) == (-1))
-                err(1, "Pipe failed");
-#  elif !defined(DOSISH)
-        if (pipe(pipefds) == (-1))
-                err(1, "Pipe failed");
-#  endif
-        const int flgs[2] = {fcntl(pipefds[0], F_GETFD), fcntl(pipefds[1], F_GETFD)};
-        fcntl(pipefds[0], F_SETFD, flgs[0]|O_NONBLOCK|O_CLOEXEC);
-        fcntl(pipefds[1], F_SETFD, flgs[1]|O_NONBLOCK|O_CLOEXEC);
+        int  status = 0;
+        char buf[8192], tmpbuf[SAFE_PATH_MAX];
+        strcpy_s(tmpbuf, SAFE_PATH_MAX, ".find_tmp_XXXXXX");
+        tmpnam_s(tmpbuf, SAFE_PATH_MAX);
+        snprintf(buf, 8192, "find \"%s\" -regex \"%s\" > \"%s\"", path, search, tmpbuf);
+        status = system(buf);
+        if ((status >>= 8) != 0)
+                errx(status, "Command failed with status %d", status);
+        bstring *result = b_quickread("%s", tmpbuf);
+        unlink(tmpbuf);
+
+        if (!result)
+                return NULL;
+        b_list *ret = (result->slen > 0) ? b_split_char(result, '\n', true) : NULL;
+        b_free(result);
+        if (ret && ret->qty == 0) {
+                b_list_destroy(ret);
+                ret = NULL;
+        }
+        return ret;
+}
 
+#else /* FIND_EXTERNAL */
 
-        const int pid = fork();
+static pthread_mutex_t    roots_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct find_index *roots;
 
-        if (pid == 0) {
-                if (dup2(pipefds[1], 1) == (-1))
-                        err(1, "dup2() failed");
+static struct find_index *acquire_index(char const *path);
+static void               release_index(struct find_index *idx);
+static void               refresh_index(struct find_index *idx);
+static struct find_memo  *match_index(struct find_index *idx, char const *search, bool glob);
+static void              *walk_thread(void *arg);
+static struct find_dir   *scan_dir(struct walk *walk, char const *path);
+static struct find_dir   *lookup_dir(struct find_index const *idx, char const *path);
 
-                char **tmp = (char *[]){"fd", "-au", (char *)search, (char *)path,  CNULL};
-                execvp("fd", tmp);
+static b_list *
+lookup(char const *path, char const *search, bool const glob, bool const first)
+{
+        struct find_index *idx  = acquire_index(path);
+        struct find_memo  *memo = NULL;
+        b_list            *ret  = NULL;
+
+        pthread_mutex_lock(&idx->mtx);
+        refresh_index(idx);
 
-                tmp = (char *[]){"find", (char *)path, "-regex", (char *)search, CNULL};
-                if (execvp("find", tmp) == (-1))
-                        err(1, "exec failed");
+        for (unsigned i = 0; i < FIND_MEMO_SIZE; ++i) {
+                if (idx->memo[i] && idx->memo[i]->glob == glob &&
+                    strcmp(idx->memo[i]->pattern, search) == 0)
+                {
+                        memo = idx->memo[i];
+                        break;
+                }
         }
+        if (!memo)
+                memo = match_index(idx, search, glob);
 
-        close(pipefds[1]);
-        waitpid(pid, &status, 0);
+        if (memo && memo->nmatches > 0) {
+                unsigned const n = first ? 1 : memo->nmatches;
+                ret = b_list_create_alloc(n);
+                for (unsigned i = 0; i < n; ++i)
+                        b_list_append(ret, b_fromcstr(memo->matches[i]));
+        }
 
-        if ((status >>= 8) != 0)
-                errx(status, "Command failed with status %d", status);
+        pthread_mutex_unlock(&idx->mtx);
+        release_index(idx);
+        return ret;
+}
 
-        bstring *ret = b_read_fd(pipefds[0]);
-        close(pipefds[0]);
+/*--------------------------------------------------------------------------------------*/
 
-        if (ret->slen == 0)
-                b_destroy(ret);
-#else
-        char buf[8192], tmpbuf[SAFE_PATH_MAX];
-        strcpy_s(tmpbuf, SAFE_PATH_MAX, ".find_tmp_XXXXXX");
-        tmpnam_s(tmpbuf, SAFE_PATH_MAX);
-        snprintf(buf, 8192, "find \"%s\" -regex \"%s\" > \"%s\"", path, search, tmpbuf);
-        status = system(buf);
-        if ((status >>= 8) != 0)
-                errx(status, "Command failed with status %d", status);
-        bstring *ret = b_quickread("%s", tmpbuf);
-        unlink(tmpbuf);
-#endif
+static int
+cmp_str(void const *a, void const *b)
+{
+        return strcmp(*(char const *const *)a, *(char const *const *)b);
+}
 
-        return ret;
+static int
+cmp_dir(void const *a, void const *b)
+{
+        return strcmp((*(struct find_dir const *const *)a)->path,
+                      (*(struct find_dir const *const *)b)->path);
+}
+
+static char const *
+sep_after(char const *path)
+{
+        size_t const len = strlen(path);
+        return (len > 0 && path[len - 1] == SEPSTR[0]) ? "" : SEPSTR;
+}
+
+/*
+ * Find or make the index for `path', keeping the most recently used first. Indexes
+ * past the limit are dropped from the end unless a search is still using them.
+ */
+static struct find_index *
+acquire_index(char const *path)
+{
+        char   root[SAFE_PATH_MAX + 1];
+        size_t len = strlen(path);
+
+        if (len > SAFE_PATH_MAX)
+                len = SAFE_PATH_MAX;
+        memcpy(root, path, len);
+        while (len > 1 && root[len - 1] == SEPSTR[0])
+                --len;
+        root[len] = '\0';
+
+        pthread_mutex_lock(&roots_mtx);
+        struct find_index *idx, **prev = &roots;
+        unsigned           n           = 0;
+
+        for (idx = roots; idx; prev = &idx->next, idx = idx->next)
+                if (strcmp(idx->root, root) == 0)
+                        break;
+
+        if (idx) {
+                *prev = idx->next;
+        } else {
+                idx       = talloc_zero(NULL, struct find_index);
+                idx->root = talloc_strdup(idx, root);
+                pthread_mutex_init(&idx->mtx, NULL);
+        }
+        idx->next = roots;
+        roots     = idx;
+        ++idx->users;
+
+        for (prev = &roots; *prev; ) {
+                struct find_index *cur = *prev;
+                if (++n > FIND_MAX_ROOTS && cur->users == 0) {
+                        *prev = cur->next;
+                        pthread_mutex_destroy(&cur->mtx);
+                        for (unsigned i = 0; i < cur->ndirs; ++i)
+                                talloc_free(cur->dirs[i]);
+                        talloc_free(cur);
+                } else {
+                        prev = &cur->next;
+                }
+        }
+
+        pthread_mutex_unlock(&roots_mtx);
+        return idx;
 }
 
-#if 0
 static void
-unquote(bstring *str)
+release_index(struct find_index *idx)
 {
-        /* bstring *ret = b_alloc_null(str->slen + 1); */
-        uint8_t  buf[str->slen + 1];
-        unsigned x = 0;
+        pthread_mutex_lock(&roots_mtx);
+        --idx->users;
+        pthread_mutex_unlock(&roots_mtx);
+}
+
+/*
+ * Walk the tree again unless it was checked very recently. Every unchanged directory's
+ * listing carries over from the last walk. Its mutex must be held.
+ */
+static void
+refresh_index(struct find_index *idx)
+{
+        struct timer tm;
+        struct walk  walk;
+        pthread_t    tids[FIND_MAX_THREADS];
+        unsigned     nthreads = MINOF(find_num_cpus(), (unsigned)FIND_MAX_THREADS);
+        unsigned     reused   = 0;
+
+        TIMER_START(&tm);
+        if (idx->dirs && tm.tv1.tv_sec - idx->checked < FIND_RECHECK_SECS)
+                return;
+
+        memset(&walk, 0, sizeof walk);
+        pthread_mutex_init(&walk.mtx, NULL);
+        pthread_cond_init(&walk.cond, NULL);
+        walk.idx     = idx;
+        walk.started = tm.tv1.tv_sec;
+        walk.queue   = talloc_array(NULL, char const *, 16);
+        walk.qmax    = 16;
+        walk.queue[walk.nqueue++] = idx->root;
+
+        /* The calling thread does its share of the work too. */
+        for (unsigned i = 1; i < nthreads; ++i)
+                if (pthread_create(&tids[i], NULL, walk_thread, &walk) != 0)
+                        nthreads = i;
+        walk_thread(&walk);
+        for (unsigned i = 1; i < nthreads; ++i)
+                pthread_join(tids[i], NULL);
+
+        /* Whatever wasn't carried over is gone or was read again. */
+        for (unsigned i = 0; i < idx->ndirs; ++i)
+                if (!idx->dirs[i]->reused)
+                        talloc_free(idx->dirs[i]);
+        for (unsigned i = 0; i < walk.ndirs; ++i) {
+                if (walk.dirs[i]->reused)
+                        ++reused;
+                walk.dirs[i]->reused = false;
+        }
+        if (walk.ndirs > 1)
+                qsort(walk.dirs, walk.ndirs, sizeof walk.dirs[0], cmp_dir);
+
+        /* Earlier results stay good as long as every directory is the same as before. */
+        if (reused != walk.ndirs || reused != idx->ndirs) {
+                for (unsigned i = 0; i < FIND_MEMO_SIZE; ++i)
+                        TALLOC_FREE(idx->memo[i]);
+        }
+
+        talloc_free(idx->dirs);
+        idx->dirs    = walk.dirs ? talloc_steal(idx, walk.dirs) : talloc_array(idx, struct find_dir *, 0);
+        idx->ndirs   = walk.ndirs;
+        idx->checked = walk.started;
 
-        for (unsigned i = 0; i < str->slen; ++i) {
-                const uint8_t ch = str->data[str->slen];
-                if (ch != '"' && ch != '\'')
-                        buf[x++] = ch;
+        talloc_free(walk.queue);
+        pthread_cond_destroy(&walk.cond);
+        pthread_mutex_destroy(&walk.mtx);
+
+        if (reused != walk.ndirs) {
+                struct timespec diff;
+                (void)timespec_get(&tm.tv2, TIME_UTC);
+                TIMESPEC_SUB(&tm.tv2, &tm.tv1, &diff);
+                warnd("Indexed %u directories under \"%s\" in %.2fms (%u unchanged, %u threads)",
+                      walk.ndirs, idx->root, TIMESPEC2DOUBLE(&diff) * 1000.0, reused, nthreads);
         }
+}
+
+static void *
+walk_thread(void *arg)
+{
+        struct walk *walk = arg;
+
+        pthread_mutex_lock(&walk->mtx);
+        for (;;) {
+                while (walk->nqueue == 0 && walk->active > 0)
+                        pthread_cond_wait(&walk->cond, &walk->mtx);
+                if (walk->nqueue == 0)
+                        break;
+
+                char const *path = walk->queue[--walk->nqueue];
+                ++walk->active;
+                pthread_mutex_unlock(&walk->mtx);
 
-        if (x != str->slen) {
-                memcpy(str->data, buf, x);
-                str->data[x] = '\0';
-                str->slen    = x;
+                struct find_dir *dir = scan_dir(walk, path);
+
+                pthread_mutex_lock(&walk->mtx);
+                if (dir) {
+                        PUSH(NULL, walk->dirs, walk->ndirs, walk->dmax, dir);
+                        for (unsigned i = 0; i < dir->nsubdirs; ++i)
+                                PUSH(NULL, walk->queue, walk->nqueue, walk->qmax, dir->subdirs[i]);
+                }
+                if (--walk->active == 0 || (dir && dir->nsubdirs > 0))
+                        pthread_cond_broadcast(&walk->cond);
         }
+        pthread_mutex_unlock(&walk->mtx);
+
+        return NULL;
 }
+
+/*
+ * Returns the last listing of `path' if the directory hasn't changed since, or else
+ * a new one. The previous walk's directories are only read here, never modified,
+ * except to mark them as carried over.
+ */
+static struct find_dir *
+scan_dir(struct walk *walk, char const *path)
+{
+        struct stat    st;
+        struct dirent *ent;
+        unsigned       fmax = 0, smax = 0;
+
+        if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+                return NULL;
+
+        struct find_dir *old = lookup_dir(walk->idx, path);
+        if (old && !old->racy && old->mtime == st.st_mtime) {
+                old->reused = true;
+                return old;
+        }
+
+        DIR *dp = opendir(path);
+        if (!dp)
+                return NULL;
+
+        struct find_dir *dir = talloc_zero(NULL, struct find_dir);
+        char const      *sep = sep_after(path);
+        dir->path  = talloc_strdup(dir, path);
+        dir->mtime = st.st_mtime;
+        dir->racy  = st.st_mtime >= walk->started - 1;
+
+        while ((ent = readdir(dp))) {
+                char const *name = ent->d_name;
+                bool        isdir;
+
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                        continue;
+#ifdef _DIRENT_HAVE_D_TYPE
+                if (ent->d_type != DT_UNKNOWN) {
+                        isdir = ent->d_type == DT_DIR;
+                } else
 #endif
+                {
+                        char        buf[SAFE_PATH_MAX + 1];
+                        struct stat est;
+                        snprintf(buf, sizeof buf, "%s%s%s", path, sep, name);
+                        isdir = lstat(buf, &est) == 0 && S_ISDIR(est.st_mode);
+                }
+
+                if (isdir)
+                        PUSH(dir, dir->subdirs, dir->nsubdirs, smax,
+                             talloc_asprintf(dir, "%s%s%s", path, sep, name));
+                else
+                        PUSH(dir, dir->files, dir->nfiles, fmax, talloc_strdup(dir, name));
+        }
+        closedir(dp);
+
+        if (dir->nfiles > 1)
+                qsort(dir->files, dir->nfiles, sizeof dir->files[0], cmp_str);
+        return dir;
+}
+
+static struct find_dir *
+lookup_dir(struct find_index const *idx, char const *path)
+{
+        unsigned lo = 0, hi = idx->ndirs;
+
+        while (lo < hi) {
+                unsigned const mid = lo + (hi - lo) / 2;
+                int const      cmp = strcmp(path, idx->dirs[mid]->path);
+                if (cmp == 0)
+                        return idx->dirs[mid];
+                if (cmp < 0)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+
+        return NULL;
+}
+
+/*
+ * Run a search over the whole index and remember the result. Matches come out one
+ * directory at a time in order of path, so the files directly under the root are
+ * first.
+ */
+static struct find_memo *
+match_index(struct find_index *idx, char const *search, bool const glob)
+{
+        regex_t  re;
+        char     buf[SAFE_PATH_MAX + 1];
+        unsigned mmax = 0;
+
+        if (!glob && regcomp(&re, search, REG_EXTENDED | REG_NOSUB) != 0) {
+                warnd("Invalid regular expression \"%s\"", search);
+                return NULL;
+        }
+
+        struct find_memo *memo = talloc_zero(idx, struct find_memo);
+        memo->pattern = talloc_strdup(memo, search);
+        memo->glob    = glob;
+
+        for (unsigned i = 0; i < idx->ndirs; ++i) {
+                struct find_dir const *dir = idx->dirs[i];
+                char const            *sep = sep_after(dir->path);
+
+                for (unsigned x = 0; x < dir->nfiles; ++x) {
+                        snprintf(buf, sizeof buf, "%s%s%s", dir->path, sep, dir->files[x]);
+                        bool const match = glob ? fnmatch(search, dir->files[x], 0) == 0
+                                                : regexec(&re, buf, 0, NULL, 0) == 0;
+                        if (match)
+                                PUSH(memo, memo->matches, memo->nmatches, mmax, talloc_strdup(memo, buf));
+                }
+        }
+        if (!glob)
+                regfree(&re);
+
+        unsigned const slot = idx->memo_next++ % FIND_MEMO_SIZE;
+        talloc_free(idx->memo[slot]);
+        idx->memo[slot] = memo;
+        return memo;
+}
+
+#endif /* FIND_EXTERNAL */
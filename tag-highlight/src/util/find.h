@@ -9,11 +9,18 @@
 extern "C" {
 #endif
 
+/*
+ * One of the first four says what to return. Add FIND_GLOB to match the file name
+ * against a shell glob instead of the full path against a regular expression.
+ */
 enum find_flags {
         FIND_LITERAL,
         FIND_SPLIT,
         FIND_SHORTEST,
         FIND_FIRST,
+
+        FIND_MODE_MASK = 0x0F,
+        FIND_GLOB      = 0x10,
 };
 
 extern void    * find_file(const char *path, const char *search, const enum find_flags flags);
@@ -0,0 +1,603 @@
+#include "Common.h"
+#include "util/line_store.h"
+
+/*
+ * Every node keeps the number of lines and bytes stored beneath it, so finding line
+ * `n' is a matter of walking down the tree subtracting the counts of the children
+ * skipped over. Leaves are chained left to right for iteration. Nodes other than the
+ * root never hold fewer than LS_MIN entries; a node that fills up is split in two.
+ */
+#define LS_ORDER (64U)
+#define LS_MIN   (LS_ORDER / 2U)
+
+/* Extra room given to the text whenever it has to grow or be copied. */
+#define LS_TEXT_SLACK (4096U)
+
+struct ls_node {
+      ls_node *next; /* Next leaf, for leaves only. */
+      unsigned n;
+      unsigned count;
+      size_t   bytes; /* Length of every line below, plus one newline each. */
+      bool     leaf;
+      union {
+            ls_node *child[LS_ORDER];
+            bstring *line[LS_ORDER];
+      };
+};
+
+/*
+ * The joined text, with the gap at [gap, gap + gap_len). Referenced by the store and
+ * by every outstanding snapshot; it is only ever written while the store is the sole
+ * owner.
+ */
+struct ls_textbuf {
+      atomic_uint refs;
+      size_t      cap;
+      size_t      gap;
+      size_t      gap_len;
+      uchar       data[];
+};
+
+struct ls_snapshot {
+      bstring     str; /* Must be first, callers only ever see this. */
+      ls_textbuf *tb;
+};
+
+static ls_node *new_node(line_store *ls, bool leaf);
+static ls_node *find_leaf(ls_node const *node, unsigned *index);
+static size_t   line_offset(line_store const *ls, unsigned index);
+static ls_node *node_insert(line_store *ls, ls_node *node, unsigned index, bstring *line);
+static ls_node *node_split(line_store *ls, ls_node *node);
+static size_t   node_replace(ls_node *node, unsigned index, bstring *line);
+static size_t   node_delete(line_store *ls, ls_node *node, unsigned index);
+static void     node_rebalance(ls_node *parent, unsigned i);
+static void     store_insert(line_store *ls, unsigned index, bstring *line);
+static void     store_delete(line_store *ls, unsigned index);
+
+static ls_textbuf *text_new(size_t cap);
+static void        text_release(ls_textbuf *tb);
+static void        text_replace(line_store *ls, size_t off, size_t oldlen, b_list const *repl);
+static void        text_move_gap(ls_textbuf *tb, size_t pos);
+static ls_textbuf *text_regap(ls_textbuf *tb, size_t need);
+
+static inline unsigned
+entry_count(ls_node const *node, unsigned const i)
+{
+      return node->leaf ? 1U : node->child[i]->count;
+}
+
+static inline size_t
+entry_bytes(ls_node const *node, unsigned const i)
+{
+      return node->leaf ? node->line[i]->slen + 1U : node->child[i]->bytes;
+}
+
+static int
+ls_destructor(line_store *ls)
+{
+      text_release(ls->text);
+      pthread_mutex_destroy(&ls->lock);
+      return 0;
+}
+
+static int
+snapshot_destructor(struct ls_snapshot *snap)
+{
+      text_release(snap->tb);
+      return 0;
+}
+
+/*======================================================================================*/
+
+line_store *
+ls_create(void *talloc_ctx)
+{
+      line_store *ls = talloc(talloc_ctx, line_store);
+      ls->root       = new_node(ls, true);
+      ls->text       = text_new(LS_TEXT_SLACK);
+      ls->qty        = 0;
+      pthread_mutex_init(&ls->lock);
+      talloc_set_destructor(ls, ls_destructor);
+      return ls;
+}
+
+bstring *
+ls_get(line_store *ls, unsigned index)
+{
+      if (index >= ls->qty)
+            return NULL;
+      ls_node *leaf = find_leaf(ls->root, &index);
+      return leaf->line[index];
+}
+
+/*
+ * Replace the lines [first, last) with every string in `repl', which may be NULL or
+ * empty to delete the range outright. The strings are moved into the store. Lines
+ * replaced one for one are swapped in place without touching the tree's shape.
+ */
+void
+ls_splice(line_store *ls, unsigned first, unsigned last, b_list *repl)
+{
+      pthread_mutex_lock(&ls->lock);
+
+      if (last > ls->qty)
+            last = ls->qty;
+      if (first > last)
+            first = last;
+
+      unsigned const ndel  = last - first;
+      unsigned const nrepl = repl ? repl->qty : 0;
+      unsigned const nswap = MINOF(ndel, nrepl);
+      unsigned       i;
+
+      size_t const off = line_offset(ls, first);
+      text_replace(ls, off, line_offset(ls, last) - off, repl);
+
+      for (i = 0; i < nswap; ++i)
+            node_replace(ls->root, first + i, talloc_move(ls, &repl->lst[i]));
+      for (unsigned x = nswap; x < ndel; ++x)
+            store_delete(ls, first + nswap);
+      for (; i < nrepl; ++i)
+            store_insert(ls, first + i, talloc_move(ls, &repl->lst[i]));
+
+      pthread_mutex_unlock(&ls->lock);
+}
+
+void
+ls_append(line_store *ls, bstring *line)
+{
+      b_list tmp = {.lst = &line, .qty = 1};
+
+      pthread_mutex_lock(&ls->lock);
+      text_replace(ls, ls->root->bytes, 0, &tmp);
+      store_insert(ls, ls->qty, talloc_move(ls, &line));
+      pthread_mutex_unlock(&ls->lock);
+}
+
+/*
+ * Returns the text of the whole buffer, allocated on `talloc_ctx'. Unless the buffer
+ * changed since the last call this costs nothing but the small header. The string
+ * is read only and must not be passed to b_free(); free it with talloc_free().
+ */
+bstring *
+ls_text(line_store *ls, void *talloc_ctx)
+{
+      pthread_mutex_lock(&ls->lock);
+
+      ls_textbuf  *tb  = ls->text;
+      size_t const len = tb->cap - tb->gap_len;
+
+      text_move_gap(tb, len);
+      tb->data[len] = '\0';
+      atomic_fetch_add_explicit(&tb->refs, 1, memory_order_relaxed);
+
+      struct ls_snapshot *snap = talloc(talloc_ctx, struct ls_snapshot);
+      snap->tb        = tb;
+      snap->str.data  = tb->data;
+      snap->str.slen  = (unsigned)len;
+      snap->str.mlen  = 0;
+      snap->str.flags = 0;
+      talloc_set_destructor(snap, snapshot_destructor);
+
+      pthread_mutex_unlock(&ls->lock);
+      return &snap->str;
+}
+
+/*
+ * Offset into the text returned by ls_text() at which `line' starts. Lines past the
+ * end map to the length of the text.
+ */
+size_t
+ls_line_offset(line_store *ls, unsigned const line)
+{
+      pthread_mutex_lock(&ls->lock);
+      size_t const ret = line_offset(ls, line);
+      pthread_mutex_unlock(&ls->lock);
+      return ret;
+}
+
+/*
+ * The line containing byte `offset' of the text, with the offset within that line
+ * stored in `column' if it isn't NULL. Offsets past the end map to ls->qty.
+ */
+unsigned
+ls_offset_line(line_store *ls, size_t offset, unsigned *column)
+{
+      pthread_mutex_lock(&ls->lock);
+      ls_node const *node = ls->root;
+      unsigned       line = 0;
+
+      if (offset >= node->bytes) {
+            line   = ls->qty;
+            offset = 0;
+            goto out;
+      }
+
+      while (!node->leaf) {
+            unsigned i = 0;
+            while (offset >= node->child[i]->bytes) {
+                  offset -= node->child[i]->bytes;
+                  line   += node->child[i]->count;
+                  ++i;
+            }
+            node = node->child[i];
+      }
+      for (unsigned i = 0; offset >= node->line[i]->slen + 1U; ++i) {
+            offset -= node->line[i]->slen + 1U;
+            ++line;
+      }
+
+out:
+      pthread_mutex_unlock(&ls->lock);
+      if (column)
+            *column = (unsigned)offset;
+      return line;
+}
+
+/*--------------------------------------------------------------------------------------*/
+
+bstring *
+ls_iter_init(line_store const *ls, ls_iter *it, unsigned index)
+{
+      if (index >= ls->qty) {
+            it->leaf = NULL;
+            it->pos  = 0;
+            return NULL;
+      }
+      it->leaf = find_leaf(ls->root, &index);
+      it->pos  = index;
+      return it->leaf->line[it->pos];
+}
+
+bstring *
+ls_iter_next(ls_iter *it)
+{
+      if (!it->leaf)
+            return NULL;
+      if (++it->pos >= it->leaf->n) {
+            it->leaf = it->leaf->next;
+            it->pos  = 0;
+            if (!it->leaf)
+                  return NULL;
+      }
+      return it->leaf->line[it->pos];
+}
+
+/*======================================================================================*/
+
+static ls_node *
+new_node(line_store *ls, bool const leaf)
+{
+      ls_node *node = talloc(ls, ls_node);
+      node->next    = NULL;
+      node->n       = 0;
+      node->count   = 0;
+      node->bytes   = 0;
+      node->leaf    = leaf;
+      return node;
+}
+
+/* Returns the leaf holding line `*index', which is updated to its offset within it. */
+static ls_node *
+find_leaf(ls_node const *node, unsigned *index)
+{
+      while (!node->leaf) {
+            unsigned i = 0;
+            while (*index >= node->child[i]->count) {
+                  *index -= node->child[i]->count;
+                  ++i;
+            }
+            node = node->child[i];
+      }
+      return (ls_node *)node;
+}
+
+/* Byte offset in the joined text at which line `index' starts. */
+static size_t
+line_offset(line_store const *ls, unsigned index)
+{
+      ls_node const *node = ls->root;
+      size_t         off  = 0;
+
+      if (index >= ls->qty)
+            return node->bytes;
+
+      while (!node->leaf) {
+            unsigned i = 0;
+            while (index >= node->child[i]->count) {
+                  index -= node->child[i]->count;
+                  off   += node->child[i]->bytes;
+                  ++i;
+            }
+            node = node->child[i];
+      }
+      for (unsigned i = 0; i < index; ++i)
+            off += node->line[i]->slen + 1U;
+
+      return off;
+}
+
+static void
+store_insert(line_store *ls, unsigned const index, bstring *line)
+{
+      ls_node *sib = node_insert(ls, ls->root, index, line);
+      if (sib) {
+            ls_node *root  = new_node(ls, false);
+            root->child[0] = ls->root;
+            root->child[1] = sib;
+            root->n        = 2;
+            root->count    = ls->root->count + sib->count;
+            root->bytes    = ls->root->bytes + sib->bytes;
+            ls->root       = root;
+      }
+      ++ls->qty;
+}
+
+static void
+store_delete(line_store *ls, unsigned const index)
+{
+      node_delete(ls, ls->root, index);
+      --ls->qty;
+
+      /* Shrink the tree once the root is left with a single child. */
+      if (!ls->root->leaf && ls->root->n == 1) {
+            ls_node *old = ls->root;
+            ls->root     = old->child[0];
+            talloc_free(old);
+      }
+}
+
+/*
+ * Inserts `line' so that it becomes line `index' below `node'. If the node fills up
+ * it is split and the new right hand sibling is returned for the caller to adopt.
+ */
+static ls_node *
+node_insert(line_store *ls, ls_node *node, unsigned index, bstring *line)
+{
+      ++node->count;
+      node->bytes += line->slen + 1U;
+
+      if (node->leaf) {
+            memmove(&node->line[index + 1], &node->line[index],
+                    (node->n - index) * sizeof(bstring *));
+            node->line[index] = line;
+            ++node->n;
+      } else {
+            /* Prefer appending to the end of a child over prepending to the next. */
+            unsigned i = 0;
+            while (i < node->n - 1 && index > node->child[i]->count) {
+                  index -= node->child[i]->count;
+                  ++i;
+            }
+            ls_node *sib = node_insert(ls, node->child[i], index, line);
+            if (sib) {
+                  memmove(&node->child[i + 2], &node->child[i + 1],
+                          (node->n - i - 1) * sizeof(ls_node *));
+                  node->child[i + 1] = sib;
+                  ++node->n;
+            }
+      }
+
+      return node->n < LS_ORDER ? NULL : node_split(ls, node);
+}
+
+static ls_node *
+node_split(line_store *ls, ls_node *node)
+{
+      unsigned const half = node->n / 2U;
+      ls_node       *sib  = new_node(ls, node->leaf);
+
+      sib->n = node->n - half;
+      memcpy(sib->child, &node->child[half], sib->n * sizeof(ls_node *));
+      node->n = half;
+
+      for (unsigned i = 0; i < sib->n; ++i) {
+            sib->count += entry_count(sib, i);
+            sib->bytes += entry_bytes(sib, i);
+      }
+      node->count -= sib->count;
+      node->bytes -= sib->bytes;
+
+      if (node->leaf) {
+            sib->next  = node->next;
+            node->next = sib;
+      }
+      return sib;
+}
+
+/* Swaps line `index' for `line', freeing the old one. Returns the old line's size. */
+static size_t
+node_replace(ls_node *node, unsigned index, bstring *line)
+{
+      size_t old;
+
+      if (node->leaf) {
+            old = node->line[index]->slen + 1U;
+            talloc_free(node->line[index]);
+            node->line[index] = line;
+      } else {
+            unsigned i = 0;
+            while (index >= node->child[i]->count) {
+                  index -= node->child[i]->count;
+                  ++i;
+            }
+            old = node_replace(node->child[i], index, line);
+      }
+
+      node->bytes = node->bytes - old + line->slen + 1U;
+      return old;
+}
+
+/* Removes line `index' below `node', returning the number of bytes it accounted for. */
+static size_t
+node_delete(line_store *ls, ls_node *node, unsigned index)
+{
+      size_t removed;
+      --node->count;
+
+      if (node->leaf) {
+            removed = node->line[index]->slen + 1U;
+            talloc_free(node->line[index]);
+            memmove(&node->line[index], &node->line[index + 1],
+                    (node->n - index - 1) * sizeof(bstring *));
+            --node->n;
+      } else {
+            unsigned i = 0;
+            while (index >= node->child[i]->count) {
+                  index -= node->child[i]->count;
+                  ++i;
+            }
+            removed = node_delete(ls, node->child[i], index);
+            if (node->child[i]->n < LS_MIN)
+                  node_rebalance(node, i);
+      }
+
+      node->bytes -= removed;
+      return removed;
+}
+
+/*
+ * Child `i' of `parent' has dropped below the minimum. Take an entry from a sibling
+ * that can spare one, or else merge the child with that sibling.
+ */
+static void
+node_rebalance(ls_node *parent, unsigned const i)
+{
+      ls_node *node = parent->child[i];
+
+      if (i > 0 && parent->child[i - 1]->n > LS_MIN) {
+            ls_node *left = parent->child[i - 1];
+            memmove(&node->child[1], &node->child[0], node->n * sizeof(ls_node *));
+            node->child[0]     = left->child[left->n - 1];
+            unsigned const cnt = entry_count(node, 0);
+            size_t const   len = entry_bytes(node, 0);
+            --left->n;
+            ++node->n;
+            left->count -= cnt;
+            node->count += cnt;
+            left->bytes -= len;
+            node->bytes += len;
+            return;
+      }
+      if (i + 1 < parent->n && parent->child[i + 1]->n > LS_MIN) {
+            ls_node *right       = parent->child[i + 1];
+            node->child[node->n] = right->child[0];
+            unsigned const cnt   = entry_count(node, node->n);
+            size_t const   len   = entry_bytes(node, node->n);
+            memmove(&right->child[0], &right->child[1], (right->n - 1) * sizeof(ls_node *));
+            --right->n;
+            ++node->n;
+            right->count -= cnt;
+            node->count  += cnt;
+            right->bytes -= len;
+            node->bytes  += len;
+            return;
+      }
+
+      /* Neither neighbour can spare anything, so merge with one of them. Both
+       * together hold at most (LS_MIN - 1) + LS_MIN entries, which fits. */
+      if (parent->n < 2)
+            return;
+      unsigned const j     = (i > 0) ? i - 1 : i;
+      ls_node       *left  = parent->child[j];
+      ls_node       *right = parent->child[j + 1];
+
+      memcpy(&left->child[left->n], right->child, right->n * sizeof(ls_node *));
+      left->n     += right->n;
+      left->count += right->count;
+      left->bytes += right->bytes;
+      if (left->leaf)
+            left->next = right->next;
+
+      memmove(&parent->child[j + 1], &parent->child[j + 2],
+              (parent->n - j - 2) * sizeof(ls_node *));
+      --parent->n;
+      talloc_free(right);
+}
+
+/*======================================================================================*/
+
+static ls_textbuf *
+text_new(size_t const cap)
+{
+      ls_textbuf *tb = malloc(offsetof(ls_textbuf, data) + cap);
+      atomic_init(&tb->refs, 1);
+      tb->cap     = cap;
+      tb->gap     = 0;
+      tb->gap_len = cap;
+      return tb;
+}
+
+static void
+text_release(ls_textbuf *tb)
+{
+      if (atomic_fetch_sub_explicit(&tb->refs, 1, memory_order_acq_rel) == 1)
+            free(tb);
+}
+
+/*
+ * Replace `oldlen' bytes at `off' with the lines in `repl'. The gap is moved to the
+ * edit, so a run of edits close together only shifts the bytes between them.
+ */
+static void
+text_replace(line_store *ls, size_t const off, size_t const oldlen, b_list const *repl)
+{
+      size_t need = 1; /* Always leave room to terminate a snapshot. */
+      if (repl)
+            for (unsigned i = 0; i < repl->qty; ++i)
+                  need += repl->lst[i]->slen + 1U;
+
+      ls_textbuf *tb = ls->text;
+
+      /* Somebody is still reading this text; leave it to them and carry on with a
+       * private copy. */
+      if (atomic_load_explicit(&tb->refs, memory_order_acquire) > 1 || tb->gap_len < need)
+            tb = ls->text = text_regap(tb, need);
+
+      text_move_gap(tb, off);
+      tb->gap_len += oldlen;
+
+      if (repl) {
+            for (unsigned i = 0; i < repl->qty; ++i) {
+                  bstring const *line = repl->lst[i];
+                  memcpy(tb->data + tb->gap, line->data, line->slen);
+                  tb->gap += line->slen;
+                  tb->data[tb->gap++] = '\n';
+                  tb->gap_len -= line->slen + 1U;
+            }
+      }
+}
+
+static void
+text_move_gap(ls_textbuf *tb, size_t const pos)
+{
+      if (pos < tb->gap)
+            memmove(tb->data + pos + tb->gap_len, tb->data + pos, tb->gap - pos);
+      else if (pos > tb->gap)
+            memmove(tb->data + tb->gap, tb->data + tb->gap + tb->gap_len, pos - tb->gap);
+      tb->gap = pos;
+}
+
+/*
+ * Copy the text into a new buffer whose gap, at the same position, has room for at
+ * least `need' bytes, then drop the store's reference to the old one.
+ */
+static ls_textbuf *
+text_regap(ls_textbuf *tb, size_t const need)
+{
+      size_t const len  = tb->cap - tb->gap_len;
+      size_t const tail = len - tb->gap;
+      size_t       cap  = len + need + LS_TEXT_SLACK;
+
+      if (cap < len * 2U)
+            cap = len * 2U;
+
+      ls_textbuf *ret = text_new(cap);
+      memcpy(ret->data, tb->data, tb->gap);
+      memcpy(ret->data + cap - tail, tb->data + tb->gap + tb->gap_len, tail);
+      ret->gap     = tb->gap;
+      ret->gap_len = cap - len;
+
+      text_release(tb);
+      return ret;
+}
@@ -0,0 +1,65 @@
+#ifndef SRC_UTIL_LINE_STORE_H_
+#define SRC_UTIL_LINE_STORE_H_
+
+#include "Common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/*======================================================================================*/
+
+/*
+ * The lines of a buffer, kept in a counted B+ tree. Lookup by line number and the
+ * insertion or removal of a line are O(log n) regardless of where in the buffer the
+ * edit happens, and in-order iteration walks the linked leaves. Every line stored is
+ * owned by the store and freed along with it.
+ *
+ * The store also keeps the text of the whole buffer, each line followed by a newline,
+ * in a gap buffer that is edited in place as lines change. ls_text() hands out that
+ * text without copying it. The snapshot stays valid and unchanged until it is freed;
+ * an edit made while a snapshot is alive moves the store onto a fresh copy instead.
+ * Since every node also counts the bytes below it, converting between line numbers
+ * and offsets into that text is O(log n) as well.
+ */
+
+typedef struct line_store line_store;
+typedef struct ls_node    ls_node;
+typedef struct ls_textbuf ls_textbuf;
+
+struct line_store {
+        ls_node        *root;
+        ls_textbuf     *text;
+        unsigned        qty;
+        pthread_mutex_t lock;
+};
+
+typedef struct {
+        ls_node *leaf;
+        unsigned pos;
+} ls_iter;
+
+extern line_store *ls_create    (void *talloc_ctx) __aWUR;
+extern bstring    *ls_get       (line_store *ls, unsigned index) __aWUR;
+extern void        ls_splice    (line_store *ls, unsigned first, unsigned last, b_list *repl);
+extern void        ls_append    (line_store *ls, bstring *line);
+extern bstring    *ls_text      (line_store *ls, void *talloc_ctx) __aWUR;
+extern size_t      ls_line_offset (line_store *ls, unsigned line);
+extern unsigned    ls_offset_line (line_store *ls, size_t offset, unsigned *column);
+extern bstring    *ls_iter_init (line_store const *ls, ls_iter *it, unsigned index);
+extern bstring    *ls_iter_next (ls_iter *it);
+
+/*
+ * Iterate over every line from the first. Breaking out of the loop is fine; the
+ * outer loop only exists to scope the iterator.
+ */
+#define LS_FOREACH(LS, VAR)                                                               \
+        for (struct { ls_iter it; bool once; } VAR##_ls_ = {{NULL, 0}, true};             \
+             VAR##_ls_.once; VAR##_ls_.once = false)                                      \
+                for (bstring *VAR = ls_iter_init((LS), &VAR##_ls_.it, 0); (VAR) != NULL; \
+                     (VAR) = ls_iter_next(&VAR##_ls_.it))
+
+/*======================================================================================*/
+#ifdef __cplusplus
+}
+#endif
+#endif /* line_store.h */
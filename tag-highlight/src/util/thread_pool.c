@@ -0,0 +1,178 @@
+#include "Common.h"
+#include "util/thread_pool.h"
+
+struct pool_task {
+      thread_pool_task_fn *fn;
+      void                *arg;
+      struct timespec      queued;
+      struct pool_task    *next;
+};
+
+struct thread_pool {
+      pthread_mutex_t   mtx;
+      pthread_cond_t    cond;
+      struct pool_task *head;
+      struct pool_task *tail;
+      char const       *name;
+      unsigned          nthreads;
+
+      struct {
+            atomic_uint_least64_t submitted;
+            atomic_uint_least64_t completed;
+            atomic_uint_least64_t total_wait_ns;
+            atomic_uint_least64_t max_wait_ns;
+            atomic_uint           depth;
+            atomic_uint           max_depth;
+      } stats;
+};
+
+static NORETURN void *pool_worker(void *vdata);
+static uint64_t       timespec_diff_ns(struct timespec const *a, struct timespec const *b);
+
+/*======================================================================================*/
+
+thread_pool *
+thread_pool_create(unsigned nthreads, char const *name)
+{
+      thread_pool *pool = calloc(1, sizeof(thread_pool));
+      if (nthreads == 0)
+            nthreads = 1;
+
+      pool->name     = name;
+      pool->nthreads = nthreads;
+      pthread_mutex_init(&pool->mtx);
+      pthread_cond_init(&pool->cond, NULL);
+
+      for (unsigned i = 0; i < nthreads; ++i)
+            START_DETACHED_PTHREAD(pool_worker, pool);
+
+      return pool;
+}
+
+void
+thread_pool_submit(thread_pool *pool, thread_pool_task_fn *fn, void *arg)
+{
+      struct pool_task *task = malloc(sizeof(struct pool_task));
+      task->fn   = fn;
+      task->arg  = arg;
+      task->next = NULL;
+      clock_gettime(CLOCK_MONOTONIC, &task->queued);
+
+      pthread_mutex_lock(&pool->mtx);
+      if (pool->tail)
+            pool->tail->next = task;
+      else
+            pool->head = task;
+      pool->tail = task;
+      pthread_mutex_unlock(&pool->mtx);
+
+      unsigned const depth = atomic_fetch_add_explicit(&pool->stats.depth, 1, memory_order_relaxed) + 1;
+      unsigned       max   = atomic_load_explicit(&pool->stats.max_depth, memory_order_relaxed);
+      while (depth > max && !atomic_compare_exchange_weak(&pool->stats.max_depth, &max, depth))
+            ;
+      atomic_fetch_add_explicit(&pool->stats.submitted, 1, memory_order_relaxed);
+
+      pthread_cond_signal(&pool->cond);
+}
+
+/*
+ * Remove every task calling `fn' with `arg' that is still waiting in the queue and
+ * return how many there were. A task that a worker has already taken is left alone.
+ */
+unsigned
+thread_pool_cancel(thread_pool *pool, thread_pool_task_fn *fn, void *arg)
+{
+      struct pool_task **link = &pool->head;
+      struct pool_task  *prev = NULL;
+      unsigned           n    = 0;
+
+      pthread_mutex_lock(&pool->mtx);
+      while (*link) {
+            struct pool_task *task = *link;
+            if (task->fn == fn && task->arg == arg) {
+                  *link = task->next;
+                  free(task);
+                  ++n;
+            } else {
+                  prev = task;
+                  link = &task->next;
+            }
+      }
+      pool->tail = prev;
+      pthread_mutex_unlock(&pool->mtx);
+
+      if (n > 0)
+            atomic_fetch_sub_explicit(&pool->stats.depth, n, memory_order_relaxed);
+      return n;
+}
+
+static NORETURN void *
+pool_worker(void *vdata)
+{
+      thread_pool *pool = vdata;
+
+      for (;;) {
+            struct pool_task *task;
+            struct timespec   now;
+
+            pthread_mutex_lock(&pool->mtx);
+            while (!pool->head)
+                  pthread_cond_wait(&pool->cond, &pool->mtx);
+            task       = pool->head;
+            pool->head = task->next;
+            if (!pool->head)
+                  pool->tail = NULL;
+            pthread_mutex_unlock(&pool->mtx);
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            uint64_t const wait = timespec_diff_ns(&task->queued, &now);
+            uint64_t       max  = atomic_load_explicit(&pool->stats.max_wait_ns, memory_order_relaxed);
+            while (wait > max && !atomic_compare_exchange_weak(&pool->stats.max_wait_ns, &max, wait))
+                  ;
+            atomic_fetch_add_explicit(&pool->stats.total_wait_ns, wait, memory_order_relaxed);
+            atomic_fetch_sub_explicit(&pool->stats.depth, 1, memory_order_relaxed);
+
+            task->fn(task->arg);
+            free(task);
+
+            atomic_fetch_add_explicit(&pool->stats.completed, 1, memory_order_relaxed);
+      }
+}
+
+/*======================================================================================*/
+
+void
+thread_pool_get_stats(thread_pool *pool, struct thread_pool_stats *stats)
+{
+      stats->submitted     = atomic_load_explicit(&pool->stats.submitted, memory_order_relaxed);
+      stats->completed     = atomic_load_explicit(&pool->stats.completed, memory_order_relaxed);
+      stats->total_wait_ns = atomic_load_explicit(&pool->stats.total_wait_ns, memory_order_relaxed);
+      stats->max_wait_ns   = atomic_load_explicit(&pool->stats.max_wait_ns, memory_order_relaxed);
+      stats->depth         = atomic_load_explicit(&pool->stats.depth, memory_order_relaxed);
+      stats->max_depth     = atomic_load_explicit(&pool->stats.max_depth, memory_order_relaxed);
+      stats->nthreads      = pool->nthreads;
+}
+
+void
+thread_pool_report_stats(thread_pool *pool)
+{
+      struct thread_pool_stats st;
+      thread_pool_get_stats(pool, &st);
+
+      double const avg = st.completed
+                           ? ((double)st.total_wait_ns / (double)st.completed) / 1000.0
+                           : 0.0;
+
+      warnd("Thread pool \"%s\" (%u threads): %" PRIu64 " tasks queued, %" PRIu64
+            " completed, queue depth %u (max %u), wait avg %.1fus max %.1fus",
+            pool->name, st.nthreads, st.submitted, st.completed, st.depth,
+            st.max_depth, avg, (double)st.max_wait_ns / 1000.0);
+}
+
+static uint64_t
+timespec_diff_ns(struct timespec const *a, struct timespec const *b)
+{
+      int64_t const ns = ((int64_t)(b->tv_sec - a->tv_sec) * (int64_t)NSEC2SECOND) +
+                         (int64_t)(b->tv_nsec - a->tv_nsec);
+      return ns > 0 ? (uint64_t)ns : 0;
+}
@@ -0,0 +1,40 @@
+#ifndef SRC_UTIL_THREAD_POOL_H_
+#define SRC_UTIL_THREAD_POOL_H_
+
+#include "Common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/*======================================================================================*/
+
+/*
+ * A fixed size pool of worker threads fed from a single FIFO task queue. Tasks are
+ * plain functions taking one argument; they must not call pthread_exit(), or the
+ * pool loses a worker.
+ */
+
+typedef void (thread_pool_task_fn)(void *arg);
+typedef struct thread_pool thread_pool;
+
+struct thread_pool_stats {
+        uint64_t submitted;     /* Total number of tasks ever queued. */
+        uint64_t completed;     /* Total number of tasks that have returned. */
+        uint64_t total_wait_ns; /* Cumulative time tasks spent queued before running. */
+        uint64_t max_wait_ns;   /* Longest time any single task spent queued. */
+        unsigned depth;         /* Number of tasks currently waiting in the queue. */
+        unsigned max_depth;     /* High water mark of `depth'. */
+        unsigned nthreads;
+};
+
+extern thread_pool *thread_pool_create(unsigned nthreads, char const *name) __aWUR;
+extern void         thread_pool_submit(thread_pool *pool, thread_pool_task_fn *fn, void *arg);
+extern unsigned     thread_pool_cancel(thread_pool *pool, thread_pool_task_fn *fn, void *arg);
+extern void         thread_pool_get_stats(thread_pool *pool, struct thread_pool_stats *stats);
+extern void         thread_pool_report_stats(thread_pool *pool);
+
+/*======================================================================================*/
+#ifdef __cplusplus
+}
+#endif
+#endif /* thread_pool.h */
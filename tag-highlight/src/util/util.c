@@ -197,6 +197,18 @@ find_num_cpus(void)
 #endif
 }
 
+/* 64 bit FNV-1a. Start with FNV1A_OFFSET_BASIS, or continue from an earlier hash. */
+uint64_t
+fnv1a(uint64_t hash, void const *data, size_t const len)
+{
+      uint8_t const *ptr = data;
+      for (size_t i = 0; i < len; ++i) {
+            hash ^= ptr[i];
+            hash *= FNV1A_PRIME;
+      }
+      return hash;
+}
+
 
 #if defined(__GNUC__) && !defined(__clang__) && !defined(__cplusplus)
 char const *
@@ -164,6 +164,9 @@ struct timer {
 #define STRINGIFY_HLP(...) #__VA_ARGS__
 #define STRINGIFY(...)     STRINGIFY_HLP(__VA_ARGS__)
 
+#define FNV1A_OFFSET_BASIS UINT64_C(0xCBF29CE484222325)
+#define FNV1A_PRIME        UINT64_C(0x100000001B3)
+
 /**
  * Silly convenience macro for assertions that should _always_ be checked regardless of
  * release type. Saves an if statement.
@@ -189,6 +192,7 @@ NORETURN extern void err_(int status, bool print_err, char const *restrict file,
 extern void     free_all__    (void *ptr, ...);
 extern int64_t  xatoi__       (char const *str, bool strict);
 extern unsigned find_num_cpus (void);
+extern uint64_t fnv1a         (uint64_t hash, void const *data, size_t len);
 ND extern FILE *fopen_fmt     (char const *restrict mode, char const *restrict fmt, ...) __aNN(1, 2) __aFMT(2, 3);
 ND extern FILE *safe_fopen    (char const *filename, char const *mode) __aNN(1, 2);
 ND extern FILE *safe_fopen_fmt(char const *mode, char const *fmt, ...) __aNN(1, 2) __aFMT(2,3);